@@ -3,6 +3,7 @@
 #include <stdio.h>
 
 extern int ush_argv(int, const char * const *av);
+extern void flight_init(void);
 
 static const char *program_path;
 static const char *program_name;
@@ -14,6 +15,7 @@ main(int argc, const char * const *argv)
 
     program_path = *argv;
     program_name = sname(program_path);
+    flight_init();
     rv = ush_argv(argc, argv);
     dbg_printf("main: rv=%d\n", rv);
     return (rv);
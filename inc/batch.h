@@ -0,0 +1,236 @@
+/*
+ * Filename: batch.h
+ * Brief: Jobs of a --batch run, and the collector of their output
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <ush.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+// --output-prefix
+//
+#define OUTPUT_PREFIX_TAG   1
+#define OUTPUT_PREFIX_TIME  2
+#define OUTPUT_PREFIX_NONE  4
+
+/*
+ * Output of one stream (stdout or stderr) of one job,
+ * already prefixed, that has not yet been written downstream.
+ */
+struct out_buf {
+    char   *buf;
+    size_t len;         // Bytes in buf
+    size_t cap;
+    size_t off;         // Bytes of buf already handed to the writer
+    bool   bol;         // The next byte read starts a new line
+    bool   pinned;      // The writer holds pointers into buf
+    FILE   *spill;      // Older output, beyond the in-memory limit
+};
+
+struct batch_job;
+
+/*
+ * What an epoll event is about.
+ */
+struct job_ref {
+    struct batch_job *job;
+    int    which;       // 0 for the pidfd, 1 or 2 for the pipe
+};
+
+/*
+ * A job that is running, or whose output is held.  Made when the job
+ * is started, and let go of once its output has been written.
+ */
+struct batch_job {
+    unsigned int id;    // Position in the manifest, from 1; the job tag
+    int    argc;
+    char   **argv;      // Pointers into the job table's string pool
+    cmd_t  *cmd;        // Until the job is reaped
+    int    fd[3];       // Our ends of the child's stdout and stderr pipes;
+                        // fd[0] is the child's end of its stdin pipe, if any,
+                        // until it is started
+    struct job_ref ref[3];
+    struct out_buf out[3];
+    bool   exited;
+    bool   done;
+    bool   killed;      // --timeout: SIGKILL was sent
+    int    status;
+    unsigned long long deadline;    // --timeout: when to signal it next, or 0
+    struct batch_job *run_prev;     // --timeout: on the list of running jobs
+    struct batch_job *run_next;
+    struct batch_job *next_free;    // On the collector's list to let go of
+};
+
+/*
+ * All of the jobs of a manifest, compactly.  Each distinct argument
+ * is stored once, in a string pool; a job is a range of |args|,
+ * which are offsets into the pool.  Nothing is kept per job but that,
+ * and a few flags; so, some millions of jobs take some tens of bytes each.
+ */
+#define JOB_SKIP          1     // Not to be run: another shard's, or already done
+#define JOB_JOURNAL_DONE  2     // The journal says it exited 0
+#define JOB_DONE          4     // Finished, failed to start, or skipped
+
+struct job_ent {
+    uint32_t arg;               // First argument, in |args|
+    uint32_t argc  : 24;
+    uint32_t flags : 8;
+};
+
+struct job_table {
+    char   *pool;               // Strings, each with its '\0'
+    size_t pool_len;
+    size_t pool_cap;
+    uint32_t *hash;             // Open addressing; pool offset + 1, or 0
+    size_t hash_cap;            // A power of 2
+    size_t nstr;
+    uint32_t *args;
+    size_t nargs;
+    size_t args_cap;
+    uint32_t job_arg;           // First argument of the job being added
+    struct job_ent *job;
+    unsigned int njobs;
+    unsigned int cap;
+    struct batch_job **live;    // By index; only if asked for
+};
+
+#define WRITER_IOV 256
+
+/*
+ * Downstream: ush's own fd 1 or fd 2.
+ * Output is gathered, as pointers into job buffers, then written
+ * with one writev().
+ */
+struct writer {
+    int    fd;
+    struct iovec iov[WRITER_IOV];
+    int    niov;
+    struct out_buf *pinned[WRITER_IOV];
+    int    npinned;
+};
+
+struct collector {
+    int    epfd;
+    bool   keep_order;
+    unsigned int prefix;
+    size_t spill_limit;
+    struct job_table *tab;
+    unsigned int head;  // With keep_order, the one job that goes out live
+    struct batch_job *free_list;    // Done with, after the next flush
+    struct writer w[3];
+};
+
+/*
+ * --broadcast-stdin
+ */
+struct bc_out {
+    int    stage[2];    // Private pipe, filled by tee()
+    int    dst;         // Write end of the job's stdin
+};
+
+struct broadcast {
+    int    in;          // The source pipe: fd 0, or fill[0]
+    int    fill[2];     // Pipe from fd 0, if fd 0 is not a pipe,
+                        // or is a bigger pipe than the stage pipes can be
+    int    fill_sz;     // How much fill[] holds
+    int    stop[2];     // Closed, to stop the thread
+    unsigned int n;
+    unsigned int alive;
+    struct bc_out *out;
+    pthread_t thread;
+    bool   running;
+    struct sigaction saved_sigpipe;
+};
+
+/*
+ * --jobs=auto
+ */
+#define ADAPT_PSI 3     // cpu, memory, io
+
+struct adapt {
+    bool   on;
+    bool   verbose;
+    bool   mem_tight;       // Start nothing more, for now
+    unsigned int limit;     // How many jobs may run now
+    unsigned int max;
+    unsigned int pct;       // --pressure-limit
+    unsigned long long mem_reserve;
+    unsigned long long tick_ns;
+    int    psi_fd[ADAPT_PSI];       // /proc/pressure/*, or -1
+    unsigned long long psi_total[ADAPT_PSI];
+    int    meminfo_fd;
+};
+
+/*
+ * --journal
+ */
+struct journal {
+    int    fd;
+    char   *buf;        // Lines not yet written
+    size_t len;
+    size_t cap;
+    bool   need_nl;     // The file ends in a line cut short
+};
+
+extern void jobtab_init(struct job_table *);
+extern int jobtab_add_arg(struct job_table *, const char *arg, size_t len);
+extern void jobtab_end_job(struct job_table *);
+extern const char *jobtab_arg(struct job_table *, unsigned int i, unsigned int a);
+extern char **jobtab_argv(struct job_table *, unsigned int i);
+extern void jobtab_index_live(struct job_table *);
+extern struct batch_job *job_alloc(struct job_table *, unsigned int i);
+extern void job_free(struct job_table *, struct batch_job *);
+extern void jobtab_free(struct job_table *);
+
+extern int collect_init(struct collector *, cmd_t *, struct job_table *);
+extern int collect_add(struct collector *, struct batch_job *);
+extern bool collect_read(struct collector *, struct batch_job *, int fd);
+extern void collect_close(struct collector *, struct batch_job *, int fd);
+extern void collect_done(struct collector *, struct batch_job *);
+extern void collect_skip(struct collector *, unsigned int i);
+extern void collect_flush(struct collector *);
+extern void collect_fini(struct collector *);
+
+extern void adapt_init(struct adapt *, cmd_t *, unsigned int ncpu);
+extern int adapt_timeout(struct adapt *);
+extern void adapt_tick(struct adapt *, unsigned int running);
+extern bool adapt_may_start(struct adapt *, unsigned int running);
+extern void adapt_fini(struct adapt *);
+
+extern int journal_open(struct journal *, cmd_t *, struct job_table *);
+extern void journal_add(struct journal *, struct job_table *, struct batch_job *);
+extern void journal_flush(struct journal *);
+extern void journal_close(struct journal *);
+
+extern int broadcast_prepare(struct broadcast *, struct job_table *);
+extern int broadcast_start(struct broadcast *);
+extern void broadcast_finish(struct broadcast *);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* _BATCH_H */
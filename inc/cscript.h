@@ -62,7 +62,12 @@ extern FILE *dbgprint_fh;
 #define dbg_print(str) fputs((str), dbgprint_fh)
 #define dbg_putchar(c) putc((c), dbgprint_fh)
 
-#if defined(__GNUC__)
+#if defined(NDEBUG)
+
+// Release build: no debug output, and no cost, not even a test of |debug|
+#define dbg_printf(fmt, ...) ((void)0)
+
+#elif defined(__GNUC__)
 
 #define dbg_printf(fmt, ...) \
     ({ if (debug) { fprintf(dbgprint_fh, (fmt), ## __VA_ARGS__); }; })
@@ -121,6 +126,9 @@ extern char * decode_esym_r(char *buf, size_t sz, int err);
 extern ssize_t qp_decode_str(char *buf, size_t sz, const char *str);
 extern ssize_t qp_encode_str(char *buf, size_t sz, char *str);
 extern int     close_from(int fd);
+extern bool    isnumeric(const char *str);
+extern unsigned long long mono_ns(void);
+extern int     write_all(int fd, const void *buf, size_t len);
 
 extern void   fshow_svar(FILE *f, const char *var, const char *value);
 extern void   dbg_show_svar(const char *var, const char *value);
@@ -0,0 +1,84 @@
+/*
+ * Filename: trace.h
+ * Brief: Tracepoints in the launch path: USDT probes, and --trace
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <sys/types.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#ifdef USH_USDT
+#include <sys/sdt.h>
+#define USH_PROBE1(name, a)     DTRACE_PROBE1(ush, name, a)
+#define USH_PROBE2(name, a, b)  DTRACE_PROBE2(ush, name, a, b)
+#else
+#define USH_PROBE1(name, a)     do { } while (0)
+#define USH_PROBE2(name, a, b)  do { } while (0)
+#endif
+
+// Trace-event phases
+//
+#define TRACE_BEGIN   'B'
+#define TRACE_END     'E'
+#define TRACE_INSTANT 'i'
+#define TRACE_FAIL    'F'     // Flight recorder only
+
+extern int trace_fd;
+
+extern int trace_open(const char *fname);
+extern void trace_str(int ph, const char *name, const char *key, const char *val);
+extern void trace_num(int ph, const char *name, const char *key, long long val);
+extern void trace_span(const char *name, pid_t pid,
+                unsigned long long start_ns, unsigned long long end_ns);
+extern void trace_process_name(const char *name);
+
+extern void flight_event(int ph, const char *name, long long num, const char *str, int err);
+extern void flight_dump(const char *why, int err);
+extern void flight_fail(const char *what, int err);
+extern void flight_user_fail(const char *what, int err, int dump);
+extern void flight_init(void);
+
+/*
+ * Probe, flight record, and --trace event, with one string, or one number.
+ */
+#define TRACE_STR(probe, ph, name, key, val) \
+    do { \
+        USH_PROBE1(probe, val); \
+        flight_event(ph, name, 0, val, 0); \
+        if (trace_fd >= 0) { \
+            trace_str(ph, name, key, val); \
+        } \
+    } while (0)
+
+#define TRACE_NUM(probe, ph, name, key, val) \
+    do { \
+        USH_PROBE1(probe, val); \
+        flight_event(ph, name, (long long)(val), NULL, 0); \
+        if (trace_fd >= 0) { \
+            trace_num(ph, name, key, (long long)(val)); \
+        } \
+    } while (0)
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* _TRACE_H */
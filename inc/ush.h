@@ -6,12 +6,46 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #include <stdio.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <errno.h>
 
+/*
+ * In-memory I/O, for library callers.  See ush_io().
+ */
+struct ush_io {
+    // IN
+    const void *stdin_buf;      // Feed this to the child as stdin, or NULL
+    size_t stdin_len;
+    bool   capture_stdout;
+    bool   capture_stderr;
+
+    // OUT -- read-only mappings; give them back with ush_io_free()
+    void   *stdout_buf;
+    size_t stdout_len;
+    void   *stderr_buf;
+    size_t stderr_len;
+};
+
+typedef struct ush_io ush_io_t;
+
+#define USH_PERF_MAX 10     // Events known to --perf-stat
+#define USH_CPUS_MAX 1024   // CPUs known to --cpus
+#define USH_NODES_MAX 1024  // NUMA nodes known to --numa-node
+
+// The order in which --batch starts jobs
+//
+enum job_order {
+    JOB_ORDER_DEFAULT,      // longest, with --history; otherwise, file
+    JOB_ORDER_FILE,
+    JOB_ORDER_LONGEST,
+    JOB_ORDER_SHORTEST,
+};
+
 struct cmd {
     int argc;
     char **argv;
@@ -33,15 +67,171 @@ struct cmd {
     bool  child_stderr_new;
     int   ioerr;
     bool  surprise;
+    bool  readahead_auto;
+    ush_io_t *io;
+    int   child_fd[3];      // Put these in place as fd 0, 1, 2 in the child
+    bool  child_fd_plan;    // ... if set.  -1 means leave that fd alone.
+
+    // Benchmark -- run the prepared command repeatedly
+    unsigned int repeat;
+    unsigned int warmup;
+    char *repeat_hook;
+    bool  repeat_json;
+
+    // Admission control -- hold one of N host-wide slots while running
+    char *limit_key;
+    unsigned int limit_slots;
+    int   limit_fd;
+    bool  limit_held;
+
+    // CPU and memory placement -- set in the child, before exec()
+    bool  cpus_set;
+    unsigned long cpus[USH_CPUS_MAX / (8 * sizeof (unsigned long))];
+    bool  numa_set;
+    int   numa_mode;
+    unsigned long numa_nodes[USH_NODES_MAX / (8 * sizeof (unsigned long))];
+    bool  thp_set;
+    bool  thp_disable;
+
+    // Scheduling and resource limits -- set in the child, before exec()
+    bool  sched_set;
+    int   sched_policy;
+    int   sched_priority;
+    bool  nice_set;
+    int   nice;
+    int   ioprio;                   // IOPRIO_PRIO_VALUE(); 0 for none
+    unsigned int rlimit_set;        // Bit mask, by RLIMIT_*
+    struct rlimit rlimit[RLIM_NLIMITS];
+    bool  oom_score_set;
+    int   oom_score_adj;
+
+    // Transient cgroup v2, with resource limits
+    char *cgroup_parent;
+    char *cgroup_memory_max;
+    char *cgroup_pids_max;
+    char  cgroup_cpu_max[64];
+    char  cgroup_io_weight[32];
+    char  cgroup_path[4096];
+    int   cgroup_fd;
+
+    // Time limit
+    unsigned long long timeout_ns;
+    unsigned long long kill_after_ns;
+    int   timeout_signal;
+    bool  own_pgrp;     // --batch: the child gets a process group of its own
+
+    // Tee -- copy the child's stdout / stderr to more files
+    int   *tee_dest[3];
+    size_t tee_count[3];
+    int   tee_src[3];
+    int   tee_tmp[2];
+
+    // Compression of the child's stdout / stderr
+    int   compress_algo[3];
+    int   compress_level[3];
+    unsigned int compress_threads;
+    int   compress_src[3];
+    void  *compress_stream[3];
+
+    // Ring files -- keep only the newest output, in a fixed-size file
+    void  *ring[3];
+    int   ring_src[3];
+
+    // Supervisor -- restart the child whenever it exits
+    bool  supervise;
+    unsigned long long restart_delay_ns;
+    unsigned long long restart_delay_max_ns;
+    unsigned int restart_limit;
+    unsigned long long restart_window_ns;
+    int   ready_fd;
+
+    // Batch -- run the jobs in a manifest, some number at a time
+    char *batch_manifest;
+    unsigned int batch_jobs;
+    bool  batch_adaptive;           // --jobs=auto; batch_jobs is the most
+    unsigned int pressure_pct;
+    unsigned long long mem_reserve;
+    char *journal_file;
+    unsigned int shard_index;       // From 1; 0 for no --shard
+    unsigned int shard_count;
+    bool  output_keep_order;
+    unsigned int output_prefix;
+    size_t output_spill;
+    bool  broadcast_stdin;
+    unsigned int job_order;         // JOB_ORDER_*; 0 for the default
+
+    // Exit report
+    bool  report;
+
+    // Performance counters -- perf_event_open(), on the child
+    unsigned int perf_events;   // Bit mask of the events to count
+    int   perf_go[2];           // The child waits on this, for the counters
+    int   perf_fd[USH_PERF_MAX];
+    unsigned int perf_have;     // Bit mask of the counts we got
+    unsigned long long perf_count[USH_PERF_MAX];
+
+    // Sampling of the child's /proc files, over time
+    unsigned long long sample_ns;   // Interval; 0 for none
+    int   sample_fd;                // CSV output
+    bool  sample_tree;              // Add up descendants, too
+    int   sample_tfd;               // timerfd
+    int   sample_proc[3];           // The child's /proc stat, status, io
+
+    // Run-time history -- one record per child, for --batch job order
+    char *history_file;
+    int   history_fd;
+
+    // Shared metrics
+    bool  metrics_started;  // Time to first launch is recorded
 
     // State
+    unsigned long long start_ns;    // When ush started on this command
     pid_t child;
+    int child_pidfd;
+    bool helper;                    // Started by the spawn helper
+    int helper_fd;                  // The wait status comes on this
+    bool timed_out;
+    int ready_rfd;
+    int ready_wfd;
+    bool child_ready;
     int child_status;
+    struct rusage child_rusage;
+    unsigned long long child_start_ns;
+    unsigned long long child_end_ns;
+    unsigned long long cg_memory_peak;
+    unsigned long long cg_usage_usec;
+    unsigned long long cg_user_usec;
+    unsigned long long cg_system_usec;
+    unsigned long long cg_nr_throttled;
+    unsigned long long cg_throttled_usec;
+    bool  cg_have_memory_peak;
+    bool  cg_have_cpu_stat;
     int rc;
 };
 
 typedef struct cmd cmd_t;
 
+/*
+ * A running child, with pipes to its stdin, stdout and stderr.
+ * See ush_popen2().
+ */
+enum ush_pipe {
+    USH_PIPE_STDIN  = 1,
+    USH_PIPE_STDOUT = 2,
+    USH_PIPE_STDERR = 4,
+};
+
+struct ush_proc {
+    pid_t pid;
+    int   pidfd;        // Becomes readable when the child exits
+    int   stdin_fd;     // Write end of the child's stdin, or -1
+    int   stdout_fd;    // Read end of the child's stdout, or -1
+    int   stderr_fd;    // Read end of the child's stderr, or -1
+    cmd_t *cmd;         // Private
+};
+
+typedef struct ush_proc ush_proc_t;
+
 enum encoding {
     ENC_INVALID,
     ENC_TEXT,
@@ -58,15 +248,165 @@ extern int cmd_chdir(cmd_t *, const char *dir);
 extern int cmd_umask(cmd_t *, const char *mask);
 extern int cmd_clearenv(cmd_t *, const char *arg);
 extern int cmd_env(cmd_t *, const char *arg);
+extern int cmd_cpus(cmd_t *, const char *list);
+extern int cmd_numa_node(cmd_t *, const char *arg);
+extern int cmd_thp(cmd_t *, const char *arg);
+extern int cmd_sched(cmd_t *, const char *arg);
+extern int cmd_nice(cmd_t *, const char *arg);
+extern int cmd_ioprio(cmd_t *, const char *arg);
+extern int cmd_rlimit(cmd_t *, const char *arg);
+extern int cmd_oom_score_adj(cmd_t *, const char *arg);
+extern int cpus_apply(cmd_t *);
+extern int mempolicy_apply(cmd_t *);
+extern int sched_apply(cmd_t *);
+extern int rlimit_apply(cmd_t *);
 extern int set_stdin (cmd_t *, const char *fname);
 extern int set_stdout(cmd_t *, const char *fname, bool append, bool new_file);
 extern int set_stderr(cmd_t *, const char *fname, bool append, bool new_file);
 extern int ush_close_from(const char *start_fd);
+extern int cmd_readahead(cmd_t *, const char *arg);
+extern void readahead_program(const char *cmd_path);
+extern void readahead_exec(cmd_t *);
+extern void readahead_wait(void);
+
+extern int io_memfd_open(cmd_t *, ush_io_t *io);
+extern void io_memfd_child_setup(cmd_t *);
+extern int io_memfd_collect(cmd_t *);
+extern void io_memfd_close(cmd_t *);
+
+extern int cmd_stdout_tee(cmd_t *, const char *fname);
+extern int cmd_stderr_tee(cmd_t *, const char *fname);
+extern int tee_prepare(cmd_t *);
+extern void tee_parent_setup(cmd_t *);
+extern bool tee_pump(cmd_t *, int fd);
+extern void tee_finish(cmd_t *);
+
+extern int cmd_stdout_compress(cmd_t *, const char *arg);
+extern int cmd_stderr_compress(cmd_t *, const char *arg);
+extern int cmd_compress_threads(cmd_t *, const char *arg);
+extern int compress_prepare(cmd_t *);
+extern void compress_parent_setup(cmd_t *);
+extern int compress_finish(cmd_t *);
+
+extern int cmd_stdout_ring(cmd_t *, const char *arg);
+extern int cmd_stderr_ring(cmd_t *, const char *arg);
+extern int ring_prepare(cmd_t *);
+extern void ring_parent_setup(cmd_t *);
+extern bool ring_pump(cmd_t *, int fd);
+extern void ring_finish(cmd_t *);
+extern int ring_dump(const char *fname, int fd);
+
+extern int cmd_repeat(cmd_t *, const char *count);
+extern int cmd_warmup(cmd_t *, const char *count);
+extern int cmd_repeat_format(cmd_t *, const char *fmt);
+extern int cmd_limit(cmd_t *, const char *key_slots);
+extern int limit_acquire(cmd_t *);
+extern void limit_release(cmd_t *);
+
+extern int cmd_cgroup(cmd_t *, const char *dir);
+extern int cmd_memory_max(cmd_t *, const char *arg);
+extern int cmd_cpu_max(cmd_t *, const char *arg);
+extern int cmd_io_weight(cmd_t *, const char *arg);
+extern int cmd_pids_max(cmd_t *, const char *arg);
+extern int cgroup_create(cmd_t *);
+extern pid_t cgroup_fork(cmd_t *);
+extern void cgroup_destroy(cmd_t *);
+extern void cgroup_kill(cmd_t *);
+extern int cmd_timeout(cmd_t *, const char *arg);
+extern int cmd_kill_after(cmd_t *, const char *arg);
+extern int cmd_signal(cmd_t *, const char *arg);
+extern int parse_signal(const char *str);
+extern void timeout_prepare(cmd_t *);
+extern void timeout_child_setup(cmd_t *);
+extern void timeout_parent_setup(cmd_t *);
+extern void timeout_kill(cmd_t *, int sig);
+extern void timeout_teardown(cmd_t *);
+extern int timeout_signalfd(void);
+extern void timeout_signalfd_close(int sfd);
+
+extern int cmd_supervise(cmd_t *);
+extern int cmd_restart_delay(cmd_t *, const char *arg);
+extern int cmd_restart_delay_max(cmd_t *, const char *arg);
+extern int cmd_restart_limit(cmd_t *, const char *arg);
+extern int cmd_ready_fd(cmd_t *, const char *arg);
+extern int ready_prepare(cmd_t *);
+extern void ready_child_setup(cmd_t *);
+extern void ready_parent_setup(cmd_t *);
+extern bool ready_check(cmd_t *);
+extern void ready_teardown(cmd_t *);
+extern void supervise_parent_setup(cmd_t *);
+
+extern int cmd_batch(cmd_t *, const char *fname);
+extern int cmd_jobs(cmd_t *, const char *arg);
+extern int cmd_pressure_limit(cmd_t *, const char *arg);
+extern int cmd_mem_reserve(cmd_t *, const char *arg);
+extern int cmd_journal(cmd_t *, const char *fname);
+extern int cmd_shard(cmd_t *, const char *arg);
+extern int cmd_output_order(cmd_t *, const char *arg);
+extern int cmd_output_prefix(cmd_t *, const char *arg);
+extern int cmd_output_spill(cmd_t *, const char *arg);
+extern int cmd_broadcast_stdin(cmd_t *);
+extern int cmd_trace(cmd_t *, const char *fname);
+extern int cmd_metrics(cmd_t *, const char *fname);
+extern void metrics_record(cmd_t *, int status);
+extern void metrics_exec(cmd_t *);
+extern void metrics_exec_failed(cmd_t *);
+extern int metrics_dump(const char *fname);
+
+extern int cmd_perf_stat(cmd_t *, const char *arg);
+extern int perf_prepare(cmd_t *);
+extern void perf_child_setup(cmd_t *);
+extern void perf_parent_setup(cmd_t *);
+extern void perf_collect(cmd_t *);
+extern void perf_teardown(cmd_t *);
+extern void fshow_perf_stat(FILE *, cmd_t *);
+
+extern int cmd_sample(cmd_t *, const char *arg);
+extern int cmd_sample_descendants(cmd_t *);
+extern void sample_parent_setup(cmd_t *);
+extern void sample_take(cmd_t *);
+extern void sample_finish(cmd_t *);
+
+extern int cmd_history(cmd_t *, const char *fname);
+extern int cmd_job_order(cmd_t *, const char *arg);
+extern uint64_t history_key(int argc, char **argv);
+extern void history_record(cmd_t *);
+extern unsigned int history_estimate(cmd_t *, const uint64_t *keys,
+                unsigned long long *est, unsigned int n);
+
+extern bool helper_running(void);
+extern int helper_spawn(int argc, char **argv, const int *fd,
+                int *sockp, pid_t *pidp, int *pidfdp);
+extern int helper_wait(int sock);
+extern int helper_argv(int argc, char **argv, int *ret);
+
+extern void fshow_exit_report(FILE *, cmd_t *);
+
+extern int parse_duration(const char *str, unsigned long long *ret);
+extern int parse_size(const char *str, unsigned long long *ret);
+extern int parse_id_list(const char *str, unsigned long *mask, size_t nbits, size_t *count);
 
 extern int run_program(cmd_t *);
+extern int run_child_program(cmd_t *);
+extern int start_child_program(cmd_t *);
+extern int wait_child_program(cmd_t *);
+extern int run_repeat(cmd_t *);
+extern int run_supervise(cmd_t *);
+extern int run_batch(cmd_t *);
 extern int run_interpret_xfname(cmd_t *, char *xfname);
 // extern int run_interpret_stream(cmd_t *, FILE *, char *xfname);
+extern void cmd_free_args(cmd_t *);
 extern int ush_argv(int argc, char **argv);
+extern int ush(int argc, char **argv);
+extern int ush_io(int argc, char **argv, ush_io_t *io);
+extern void ush_io_free(ush_io_t *io);
+extern int ush_popen2(int argc, char **argv, int pipes, ush_proc_t *proc);
+extern int ush_pclose2(ush_proc_t *proc);
+extern int ush_helper_start(void);
+extern void ush_helper_stop(void);
+extern ssize_t ush_splice(int in_fd, int out_fd, size_t len);
+extern ssize_t ush_vmsplice(int pipe_fd, const void *buf, size_t len);
+extern int ush_splice_all(int in_fd, int out_fd);
 
 
 extern void lsdlh(const char *fname);
@@ -37,30 +37,6 @@
 
 #include <cscript.h>
 
-/**
- * @brief Determine if a string is numeric
- *
- * More precisely, determine if a string consists of nothing but
- * decimal digits.
- *
- * @param str  IN  The string to be tested.
- * @return true or false
- *
- * There is nothing fancy here -- no radix options, no sign,
- * no leading or trailing space or punctuation -- just ASCII
- * decimal digits.
- *
- */
-static bool
-isnumeric(const char *str)
-{
-    const char *s = str;
-    while (*s >= '0' && *s <= '9') {
-        ++s;
-    }
-    return (*s == '\0' && s > str);
-}
-
 /**
  *
  * @brief Close all file descriptors >= a given number.  Brute force method.
@@ -0,0 +1,46 @@
+/*
+ * Filename: isnumeric.c
+ * Library: libcscript
+ * Brief: Determine if a string is nothing but decimal digits
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+
+#include <cscript.h>
+
+/**
+ * @brief Determine if a string is numeric
+ *
+ * More precisely, determine if a string consists of nothing but
+ * decimal digits.
+ *
+ * @param str  IN  The string to be tested.
+ * @return true or false
+ *
+ * There is nothing fancy here -- no radix options, no sign,
+ * no leading or trailing space or punctuation -- just ASCII
+ * decimal digits.
+ *
+ */
+bool
+isnumeric(const char *str)
+{
+    const char *s = str;
+    while (*s >= '0' && *s <= '9') {
+        ++s;
+    }
+    return (*s == '\0' && s > str);
+}
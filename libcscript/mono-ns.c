@@ -0,0 +1,44 @@
+/*
+ * Filename: mono-ns.c
+ * Library: libcscript
+ * Brief: The monotonic clock, in nanoseconds
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(__GNUC__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1
+#endif
+
+#include <time.h>
+    // Import clock_gettime()
+
+#include <cscript.h>
+
+/**
+ * @brief The monotonic clock, in nanoseconds
+ *
+ * @return nanoseconds since some unspecified starting point
+ *
+ * Good only for measuring intervals.  Safe to call from a signal handler.
+ *
+ */
+unsigned long long
+mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
@@ -0,0 +1,55 @@
+/*
+ * Filename: write-all.c
+ * Library: libcscript
+ * Brief: Write all of a buffer, across short writes and EINTR
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+    // Import write()
+#include <errno.h>
+    // Import var errno
+    // Import var EINTR
+
+#include <cscript.h>
+
+/**
+ * @brief Write all of |buf| to |fd|.
+ *
+ * @param fd   IN  File descriptor to write to
+ * @param buf  IN  What to write
+ * @param len  IN  How many bytes
+ * @return errno-style status
+ *
+ */
+int
+write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    ssize_t n;
+
+    while (len != 0) {
+        n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno);
+        }
+        p += n;
+        len -= n;
+    }
+    return (0);
+}
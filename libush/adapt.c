@@ -0,0 +1,337 @@
+/*
+ * Filename: adapt.c
+ * Library: libush
+ * Brief: --jobs=auto: how many --batch jobs to run at once, from pressure
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <batch.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import open()
+#include <stdio.h>
+    // Import snprintf()
+#include <stdlib.h>
+    // Import strtoul()
+    // Import strtoull()
+#include <string.h>
+    // Import memset()
+    // Import strlen()
+    // Import strncmp()
+    // Import strstr()
+
+#define ADAPT_TICK_NS     1000000000ULL   // How often to look
+#define ADAPT_PRESSURE    20              // Default --pressure-limit, percent
+#define ADAPT_RESERVE_PCT 5               // Default --mem-reserve, % of MemTotal
+
+static const char *psi_name[ADAPT_PSI] = { "cpu", "memory", "io" };
+
+/**
+ * @brief Command-line option: stall percentage above which --jobs=auto backs off
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  A percentage, 1..100
+ * @return errno-style status
+ *
+ */
+int
+cmd_pressure_limit(cmd_t *cmd, const char *arg)
+{
+    char *end;
+    unsigned long n;
+
+    errno = 0;
+    n = strtoul(arg, &end, 10);
+    if (*end == '%') {
+        ++end;
+    }
+    if (errno != 0 || end == arg || *end != '\0' || n == 0 || n > 100) {
+        eprintf("--pressure-limit: '%s' must be a percentage, in 1..100.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    cmd->pressure_pct = (unsigned int)n;
+    return (0);
+}
+
+/**
+ * @brief Command-line option: memory that --jobs=auto leaves free
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  A size, like 2G
+ * @return errno-style status
+ *
+ */
+int
+cmd_mem_reserve(cmd_t *cmd, const char *arg)
+{
+    unsigned long long n;
+
+    if (parse_size(arg, &n) != 0) {
+        eprintf("--mem-reserve: '%s' must be a size, like 512M or 2G.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    cmd->mem_reserve = n;
+    return (0);
+}
+
+/*
+ * Read all of a small /proc file, from the start.
+ */
+static ssize_t
+proc_read(int fd, char *buf, size_t size)
+{
+    ssize_t n;
+
+    n = pread(fd, buf, size - 1, 0);
+    if (n < 0) {
+        return (n);
+    }
+    buf[n] = '\0';
+    return (n);
+}
+
+/*
+ * The "some ... total=<usec>" counter of a /proc/pressure file.
+ */
+static bool
+psi_total(int fd, unsigned long long *ret)
+{
+    char buf[256];
+    char *p;
+
+    if (proc_read(fd, buf, sizeof (buf)) <= 0 || strncmp(buf, "some ", 5) != 0) {
+        return (false);
+    }
+    p = strstr(buf, "total=");
+    if (p == NULL) {
+        return (false);
+    }
+    *ret = strtoull(p + 6, NULL, 10);
+    return (true);
+}
+
+/*
+ * A field of /proc/meminfo, in bytes.
+ */
+static unsigned long long
+meminfo_field(const char *buf, const char *name)
+{
+    const char *p;
+
+    p = strstr(buf, name);
+    if (p == NULL) {
+        return (0);
+    }
+    return (strtoull(p + strlen(name), NULL, 10) * 1024);
+}
+
+static unsigned long long
+mem_available(struct adapt *ac)
+{
+    char buf[4096];
+
+    if (ac->meminfo_fd < 0 || proc_read(ac->meminfo_fd, buf, sizeof (buf)) <= 0) {
+        return (~0ULL);
+    }
+    if (ac->mem_reserve == 0) {
+        ac->mem_reserve = meminfo_field(buf, "MemTotal:") / 100 * ADAPT_RESERVE_PCT;
+    }
+    return (meminfo_field(buf, "MemAvailable:"));
+}
+
+/**
+ * @brief Start watching pressure, for --jobs=auto.
+ *
+ * @param ac    OUT  The controller
+ * @param cmd   IN   Command "object", with the options
+ * @param ncpu  IN   Number of CPUs; the number of jobs to start with
+ *
+ * Without PSI (a kernel before 4.20, or CONFIG_PSI off), only
+ * MemAvailable is watched.
+ *
+ */
+void
+adapt_init(struct adapt *ac, cmd_t *cmd, unsigned int ncpu)
+{
+    char path[32];
+    int i;
+
+    memset(ac, 0, sizeof (*ac));
+    ac->on = cmd->batch_adaptive;
+    ac->verbose = cmd->verbose;
+    ac->meminfo_fd = -1;
+    for (i = 0; i < ADAPT_PSI; ++i) {
+        ac->psi_fd[i] = -1;
+    }
+    if (!ac->on) {
+        return;
+    }
+    ac->max = cmd->batch_jobs ? cmd->batch_jobs : 2 * ncpu;
+    ac->limit = (ncpu < ac->max) ? ncpu : ac->max;
+    ac->pct = cmd->pressure_pct ? cmd->pressure_pct : ADAPT_PRESSURE;
+    ac->mem_reserve = cmd->mem_reserve;
+    ac->meminfo_fd = open("/proc/meminfo", O_RDONLY|O_CLOEXEC);
+    for (i = 0; i < ADAPT_PSI; ++i) {
+        snprintf(path, sizeof (path), "/proc/pressure/%s", psi_name[i]);
+        ac->psi_fd[i] = open(path, O_RDONLY|O_CLOEXEC);
+        if (ac->psi_fd[i] >= 0 && !psi_total(ac->psi_fd[i], &ac->psi_total[i])) {
+            close(ac->psi_fd[i]);
+            ac->psi_fd[i] = -1;
+        }
+    }
+    if (ac->psi_fd[0] < 0 && ac->verbose) {
+        eprintf("--jobs=auto: no /proc/pressure; watching MemAvailable only.\n");
+    }
+    ac->tick_ns = mono_ns();
+    ac->mem_tight = (mem_available(ac) < ac->mem_reserve);
+    if (ac->verbose) {
+        eprintf("--jobs=auto: starting with %u, up to %u.\n", ac->limit, ac->max);
+    }
+}
+
+/**
+ * @brief Milliseconds until adapt_tick() has something to do; -1 if never.
+ *
+ * @param ac  IN  The controller
+ *
+ */
+int
+adapt_timeout(struct adapt *ac)
+{
+    unsigned long long now;
+    unsigned long long next;
+
+    if (!ac->on) {
+        return (-1);
+    }
+    now = mono_ns();
+    next = ac->tick_ns + ADAPT_TICK_NS;
+    return ((next > now) ? (int)((next - now + 999999) / 1000000) : 0);
+}
+
+/**
+ * @brief Once a tick has gone by, look at pressure, and set the limit.
+ *
+ * @param ac       IN  The controller
+ * @param running  IN  How many jobs are running now
+ *
+ */
+void
+adapt_tick(struct adapt *ac, unsigned int running)
+{
+    unsigned long long now;
+    unsigned long long elapsed_us;
+    unsigned long long total;
+    unsigned long long avail;
+    unsigned int stall[ADAPT_PSI];
+    unsigned int limit;
+    bool congested;
+    int i;
+
+    if (!ac->on) {
+        return;
+    }
+    now = mono_ns();
+    if (now < ac->tick_ns + ADAPT_TICK_NS) {
+        return;
+    }
+    elapsed_us = (now - ac->tick_ns) / 1000;
+    ac->tick_ns = now;
+
+    for (i = 0; i < ADAPT_PSI; ++i) {
+        stall[i] = 0;
+        if (ac->psi_fd[i] < 0 || !psi_total(ac->psi_fd[i], &total)) {
+            continue;
+        }
+        if (total > ac->psi_total[i] && elapsed_us != 0) {
+            stall[i] = (unsigned int)((total - ac->psi_total[i]) * 100 / elapsed_us);
+        }
+        ac->psi_total[i] = total;
+    }
+    // Stalls on memory cost more than stalls on CPU or I/O.
+    congested = stall[0] > ac->pct || stall[1] > ac->pct / 4 || stall[2] > ac->pct;
+
+    avail = mem_available(ac);
+    ac->mem_tight = (avail < ac->mem_reserve || stall[1] > ac->pct / 4);
+    congested |= ac->mem_tight;
+
+    limit = ac->limit;
+    if (congested) {
+        limit = (limit > 1) ? limit / 2 : 1;
+    }
+    else if (running >= limit && limit < ac->max) {
+        ++limit;
+    }
+    if (limit != ac->limit && ac->verbose) {
+        eprintf("--jobs=auto: %u -> %u; stalled cpu %u%%, memory %u%%, io %u%%",
+            ac->limit, limit, stall[0], stall[1], stall[2]);
+        if (avail != ~0ULL) {
+            eprintf(", %lluM available", avail >> 20);
+        }
+        eprintf(".\n");
+    }
+    ac->limit = limit;
+}
+
+/**
+ * @brief May another job be started now?
+ *
+ * @param ac       IN  The controller
+ * @param running  IN  How many jobs are running now
+ *
+ * At least one job is always allowed to run, so that the batch
+ * makes progress, however tight things are.
+ *
+ */
+bool
+adapt_may_start(struct adapt *ac, unsigned int running)
+{
+    if (running == 0) {
+        return (true);
+    }
+    return (running < ac->limit && !ac->mem_tight);
+}
+
+/**
+ * @brief Let go of the /proc files.
+ *
+ * @param ac  IN  The controller
+ *
+ */
+void
+adapt_fini(struct adapt *ac)
+{
+    int i;
+
+    for (i = 0; i < ADAPT_PSI; ++i) {
+        if (ac->psi_fd[i] >= 0) {
+            close(ac->psi_fd[i]);
+            ac->psi_fd[i] = -1;
+        }
+    }
+    if (ac->meminfo_fd >= 0) {
+        close(ac->meminfo_fd);
+        ac->meminfo_fd = -1;
+    }
+}
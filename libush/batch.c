@@ -0,0 +1,833 @@
+/*
+ * Filename: batch.c
+ * Library: libush
+ * Brief: Run the jobs listed in a manifest, some number at a time
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <batch.h>
+#include <trace.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import pipe2()
+    // Import fcntl()
+#include <limits.h>
+    // Import INT_MAX
+#include <signal.h>
+    // Import kill()
+#include <stdio.h>
+    // Import fopen()
+    // Import getline()
+#include <stdlib.h>
+    // Import calloc()
+    // Import realloc()
+    // Import strtoul()
+    // Import qsort()
+    // Import free()
+#include <string.h>
+    // Import strcmp()
+    // Import strdup()
+    // Import strncmp()
+    // Import memset()
+#include <sys/epoll.h>
+    // Import epoll_wait()
+#include <sys/signalfd.h>
+    // Import struct signalfd_siginfo
+#include <sys/wait.h>
+    // Import W_EXITCODE()
+
+extern void *guard_mem(void *obj);
+extern void eexplain_err(int err);
+
+#define BATCH_FAILED_MAX 100
+
+/*
+ * --timeout, for a batch: the jobs that are running, each with
+ * its own deadline, and the signals to pass on to them.
+ */
+struct batch_timeout {
+    unsigned long long timeout_ns;
+    unsigned long long kill_after_ns;
+    int    sig;
+    int    sfd;                 // signalfd of the forwarded signals, or -1
+    bool   stopped;             // A signal was passed on; start no more jobs
+    struct job_ref ref;         // The epoll tag of |sfd|; ref.job is NULL
+    struct batch_job *running;
+};
+
+/**
+ * @brief Command-line option to run the jobs listed in a manifest
+ *
+ * @param cmd    IN  Command "object" that hold context/control information
+ * @param fname  IN  The manifest
+ * @return errno-style status
+ *
+ * --batch implies --fork.
+ *
+ */
+int
+cmd_batch(cmd_t *cmd, const char *fname)
+{
+    free(cmd->batch_manifest);
+    cmd->batch_manifest = (char *)guard_mem(strdup(fname));
+    cmd->cmd_fork = true;
+    return (0);
+}
+
+/**
+ * @brief Command-line option to set how many jobs run at a time
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  A count, 1 or more; or auto[:<most>]
+ * @return errno-style status
+ *
+ * "auto" adjusts the count as the batch runs; see adapt.c.
+ *
+ */
+int
+cmd_jobs(cmd_t *cmd, const char *arg)
+{
+    char *end;
+    unsigned long n;
+
+    cmd->batch_adaptive = false;
+    cmd->batch_jobs = 0;
+    if (strcmp(arg, "auto") == 0) {
+        cmd->batch_adaptive = true;
+        return (0);
+    }
+    if (strncmp(arg, "auto:", 5) == 0) {
+        cmd->batch_adaptive = true;
+        arg += 5;
+    }
+    errno = 0;
+    n = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || n == 0 || n > 65536) {
+        eprintf("--jobs: '%s' must be a count, in 1..65536, or auto[:<count>].\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    cmd->batch_jobs = (unsigned int)n;
+    return (0);
+}
+
+static int
+read_manifest(const char *fname, struct job_table *tab)
+{
+    FILE *f;
+    char *line;
+    size_t sz;
+    ssize_t len;
+    int err;
+
+    jobtab_init(tab);
+    f = fopen(fname, "r");
+    if (f == NULL) {
+        err = errno;
+        eprintf("--batch: fopen('%s') failed.\n", fname);
+        eexplain_err(err);
+        return (err);
+    }
+
+    line = NULL;
+    sz = 0;
+    err = 0;
+    while ((len = getline(&line, &sz, f)) != -1) {
+        if (len != 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (line[0] == '#') {
+            continue;
+        }
+        if (len == 0) {
+            jobtab_end_job(tab);
+            continue;
+        }
+        err = jobtab_add_arg(tab, line, len);
+        if (err != 0) {
+            eprintf("--batch: '%s' is too big, at job %u.\n", fname, tab->njobs + 1);
+            eexplain_err(err);
+            break;
+        }
+    }
+    jobtab_end_job(tab);
+    free(line);
+    fclose(f);
+    if (err != 0) {
+        jobtab_free(tab);
+    }
+    return (err);
+}
+
+/*
+ * Start one job, with its stdout and stderr going to pipes.
+ * The job's command "object" is a copy of the prepared one.
+ */
+static int
+start_job(cmd_t *cmd, struct collector *c, struct batch_job *job)
+{
+    cmd_t *jcmd;
+    int pfd[2];
+    int fd;
+    int rv;
+
+    jcmd = job->cmd;
+    *jcmd = *cmd;
+    jcmd->batch_manifest = NULL;
+    jcmd->cmd_path = job->argv[0];
+    jcmd->cmd_name = sname(job->argv[0]);
+    jcmd->argc = job->argc;
+    jcmd->argv = job->argv;
+    jcmd->child_fd[0] = job->fd[0];
+    job->fd[0] = -1;
+    jcmd->child_fd[1] = -1;
+    jcmd->child_fd[2] = -1;
+    jcmd->child_fd_plan = true;
+    if (jcmd->timeout_ns != 0) {
+        // The batch loop keeps the deadline; see batch_timeout_check().
+        jcmd->timeout_ns = 0;
+        jcmd->own_pgrp = true;
+    }
+
+    rv = 0;
+    for (fd = 1; fd <= 2; ++fd) {
+        if (pipe2(pfd, O_CLOEXEC) != 0) {
+            rv = errno;
+            eprintf("pipe2() failed, for job %u.\n", job->id);
+            eexplain_err(rv);
+            break;
+        }
+        fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+        job->fd[fd] = pfd[0];
+        jcmd->child_fd[fd] = pfd[1];
+    }
+    if (rv == 0) {
+        rv = start_child_program(jcmd);
+    }
+    else {
+        rv = W_EXITCODE(rv & 0xff, 0);
+    }
+
+    for (fd = 0; fd <= 2; ++fd) {
+        if (jcmd->child_fd[fd] >= 0) {
+            close(jcmd->child_fd[fd]);
+            jcmd->child_fd[fd] = -1;
+        }
+    }
+    if (rv == 0) {
+        rv = collect_add(c, job);
+        if (rv != 0) {
+            // Still, there is a child to wait for.
+            rv = 0;
+            job->exited = true;
+        }
+        return (rv);
+    }
+
+    for (fd = 1; fd <= 2; ++fd) {
+        collect_close(c, job, fd);
+    }
+    flight_fail("could not start a job", WEXITSTATUS(rv));
+    metrics_record(jcmd, rv);
+    job->status = rv;
+    return (rv);
+}
+
+static void
+batch_timeout_init(struct batch_timeout *bt, cmd_t *cmd, int epfd)
+{
+    struct epoll_event ev;
+
+    memset(bt, 0, sizeof (*bt));
+    bt->sfd = -1;
+    bt->timeout_ns = cmd->timeout_ns;
+    if (bt->timeout_ns == 0) {
+        return;
+    }
+    bt->kill_after_ns = cmd->kill_after_ns;
+    bt->sig = cmd->timeout_signal ? cmd->timeout_signal : SIGTERM;
+    bt->sfd = timeout_signalfd();
+    if (bt->sfd < 0) {
+        eprintf("signalfd() failed; INT, QUIT, TERM and HUP are not passed on"
+            " to the jobs.\n");
+        return;
+    }
+    memset(&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &bt->ref;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, bt->sfd, &ev);
+}
+
+static void
+batch_timeout_fini(struct batch_timeout *bt)
+{
+    if (bt->timeout_ns != 0) {
+        timeout_signalfd_close(bt->sfd);
+    }
+}
+
+/*
+ * The job was started; its deadline counts from now.
+ */
+static void
+batch_timeout_add(struct batch_timeout *bt, struct batch_job *job)
+{
+    if (bt->timeout_ns == 0) {
+        return;
+    }
+    job->deadline = job->cmd->child_start_ns + bt->timeout_ns;
+    job->run_prev = NULL;
+    job->run_next = bt->running;
+    if (bt->running != NULL) {
+        bt->running->run_prev = job;
+    }
+    bt->running = job;
+}
+
+static void
+batch_timeout_remove(struct batch_timeout *bt, struct batch_job *job)
+{
+    if (bt->timeout_ns == 0) {
+        return;
+    }
+    if (job->run_prev != NULL) {
+        job->run_prev->run_next = job->run_next;
+    }
+    else if (bt->running == job) {
+        bt->running = job->run_next;
+    }
+    if (job->run_next != NULL) {
+        job->run_next->run_prev = job->run_prev;
+    }
+    job->run_prev = NULL;
+    job->run_next = NULL;
+}
+
+static void
+batch_kill(struct batch_job *job, int sig)
+{
+    cmd_t *jcmd = job->cmd;
+
+    if (jcmd->verbose) {
+        eprintf("job %u: timeout: signal %d to process group %d\n",
+            job->id, sig, (int)jcmd->child);
+    }
+    kill(-jcmd->child, sig);
+    kill(jcmd->child, sig);
+    if (sig == SIGKILL && jcmd->cgroup_parent != NULL) {
+        cgroup_kill(jcmd);
+    }
+}
+
+/*
+ * Signal the jobs whose time is up.
+ * Returns how long, in ms, until the next deadline, or -1 if none.
+ */
+static int
+batch_timeout_check(struct batch_timeout *bt)
+{
+    struct batch_job *job;
+    unsigned long long now;
+    unsigned long long next;
+    unsigned long long left;
+
+    if (bt->running == NULL) {
+        return (-1);
+    }
+    now = mono_ns();
+    next = 0;
+    for (job = bt->running; job != NULL; job = job->run_next) {
+        if (job->deadline != 0 && job->deadline <= now) {
+            if (!job->cmd->timed_out) {
+                job->cmd->timed_out = true;
+                batch_kill(job, bt->sig);
+                job->deadline = 0;
+                if (bt->kill_after_ns != 0) {
+                    job->deadline = now + bt->kill_after_ns;
+                }
+            }
+            else if (!job->killed) {
+                batch_kill(job, SIGKILL);
+                job->killed = true;
+                job->deadline = 0;
+            }
+        }
+        if (job->deadline != 0 && (next == 0 || job->deadline < next)) {
+            next = job->deadline;
+        }
+    }
+    if (next == 0) {
+        return (-1);
+    }
+    left = (next - now + 999999) / 1000000;
+    return ((left > INT_MAX) ? INT_MAX : (int)left);
+}
+
+/*
+ * Pass on INT, QUIT, TERM or HUP to every running job,
+ * as the terminal would have, and start no more of them.
+ */
+static void
+batch_timeout_forward(struct batch_timeout *bt)
+{
+    struct signalfd_siginfo si;
+    struct batch_job *job;
+
+    while (read(bt->sfd, &si, sizeof (si)) == (ssize_t)sizeof (si)) {
+        for (job = bt->running; job != NULL; job = job->run_next) {
+            kill(-job->cmd->child, (int)si.ssi_signo);
+        }
+        bt->stopped = true;
+    }
+}
+
+/*
+ * Once the job has exited and nothing is left in its pipes, reap it,
+ * and hand it over to the collector, which lets go of it, once its
+ * output is written.  Then, |job| is not to be used.
+ */
+static bool
+finish_job(struct collector *c, struct journal *jn, struct batch_timeout *bt,
+    struct batch_job *job, int *statusp)
+{
+    int fd;
+
+    if (job->exited) {
+        // Take what it wrote before it exited.  Anything written
+        // later, by some descendant, is not waited for.
+        //
+        for (fd = 1; fd <= 2; ++fd) {
+            while (collect_read(c, job, fd)) {
+                continue;
+            }
+            collect_close(c, job, fd);
+        }
+    }
+    else if (job->cmd->child_pidfd >= 0 || job->fd[1] >= 0 || job->fd[2] >= 0) {
+        return (false);
+    }
+
+    if (job->cmd->child_pidfd >= 0) {
+        epoll_ctl(c->epfd, EPOLL_CTL_DEL, job->cmd->child_pidfd, NULL);
+    }
+    batch_timeout_remove(bt, job);
+    job->status = wait_child_program(job->cmd);
+    if (job->cmd->verbose) {
+        eprintf("job %u: status=0x%02x\n", job->id, job->status);
+    }
+    journal_add(jn, c->tab, job);
+    free(job->cmd);
+    job->cmd = NULL;
+    *statusp = job->status;
+    collect_done(c, job);
+    return (true);
+}
+
+struct job_est {
+    unsigned int idx;
+    unsigned long long est;
+};
+
+/*
+ * Manifest order among equals.  No history is ~0, the longest.
+ */
+static int
+job_est_longest(const void *a, const void *b)
+{
+    const struct job_est *ja = (const struct job_est *)a;
+    const struct job_est *jb = (const struct job_est *)b;
+
+    if (ja->est != jb->est) {
+        return ((ja->est > jb->est) ? -1 : 1);
+    }
+    return ((ja->idx < jb->idx) ? -1 : (ja->idx > jb->idx));
+}
+
+static int
+job_est_shortest(const void *a, const void *b)
+{
+    const struct job_est *ja = (const struct job_est *)a;
+    const struct job_est *jb = (const struct job_est *)b;
+
+    if (ja->est != jb->est) {
+        return ((ja->est < jb->est) ? -1 : 1);
+    }
+    return ((ja->idx < jb->idx) ? -1 : (ja->idx > jb->idx));
+}
+
+/*
+ * Expected time to run all of the jobs, |slots| at a time, in |order|:
+ * each job goes to the slot that comes free first.
+ */
+static unsigned long long
+predict_makespan(const struct job_est *order, unsigned int njobs, unsigned int slots)
+{
+    unsigned long long *heap;
+    unsigned long long t;
+    unsigned long long end;
+    unsigned int i;
+    unsigned int p;
+    unsigned int k;
+
+    if (slots > njobs) {
+        slots = njobs;
+    }
+    if (slots == 0) {
+        return (0);
+    }
+    // A min-heap of when each slot comes free; all are free at 0.
+    heap = (unsigned long long *)guard_mem(calloc(slots, sizeof (*heap)));
+    end = 0;
+    for (i = 0; i < njobs; ++i) {
+        t = heap[0] + order[i].est;
+        if (t > end) {
+            end = t;
+        }
+        // Replace the root, and sift down.
+        for (p = 0; (k = 2 * p + 1) < slots; p = k) {
+            if (k + 1 < slots && heap[k + 1] < heap[k]) {
+                ++k;
+            }
+            if (heap[k] >= t) {
+                break;
+            }
+            heap[p] = heap[k];
+        }
+        heap[p] = t;
+    }
+    free(heap);
+    return (end);
+}
+
+/*
+ * The order in which to start the jobs.
+ *
+ * With --history, each job's expected run time is what it took before.
+ * Longest first (LPT) keeps a long job from being started last, and
+ * stretching the whole batch.  Jobs with no history count as longest;
+ * that is, they go first with "longest", and last with "shortest".
+ * Otherwise, and with --job-order=file, jobs start in manifest order.
+ *
+ * Returns an array of indexes into |tab|, or NULL, for manifest order.
+ */
+static unsigned int *
+order_jobs(cmd_t *cmd, struct job_table *tab, unsigned int slots)
+{
+    struct job_est *est;
+    char **argv;
+    unsigned long long *wall;
+    unsigned long long sum;
+    unsigned long long avg;
+    uint64_t *keys;
+    unsigned int *order;
+    unsigned int order_by;
+    unsigned int known;
+    unsigned int njobs;
+    unsigned int i;
+
+    njobs = tab->njobs;
+    order_by = cmd->job_order;
+    if (order_by == JOB_ORDER_DEFAULT) {
+        order_by = (cmd->history_file != NULL) ? JOB_ORDER_LONGEST : JOB_ORDER_FILE;
+    }
+    if (cmd->history_file == NULL || njobs == 0
+        || (order_by == JOB_ORDER_FILE && !cmd->verbose)) {
+        return (NULL);
+    }
+
+    keys = (uint64_t *)guard_mem(calloc(njobs, sizeof (*keys)));
+    wall = (unsigned long long *)guard_mem(calloc(njobs, sizeof (*wall)));
+    for (i = 0; i < njobs; ++i) {
+        argv = jobtab_argv(tab, i);
+        keys[i] = history_key(tab->job[i].argc, argv);
+        free(argv);
+    }
+    known = history_estimate(cmd, keys, wall, njobs);
+
+    est = (struct job_est *)guard_mem(calloc(njobs, sizeof (*est)));
+    sum = 0;
+    for (i = 0; i < njobs; ++i) {
+        est[i].idx = i;
+        est[i].est = wall[i] ? wall[i] : ~0ULL;
+        sum += wall[i];
+    }
+    if (order_by == JOB_ORDER_LONGEST) {
+        qsort(est, njobs, sizeof (*est), job_est_longest);
+    }
+    else if (order_by == JOB_ORDER_SHORTEST) {
+        qsort(est, njobs, sizeof (*est), job_est_shortest);
+    }
+
+    if (cmd->verbose) {
+        // A job with no history is guessed to take the average.
+        avg = known ? sum / known : 0;
+        for (i = 0; i < njobs; ++i) {
+            if (est[i].est == ~0ULL) {
+                est[i].est = avg;
+            }
+        }
+        eprintf("--batch: %u of %u jobs have history; expected to take %.3f s,"
+            " %u at a time.\n",
+            known, njobs, (double)predict_makespan(est, njobs, slots) / 1e9, slots);
+    }
+
+    order = NULL;
+    if (order_by != JOB_ORDER_FILE) {
+        order = (unsigned int *)guard_mem(calloc(njobs, sizeof (*order)));
+        for (i = 0; i < njobs; ++i) {
+            order[i] = est[i].idx;
+        }
+    }
+    free(est);
+    free(wall);
+    free(keys);
+    return (order);
+}
+
+/**
+ * @brief Run all of the jobs in the manifest.
+ *
+ * @param cmd  IN  Command "object", prepared as for any one job
+ * @return a made-up wait status, with the count of failed jobs
+ *
+ */
+int
+run_batch(cmd_t *cmd)
+{
+    struct collector c;
+    struct broadcast bc;
+    struct adapt ac;
+    struct batch_timeout bt;
+    struct journal jn;
+    struct job_table tab;
+    struct batch_job *job;
+    struct epoll_event ev[64];
+    unsigned int njobs;
+    unsigned int max_running;
+    unsigned int running;
+    unsigned int *order;
+    unsigned int next;
+    unsigned int ndone;
+    unsigned int failed;
+    unsigned int idx;
+    int status;
+    long ncpu;
+    int ms;
+    int n;
+    int i;
+    int rv;
+
+    if (cmd->supervise || cmd->repeat != 0
+        || cmd->tee_count[1] != 0 || cmd->tee_count[2] != 0
+        || cmd->compress_algo[1] != 0 || cmd->compress_algo[2] != 0
+        || cmd->ring[1] != NULL || cmd->ring[2] != NULL
+        || cmd->io != NULL || cmd->sample_ns != 0) {
+        eprintf("--batch cannot be combined with --supervise, --repeat,"
+            " tee, compression, ring files or --sample.\n");
+        return (W_EXITCODE(EINVAL, 0));
+    }
+
+    rv = read_manifest(cmd->batch_manifest, &tab);
+    if (rv != 0) {
+        return (W_EXITCODE(rv & 0xff, 0));
+    }
+    njobs = tab.njobs;
+    if (cmd->readahead_auto) {
+        readahead_exec(cmd);
+        for (idx = 0; idx < njobs; ++idx) {
+            // Program names are interned; skip a run of the same one.
+            if (idx == 0 || tab.args[tab.job[idx].arg] != tab.args[tab.job[idx - 1].arg]) {
+                readahead_program(jobtab_arg(&tab, idx, 0));
+            }
+        }
+    }
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 0) {
+        ncpu = 1;
+    }
+    adapt_init(&ac, cmd, (unsigned int)ncpu);
+    max_running = ac.on ? ac.max : cmd->batch_jobs;
+    if (max_running == 0) {
+        max_running = (unsigned int)ncpu;
+    }
+
+    if (cmd->broadcast_stdin) {
+        // Every job has to be there from the start.
+        if (cmd->batch_adaptive) {
+            eprintf("--broadcast-stdin: all %u jobs must run at once, but --jobs=auto.\n",
+                njobs);
+        }
+        else if (cmd->batch_jobs != 0 && cmd->batch_jobs < njobs) {
+            eprintf("--broadcast-stdin: all %u jobs must run at once, but --jobs=%u.\n",
+                njobs, cmd->batch_jobs);
+        }
+        if (cmd->batch_adaptive || (cmd->batch_jobs != 0 && cmd->batch_jobs < njobs)) {
+            adapt_fini(&ac);
+            jobtab_free(&tab);
+            return (W_EXITCODE(EINVAL, 0));
+        }
+        max_running = njobs ? njobs : 1;
+    }
+    order = order_jobs(cmd, &tab, max_running);
+
+    rv = journal_open(&jn, cmd, &tab);
+    if (rv == 0) {
+        rv = limit_acquire(cmd);
+        if (rv != 0) {
+            journal_close(&jn);
+        }
+    }
+    if (rv == 0) {
+        rv = collect_init(&c, cmd, &tab);
+        if (rv == 0 && cmd->broadcast_stdin) {
+            rv = broadcast_prepare(&bc, &tab);
+            if (rv != 0) {
+                collect_fini(&c);
+            }
+        }
+        if (rv != 0) {
+            limit_release(cmd);
+            journal_close(&jn);
+        }
+    }
+    if (rv != 0) {
+        adapt_fini(&ac);
+        free(order);
+        jobtab_free(&tab);
+        return (W_EXITCODE(rv & 0xff, 0));
+    }
+
+    batch_timeout_init(&bt, cmd, c.epfd);
+    next = 0;
+    running = 0;
+    ndone = 0;
+    failed = 0;
+    while (ndone < njobs) {
+        adapt_tick(&ac, running);
+        while (next < njobs && !bt.stopped
+               && (ac.on ? adapt_may_start(&ac, running) : running < max_running)) {
+            idx = order ? order[next] : next;
+            ++next;
+            job = (tab.live != NULL) ? tab.live[idx] : NULL;
+            if (tab.job[idx].flags & JOB_SKIP) {
+                if (job != NULL) {
+                    // Its stdin pipe, for --broadcast-stdin
+                    job_free(&tab, job);
+                }
+                collect_skip(&c, idx);
+                ++ndone;
+                continue;
+            }
+            if (job == NULL) {
+                job = job_alloc(&tab, idx);
+            }
+            if (start_job(cmd, &c, job) != 0) {
+                journal_add(&jn, &tab, job);
+                collect_done(&c, job);
+                ++failed;
+                ++ndone;
+                continue;
+            }
+            ++running;
+            batch_timeout_add(&bt, job);
+            if (finish_job(&c, &jn, &bt, job, &status)) {
+                // No pidfd, and no pipes to wait on.
+                --running;
+                ++ndone;
+                failed += (status != 0);
+            }
+        }
+        collect_flush(&c);
+        journal_flush(&jn);
+        if (cmd->broadcast_stdin && !bc.running && next == njobs) {
+            broadcast_start(&bc);
+        }
+        if (running == 0) {
+            if (bt.stopped) {
+                // The jobs that were never started count as failed.
+                failed += njobs - ndone;
+                break;
+            }
+            continue;
+        }
+
+        ms = adapt_timeout(&ac);
+        n = batch_timeout_check(&bt);
+        if (n >= 0 && (ms < 0 || n < ms)) {
+            ms = n;
+        }
+        n = epoll_wait(c.epfd, ev, sizeof (ev) / sizeof (ev[0]), ms);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rv = errno;
+            eprintf("epoll_wait() failed.\n");
+            eexplain_err(rv);
+            break;
+        }
+        for (i = 0; i < n; ++i) {
+            struct job_ref *ref = (struct job_ref *)ev[i].data.ptr;
+
+            job = ref->job;
+            if (job == NULL) {
+                batch_timeout_forward(&bt);
+                continue;
+            }
+            if (job->done) {
+                // Finished earlier in this same batch of events.
+                continue;
+            }
+            if (ref->which == 0) {
+                job->exited = true;
+            }
+            else {
+                collect_read(&c, job, ref->which);
+            }
+            if (finish_job(&c, &jn, &bt, job, &status)) {
+                --running;
+                ++ndone;
+                failed += (status != 0);
+            }
+        }
+        collect_flush(&c);
+        journal_flush(&jn);
+    }
+
+    if (cmd->broadcast_stdin) {
+        broadcast_finish(&bc);
+    }
+    batch_timeout_fini(&bt);
+    collect_fini(&c);
+    journal_close(&jn);
+    limit_release(cmd);
+    adapt_fini(&ac);
+    free(order);
+    jobtab_free(&tab);
+    if (rv != 0) {
+        return (W_EXITCODE(rv & 0xff, 0));
+    }
+    if (failed > BATCH_FAILED_MAX) {
+        failed = BATCH_FAILED_MAX;
+    }
+    return (W_EXITCODE(failed, 0));
+}
@@ -0,0 +1,443 @@
+/*
+ * Filename: broadcast.c
+ * Library: libush
+ * Brief: Feed one stdin to every job of a --batch, reading it only once
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <batch.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import pipe2()
+    // Import splice()
+    // Import tee()
+    // Import fcntl()
+#include <poll.h>
+    // Import poll()
+#include <pthread.h>
+    // Import pthread_create()
+    // Import pthread_join()
+#include <signal.h>
+    // Import sigaction()
+#include <stdlib.h>
+    // Import calloc()
+    // Import free()
+#include <string.h>
+    // Import memset()
+#include <sys/ioctl.h>
+    // Import ioctl()
+    // Import FIONREAD
+#include <sys/stat.h>
+    // Import fstat()
+    // Import S_ISFIFO()
+
+extern void *guard_mem(void *obj);
+extern void eexplain_err(int err);
+
+#define BROADCAST_PIPE_SZ (1024 * 1024)
+
+/*
+ * Make the source pipe no bigger than |sz|, which is all that
+ * a staging pipe could get.  The caller's own pipe, on fd 0,
+ * is not changed; a pipe of our own is put in between, instead.
+ * Returns the size of the source pipe, or -1.
+ */
+static int
+shrink_source(struct broadcast *bc, int sz)
+{
+    if (bc->fill[1] < 0) {
+        if (pipe2(bc->fill, O_CLOEXEC) != 0) {
+            return (-1);
+        }
+        bc->in = bc->fill[0];
+    }
+    fcntl(bc->fill[1], F_SETPIPE_SZ, sz);
+    bc->fill_sz = fcntl(bc->fill[1], F_GETPIPE_SZ);
+    return (bc->fill_sz);
+}
+
+/**
+ * @brief Command-line option to give every job of a --batch the same stdin
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @return errno-style status
+ *
+ */
+int
+cmd_broadcast_stdin(cmd_t *cmd)
+{
+    cmd->broadcast_stdin = true;
+    return (0);
+}
+
+static void
+close_fd(int *fdp)
+{
+    if (*fdp >= 0) {
+        close(*fdp);
+        *fdp = -1;
+    }
+}
+
+/**
+ * @brief Make the stdin pipes for all of the jobs.  Before any are started.
+ *
+ * @param bc   OUT  Broadcast state
+ * @param tab  IN   The jobs; each is made live, and gets the child's end
+ *                  of a pipe in |fd[0]|
+ * @return errno-style status
+ *
+ */
+int
+broadcast_prepare(struct broadcast *bc, struct job_table *tab)
+{
+    struct stat st;
+    struct bc_out *out;
+    struct batch_job *job;
+    unsigned int njobs;
+    int pfd[2];
+    int in_sz;
+    int stage_sz;
+    unsigned int i;
+
+    memset(bc, 0, sizeof (*bc));
+    bc->fill[0] = -1;
+    bc->fill[1] = -1;
+    bc->stop[0] = -1;
+    bc->stop[1] = -1;
+    njobs = tab->njobs;
+    bc->n = njobs;
+    bc->out = (struct bc_out *)guard_mem(calloc(njobs, sizeof (struct bc_out)));
+    for (i = 0; i < njobs; ++i) {
+        bc->out[i].stage[0] = -1;
+        bc->out[i].stage[1] = -1;
+        bc->out[i].dst = -1;
+    }
+
+    if (fstat(0, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        bc->in = 0;
+    }
+    else {
+        if (pipe2(bc->fill, O_CLOEXEC) != 0) {
+            goto fail;
+        }
+        fcntl(bc->fill[1], F_SETPIPE_SZ, BROADCAST_PIPE_SZ);
+        bc->fill_sz = fcntl(bc->fill[1], F_GETPIPE_SZ);
+        bc->in = bc->fill[0];
+    }
+    in_sz = fcntl(bc->in, F_GETPIPE_SZ);
+    if (pipe2(bc->stop, O_CLOEXEC) != 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < njobs; ++i) {
+        out = &bc->out[i];
+        if (pipe2(out->stage, O_CLOEXEC) != 0) {
+            goto fail;
+        }
+        if (in_sz > 0 && fcntl(out->stage[1], F_SETPIPE_SZ, in_sz) < in_sz) {
+            // Likely EPERM, past the per-user limit.  Take what we got,
+            // for the source pipe, too.  The stage pipes made so far
+            // are big enough, still.
+            //
+            stage_sz = fcntl(out->stage[1], F_GETPIPE_SZ);
+            if (stage_sz <= 0 || shrink_source(bc, stage_sz) != stage_sz) {
+                eprintf("--broadcast-stdin: cannot make a pipe of %d bytes.\n", in_sz);
+                errno = EPIPE;
+                goto fail;
+            }
+            in_sz = stage_sz;
+        }
+        if (pipe2(pfd, O_CLOEXEC) != 0) {
+            goto fail;
+        }
+        fcntl(pfd[1], F_SETPIPE_SZ, in_sz);
+        jobtab_index_live(tab);
+        job = tab->live[i];
+        if (job == NULL) {
+            job = job_alloc(tab, i);
+        }
+        job->fd[0] = pfd[0];
+        out->dst = pfd[1];
+    }
+    return (0);
+
+fail:
+    {
+        int err = errno;
+        eprintf("--broadcast-stdin: pipe2() failed.\n");
+        eexplain_err(err);
+        for (i = 0; tab->live != NULL && i < njobs; ++i) {
+            if (tab->live[i] != NULL) {
+                job_free(tab, tab->live[i]);
+            }
+        }
+        broadcast_finish(bc);
+        return (err);
+    }
+}
+
+/*
+ * This job is not reading any more.
+ */
+static void
+drop_out(struct broadcast *bc, struct bc_out *out)
+{
+    close_fd(&out->stage[0]);
+    close_fd(&out->stage[1]);
+    close_fd(&out->dst);
+    --bc->alive;
+}
+
+/*
+ * Move the next bit of fd 0 into the fill pipe, which is empty.
+ * Return the number of bytes, 0 at end of file, or -1.
+ */
+static ssize_t
+fill(struct broadcast *bc)
+{
+    char buf[65536];
+    ssize_t n;
+    ssize_t w;
+    ssize_t off;
+
+    do {
+        n = splice(0, NULL, bc->fill[1], NULL, bc->fill_sz, SPLICE_F_MOVE);
+    } while (n == -1 && errno == EINTR);
+    if (n != -1 || errno != EINVAL) {
+        return (n);
+    }
+
+    // fd 0 cannot be spliced from; a terminal, say.
+    // No more than fits, since the fill pipe is not drained until we return.
+    //
+    do {
+        n = read(0, buf, (size_t)bc->fill_sz < sizeof (buf) ? (size_t)bc->fill_sz : sizeof (buf));
+    } while (n == -1 && errno == EINTR);
+    for (off = 0; off < n; off += w) {
+        w = write(bc->fill[1], buf + off, n - off);
+        if (w == -1) {
+            if (errno == EINTR) {
+                w = 0;
+                continue;
+            }
+            return (-1);
+        }
+    }
+    return (n);
+}
+
+/*
+ * Hand |len| bytes, which are in the source pipe, to every job.
+ */
+static bool
+round_out(struct broadcast *bc, size_t len)
+{
+    struct bc_out *out;
+    unsigned int last;
+    unsigned int i;
+    size_t left;
+    ssize_t n;
+
+    for (last = bc->n; last != 0 && bc->out[last - 1].dst < 0; --last) {
+        continue;
+    }
+    if (last == 0) {
+        return (false);
+    }
+    --last;
+
+    for (i = 0; i < last; ++i) {
+        out = &bc->out[i];
+        if (out->dst < 0) {
+            continue;
+        }
+        do {
+            n = tee(bc->in, out->stage[1], len, 0);
+        } while (n == -1 && errno == EINTR);
+        if (n != (ssize_t)len) {
+            eprintf("--broadcast-stdin: tee() took %zd of %zu bytes.\n", n, len);
+            return (false);
+        }
+    }
+    for (left = len; left != 0; left -= n) {
+        n = splice(bc->in, NULL, bc->out[last].stage[1], NULL, left, SPLICE_F_MOVE);
+        if (n == -1) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            eexplain_err(errno);
+            return (false);
+        }
+    }
+
+    // One job at a time is fine.  The round is not over until
+    // the slowest one has it all, anyway.
+    //
+    for (i = 0; i <= last; ++i) {
+        out = &bc->out[i];
+        if (out->dst < 0) {
+            continue;
+        }
+        for (left = len; left != 0; left -= n) {
+            n = splice(out->stage[0], NULL, out->dst, NULL, left, SPLICE_F_MOVE);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                drop_out(bc, out);
+                break;
+            }
+        }
+    }
+    return (bc->alive != 0);
+}
+
+static void *
+broadcast_thread(void *arg)
+{
+    struct broadcast *bc = (struct broadcast *)arg;
+    struct pollfd pfd[2];
+    unsigned int i;
+    int len;
+
+    while (true) {
+        pfd[0].fd = (bc->fill[1] >= 0) ? 0 : bc->in;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = bc->stop[0];
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pfd[1].revents != 0) {
+            break;
+        }
+        if (bc->fill[1] >= 0 && fill(bc) <= 0) {
+            break;
+        }
+        if (ioctl(bc->in, FIONREAD, &len) != 0) {
+            break;
+        }
+        if (len == 0) {
+            if (pfd[0].revents & (POLLHUP | POLLERR)) {
+                break;
+            }
+            continue;
+        }
+        if (!round_out(bc, (size_t)len)) {
+            break;
+        }
+    }
+
+    // End of file, for everyone.
+    //
+    for (i = 0; i < bc->n; ++i) {
+        if (bc->out[i].dst >= 0) {
+            drop_out(bc, &bc->out[i]);
+        }
+    }
+    return (NULL);
+}
+
+/*
+ * A job that stops reading must not kill ush.  A handler, unlike
+ * SIG_IGN, is not passed on through exec() to jobs started later.
+ */
+static void
+sigpipe_handler(int sig)
+{
+    (void)sig;
+}
+
+/**
+ * @brief Start feeding the jobs.  After all of them have been started.
+ *
+ * @param bc  IN  Broadcast state
+ * @return errno-style status
+ *
+ */
+int
+broadcast_start(struct broadcast *bc)
+{
+    struct sigaction sa;
+    unsigned int i;
+    int rv;
+
+    for (i = 0; i < bc->n; ++i) {
+        if (bc->out[i].dst >= 0) {
+            ++bc->alive;
+        }
+    }
+    memset(&sa, 0, sizeof (sa));
+    sa.sa_handler = sigpipe_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPIPE, &sa, &bc->saved_sigpipe);
+
+    rv = pthread_create(&bc->thread, NULL, broadcast_thread, bc);
+    if (rv != 0) {
+        eprintf("--broadcast-stdin: pthread_create() failed.\n");
+        eexplain_err(rv);
+        sigaction(SIGPIPE, &bc->saved_sigpipe, NULL);
+        return (rv);
+    }
+    bc->running = true;
+    return (0);
+}
+
+/**
+ * @brief Stop feeding the jobs, and let go of everything.
+ *
+ * @param bc  IN  Broadcast state
+ *
+ * By now, every job has exited, so nothing is left to wait for,
+ * except, maybe, fd 0.
+ *
+ */
+void
+broadcast_finish(struct broadcast *bc)
+{
+    unsigned int i;
+
+    if (bc->running) {
+        close_fd(&bc->stop[1]);
+        pthread_join(bc->thread, NULL);
+        sigaction(SIGPIPE, &bc->saved_sigpipe, NULL);
+        bc->running = false;
+    }
+    for (i = 0; i < bc->n; ++i) {
+        close_fd(&bc->out[i].stage[0]);
+        close_fd(&bc->out[i].stage[1]);
+        close_fd(&bc->out[i].dst);
+    }
+    free(bc->out);
+    bc->out = NULL;
+    bc->n = 0;
+    close_fd(&bc->fill[0]);
+    close_fd(&bc->fill[1]);
+    close_fd(&bc->stop[0]);
+    close_fd(&bc->stop[1]);
+}
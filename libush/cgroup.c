@@ -0,0 +1,411 @@
+/*
+ * Filename: cgroup.c
+ * Library: libush
+ * Brief: Run the child in a transient cgroup v2, with resource limits
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import openat()
+#include <signal.h>
+    // Import SIGCHLD
+#include <stdint.h>
+    // Import type uint64_t
+#include <stdlib.h>
+    // Import free()
+    // Import strtod()
+    // Import strtoul()
+    // Import strtoull()
+#include <string.h>
+    // Import strchr()
+    // Import strcmp()
+    // Import strcpy()
+    // Import strdup()
+    // Import strncmp()
+#include <sys/stat.h>
+    // Import mkdir()
+
+// The most that the kernel takes for pids.max (PID_MAX_LIMIT)
+#define CGROUP_PIDS_MAX (4 * 1024 * 1024)
+
+extern void *guard_mem(void *obj);
+extern void eexplain_err(int err);
+
+static unsigned int cgroup_seq;
+
+/**
+ * @brief Command-line option to run the child in a transient cgroup
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param dir  IN  A delegated cgroup v2 directory
+ * @return errno-style status
+ *
+ * --cgroup implies --fork.
+ *
+ */
+int
+cmd_cgroup(cmd_t *cmd, const char *dir)
+{
+    struct stat st;
+
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        int err = errno ? errno : ENOTDIR;
+        eprintf("--cgroup: '");
+        fshow_fname(errprint_fh, dir);
+        eprintf("' is not a cgroup directory.\n");
+        cmd->ioerr = err;
+        return (err);
+    }
+    free(cmd->cgroup_parent);
+    cmd->cgroup_parent = (char *)guard_mem(strdup(dir));
+    cmd->cmd_fork = true;
+    return (0);
+}
+
+int
+cmd_memory_max(cmd_t *cmd, const char *arg)
+{
+    unsigned long long bytes;
+
+    if (strcmp(arg, "max") != 0 && parse_size(arg, &bytes) != 0) {
+        eprintf("--memory-max: '%s' must be a size, like 512M, or 'max'.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    free(cmd->cgroup_memory_max);
+    cmd->cgroup_memory_max = (char *)guard_mem(strdup(arg));
+    return (0);
+}
+
+int
+cmd_pids_max(cmd_t *cmd, const char *arg)
+{
+    if (!(strcmp(arg, "max") == 0
+          || (isnumeric(arg) && strlen(arg) <= 8
+              && strtoul(arg, NULL, 10) <= CGROUP_PIDS_MAX))) {
+        eprintf("--pids-max: '%s' must be a number in 0..%u, or 'max'.\n",
+            arg, CGROUP_PIDS_MAX);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    free(cmd->cgroup_pids_max);
+    cmd->cgroup_pids_max = (char *)guard_mem(strdup(arg));
+    return (0);
+}
+
+int
+cmd_io_weight(cmd_t *cmd, const char *arg)
+{
+    unsigned long int w;
+
+    if (!isnumeric(arg) || (w = strtoul(arg, NULL, 10)) < 1 || w > 10000) {
+        eprintf("--io-weight: '%s' must be a number in 1..10000.\n", arg);
+        cmd->ioerr = ERANGE;
+        return (ERANGE);
+    }
+    snprintf(cmd->cgroup_io_weight, sizeof (cmd->cgroup_io_weight),
+        "default %lu", w);
+    return (0);
+}
+
+/*
+ * --cpu-max accepts the cgroup syntax, "<quota> <period>", or "max",
+ * but also <quota>:<period>, which does not need quoting on a command
+ * line, and <n>%, which is a percentage of one CPU, with the default
+ * period of 100ms.  So, 250% means two and a half CPUs.
+ */
+int
+cmd_cpu_max(cmd_t *cmd, const char *arg)
+{
+    char *buf;
+    size_t sz;
+    size_t len;
+
+    sz = sizeof (cmd->cgroup_cpu_max);
+    buf = cmd->cgroup_cpu_max;
+    len = strlen(arg);
+    if (len > 0 && arg[len - 1] == '%') {
+        char *end;
+        double pct;
+
+        pct = strtod(arg, &end);
+        if (end != arg + len - 1 || pct <= 0.0) {
+            eprintf("--cpu-max: Invalid percentage, '%s'.\n", arg);
+            cmd->ioerr = EINVAL;
+            return (EINVAL);
+        }
+        snprintf(buf, sz, "%llu 100000", (unsigned long long)(pct * 1000.0));
+        return (0);
+    }
+    if (len >= sz) {
+        eprintf("--cpu-max: '%s' is too long.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    strcpy(buf, arg);
+    for (; *buf; ++buf) {
+        if (*buf == ':') {
+            *buf = ' ';
+        }
+    }
+    return (0);
+}
+
+static int
+cg_write(int dirfd, const char *file, const char *value)
+{
+    int fd;
+    ssize_t len;
+    int err;
+
+    fd = openat(dirfd, file, O_WRONLY|O_CLOEXEC);
+    if (fd == -1) {
+        return (errno);
+    }
+    len = write(fd, value, strlen(value));
+    err = (len == -1) ? errno : 0;
+    close(fd);
+    return (err);
+}
+
+static ssize_t
+cg_read(int dirfd, const char *file, char *buf, size_t sz)
+{
+    int fd;
+    ssize_t len;
+
+    fd = openat(dirfd, file, O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+        return (-1);
+    }
+    len = read(fd, buf, sz - 1);
+    close(fd);
+    if (len < 0) {
+        return (-1);
+    }
+    buf[len] = '\0';
+    return (len);
+}
+
+static int
+cg_limit(cmd_t *cmd, const char *ctl, const char *file, const char *value)
+{
+    char enable[32];
+    int pfd;
+    int rv;
+
+    if (value == NULL || value[0] == '\0') {
+        return (0);
+    }
+
+    // Make sure the controller is enabled for our children.
+    // Enabling a controller that is already enabled is harmless.
+    //
+    pfd = open(cmd->cgroup_parent, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (pfd != -1) {
+        snprintf(enable, sizeof (enable), "+%s", ctl);
+        cg_write(pfd, "cgroup.subtree_control", enable);
+        close(pfd);
+    }
+
+    rv = cg_write(cmd->cgroup_fd, file, value);
+    if (rv != 0) {
+        eprintf("--cgroup: Could not write '%s' to %s/%s.\n",
+            value, cmd->cgroup_path, file);
+        eexplain_err(rv);
+    }
+    return (rv);
+}
+
+/**
+ * @brief Make the transient cgroup for one run, and set its limits.
+ *
+ * @param cmd  IN  Command "object"
+ * @return errno-style status
+ *
+ */
+int
+cgroup_create(cmd_t *cmd)
+{
+    int pfd;
+    int rv;
+
+    ++cgroup_seq;
+    snprintf(cmd->cgroup_path, sizeof (cmd->cgroup_path), "%s/ush-%d-%u",
+        cmd->cgroup_parent, (int)getpid(), cgroup_seq);
+    rv = mkdir(cmd->cgroup_path, 0755);
+    if (rv != 0) {
+        int err = errno;
+        eprintf("--cgroup: mkdir('");
+        fshow_fname(errprint_fh, cmd->cgroup_path);
+        eprintf("') failed.\n");
+        eexplain_err(err);
+        cmd->cgroup_path[0] = '\0';
+        return (err);
+    }
+
+    cmd->cgroup_fd = open(cmd->cgroup_path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (cmd->cgroup_fd == -1) {
+        int err = errno;
+        rmdir(cmd->cgroup_path);
+        cmd->cgroup_path[0] = '\0';
+        return (err);
+    }
+    cmd->cg_have_memory_peak = false;
+    cmd->cg_have_cpu_stat = false;
+
+    // Best effort: the memory controller is needed for memory.peak,
+    // even if there is no --memory-max.
+    //
+    pfd = open(cmd->cgroup_parent, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (pfd != -1) {
+        cg_write(pfd, "cgroup.subtree_control", "+memory");
+        close(pfd);
+    }
+
+    rv = cg_limit(cmd, "memory", "memory.max", cmd->cgroup_memory_max);
+    if (rv == 0) {
+        rv = cg_limit(cmd, "cpu", "cpu.max", cmd->cgroup_cpu_max);
+    }
+    if (rv == 0) {
+        rv = cg_limit(cmd, "io", "io.weight", cmd->cgroup_io_weight);
+    }
+    if (rv == 0) {
+        rv = cg_limit(cmd, "pids", "pids.max", cmd->cgroup_pids_max);
+    }
+    if (rv != 0) {
+        cgroup_destroy(cmd);
+        return (rv);
+    }
+    if (cmd->verbose) {
+        eprintf("cgroup %s\n", cmd->cgroup_path);
+    }
+    return (0);
+}
+
+/**
+ * @brief fork(), with the child moved into the transient cgroup.
+ *
+ * @param cmd  IN  Command "object"
+ * @return pid, like fork()
+ *
+ * This is a plain fork(), not a raw clone3(CLONE_INTO_CGROUP).
+ * clone3() goes around the C library, which then does not reset its
+ * own locks (malloc, stdio) in the child, or run atfork handlers;
+ * and the child goes on to call eprintf() and the like, before exec(),
+ * while some other thread in the parent may hold those locks.
+ *
+ */
+pid_t
+cgroup_fork(cmd_t *cmd)
+{
+    pid_t pid;
+
+    pid = fork();
+    if (pid == 0) {
+        int rv = cg_write(cmd->cgroup_fd, "cgroup.procs", "0");
+        if (rv != 0) {
+            eprintf("--cgroup: Could not move into %s.\n", cmd->cgroup_path);
+            eexplain_err(rv);
+            fflush(errprint_fh);
+            _exit(126);
+        }
+    }
+    return (pid);
+}
+
+/**
+ * @brief Kill every process in the transient cgroup.
+ *
+ * @param cmd  IN  Command "object"
+ *
+ * cgroup.kill is new in Linux 5.14.  If it is not there,
+ * then there is nothing more that can be done, here.
+ *
+ */
+void
+cgroup_kill(cmd_t *cmd)
+{
+    if (cmd->cgroup_path[0] == '\0' || cmd->cgroup_fd == -1) {
+        return;
+    }
+    cg_write(cmd->cgroup_fd, "cgroup.kill", "1");
+}
+
+static unsigned long long
+cg_stat_field(const char *buf, const char *name)
+{
+    const char *s;
+    size_t len;
+
+    len = strlen(name);
+    for (s = buf; s != NULL && *s; s = strchr(s, '\n')) {
+        if (*s == '\n') {
+            ++s;
+        }
+        if (strncmp(s, name, len) == 0 && s[len] == ' ') {
+            return (strtoull(s + len + 1, NULL, 10));
+        }
+    }
+    return (0);
+}
+
+/**
+ * @brief Collect statistics for the exit report, then remove the cgroup.
+ *
+ * @param cmd  IN  Command "object"
+ *
+ * If some descendant of the child is still alive and in the cgroup,
+ * then the cgroup cannot be removed.  It is left, and we say so.
+ *
+ */
+void
+cgroup_destroy(cmd_t *cmd)
+{
+    char buf[1024];
+
+    if (cmd->cgroup_path[0] == '\0' || cmd->cgroup_fd == -1) {
+        return;
+    }
+
+    if (cg_read(cmd->cgroup_fd, "memory.peak", buf, sizeof (buf)) > 0) {
+        cmd->cg_memory_peak = strtoull(buf, NULL, 10);
+        cmd->cg_have_memory_peak = true;
+    }
+    if (cg_read(cmd->cgroup_fd, "cpu.stat", buf, sizeof (buf)) > 0) {
+        cmd->cg_usage_usec     = cg_stat_field(buf, "usage_usec");
+        cmd->cg_user_usec      = cg_stat_field(buf, "user_usec");
+        cmd->cg_system_usec    = cg_stat_field(buf, "system_usec");
+        cmd->cg_nr_throttled   = cg_stat_field(buf, "nr_throttled");
+        cmd->cg_throttled_usec = cg_stat_field(buf, "throttled_usec");
+        cmd->cg_have_cpu_stat = true;
+    }
+
+    close(cmd->cgroup_fd);
+    cmd->cgroup_fd = -1;
+    if (rmdir(cmd->cgroup_path) != 0) {
+        int err = errno;
+        eprintf("--cgroup: Could not remove %s.\n", cmd->cgroup_path);
+        eexplain_err(err);
+    }
+}
@@ -0,0 +1,101 @@
+/*
+ * Filename: cmd-cpus.c
+ * Library: libush
+ * Brief: Set CPU affinity before running the child process
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <limits.h>
+    // Import CHAR_BIT
+#include <sched.h>
+    // Import sched_setaffinity()
+    // Import type cpu_set_t
+    // Import CPU_SET()
+    // Import CPU_ZERO()
+
+#define BITS_PER_LONG (sizeof (unsigned long) * CHAR_BIT)
+
+extern void eexplain_err(int err);
+
+/**
+ * @brief Command-line option to set the CPU affinity of the program
+ *
+ * @param cmd   IN  Command "object" that hold context/control information
+ * @param list  IN  A list of CPUs, like "0-3,8"
+ * @return errno-style status
+ *
+ * The option only records the CPUs.  Affinity is set by cpus_apply(),
+ * for the program only, not for a ush parent that stays around.
+ *
+ */
+int
+cmd_cpus(cmd_t *cmd, const char *list)
+{
+    size_t count;
+    int rv;
+
+    rv = parse_id_list(list, cmd->cpus, USH_CPUS_MAX, &count);
+    if (rv != 0) {
+        eprintf("--cpus: Invalid CPU list, '%s'.\n", list);
+        cmd->ioerr = rv;
+        return (rv);
+    }
+    cmd->cpus_set = true;
+    return (0);
+}
+
+/**
+ * @brief Set the CPU affinity asked for by --cpus.
+ *
+ * @param cmd  IN  Command "object"
+ * @return errno-style status
+ *
+ * In the child, after fork() and before exec();
+ * or, without --fork, in ush itself, just before exec().
+ *
+ */
+int
+cpus_apply(cmd_t *cmd)
+{
+    cpu_set_t cpus;
+    size_t cpu;
+
+    if (!cmd->cpus_set) {
+        return (0);
+    }
+
+    CPU_ZERO(&cpus);
+    for (cpu = 0; cpu < USH_CPUS_MAX && cpu < CPU_SETSIZE; ++cpu) {
+        if (cmd->cpus[cpu / BITS_PER_LONG] & (1UL << (cpu % BITS_PER_LONG))) {
+            CPU_SET(cpu, &cpus);
+        }
+    }
+
+    if (sched_setaffinity(0, sizeof (cpus), &cpus) != 0) {
+        int err = errno;
+        eprintf("sched_setaffinity() failed.\n");
+        eexplain_err(err);
+        return (err);
+    }
+    return (0);
+}
@@ -0,0 +1,280 @@
+/*
+ * Filename: cmd-limit.c
+ * Library: libush
+ * Brief: Host-wide concurrency limit -- hold one of N slots while running
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var EDOM
+    // Import var EINVAL
+#include <fcntl.h>
+    // Import open()
+    // Import constant O_CLOEXEC
+#include <stdlib.h>
+    // Import free()
+    // Import getenv()
+    // Import strtoul()
+#include <string.h>
+    // Import strdup()
+    // Import strrchr()
+#include <sys/file.h>
+    // Import flock()
+#include <sys/stat.h>
+    // Import mkdir()
+    // Import chmod()
+    // Import fchmod()
+#include <time.h>
+    // Import nanosleep()
+
+#define LIMIT_MAX_SLOTS 1024
+
+extern void *guard_mem(void *obj);
+extern void eexplain_err(int err);
+
+/*
+ * A key becomes part of a file name, so keep it simple.
+ * No '/', and no leading '.'.
+ */
+static bool
+is_limit_key(const char *key, size_t len)
+{
+    size_t i;
+
+    if (len == 0 || key[0] == '.') {
+        return (false);
+    }
+    for (i = 0; i < len; ++i) {
+        int c = key[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+              || (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.')) {
+            return (false);
+        }
+    }
+    return (true);
+}
+
+/**
+ * @brief Command-line option to limit concurrency across ush processes
+ *
+ * @param cmd       IN  Command "object" that hold context/control information
+ * @param key_slots IN  KEY:N
+ * @return errno-style status
+ *
+ * Nothing is locked, yet.  That is done by limit_acquire(),
+ * just before running the program.
+ *
+ * --limit implies --fork.  The slot must be held until the child
+ * exits, so somebody has to be around to wait for it.
+ *
+ */
+int
+cmd_limit(cmd_t *cmd, const char *key_slots)
+{
+    const char *colon;
+    unsigned long int n;
+
+    colon = strrchr(key_slots, ':');
+    if (colon == NULL || !is_limit_key(key_slots, colon - key_slots)) {
+        eprintf("--limit: Invalid key in '%s'.\n", key_slots);
+        eprintf("--limit=KEY:N, where KEY is [A-Za-z0-9_.-]+\n");
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    if (!isnumeric(colon + 1)) {
+        eprintf("--limit: %s argument must be numeric.\n", colon + 1);
+        cmd->ioerr = EDOM;
+        return (EDOM);
+    }
+    n = strtoul(colon + 1, NULL, 10);
+    if (n == 0 || n > LIMIT_MAX_SLOTS) {
+        eprintf("--limit: slots must be in 1..%u.\n", LIMIT_MAX_SLOTS);
+        cmd->ioerr = ERANGE;
+        return (ERANGE);
+    }
+
+    free(cmd->limit_key);
+    cmd->limit_key = (char *)guard_mem(strdup(key_slots));
+    cmd->limit_slots = (unsigned int)n;
+    cmd->cmd_fork = true;
+    return (0);
+}
+
+/*
+ * Make sure |dir| exists.  If we are the one to create it,
+ * make it world-writable and sticky, like /tmp, so that it
+ * can be shared by all users.
+ */
+static int
+limit_dir_ok(const char *dir)
+{
+    int rv;
+
+    rv = mkdir(dir, 0755);
+    if (rv == 0) {
+        chmod(dir, 01777);
+        return (0);
+    }
+    if (errno != EEXIST) {
+        return (errno);
+    }
+    return (access(dir, W_OK|X_OK) == 0 ? 0 : errno);
+}
+
+static const char *
+limit_dir(void)
+{
+    const char *dir;
+
+    dir = getenv("USH_LIMIT_DIR");
+    if (dir != NULL) {
+        return (limit_dir_ok(dir) == 0 ? dir : NULL);
+    }
+    if (limit_dir_ok("/run/ush") == 0 && limit_dir_ok("/run/ush/limit") == 0) {
+        return ("/run/ush/limit");
+    }
+    if (limit_dir_ok("/tmp/ush-limit") == 0) {
+        return ("/tmp/ush-limit");
+    }
+    return (NULL);
+}
+
+/*
+ * Open a slot file, creating it if need be.
+ *
+ * A slot file that we create is made readable and writable by all,
+ * whatever the umask, so that ush processes of other users can take
+ * the same slots.  flock() does not need write access, so a slot file
+ * that was created without it can still be opened read-only, and locked.
+ */
+static int
+open_slot(const char *dir, const char *key, size_t keylen, unsigned int slot, int *fdp)
+{
+    char path[4096];
+    int fd;
+    int err;
+
+    snprintf(path, sizeof (path), "%s/%.*s.%u",
+        dir, (int)keylen, key, slot);
+    fd = open(path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0666);
+    if (fd >= 0) {
+        fchmod(fd, 0666);
+    }
+    else if (errno == EEXIST) {
+        fd = open(path, O_RDWR|O_CLOEXEC);
+        if (fd == -1 && errno == EACCES) {
+            fd = open(path, O_RDONLY|O_CLOEXEC);
+        }
+    }
+    if (fd == -1) {
+        err = errno;
+        eprintf("--limit: open('");
+        fshow_fname(errprint_fh, path);
+        eprintf("') failed.\n");
+        eexplain_err(err);
+        return (err);
+    }
+    *fdp = fd;
+    return (0);
+}
+
+/**
+ * @brief Wait for, and take, one of the slots named by --limit.
+ *
+ * @param cmd  IN  Command "object"
+ * @return errno-style status
+ *
+ * Try every slot without blocking, starting at a slot picked by pid,
+ * so that concurrent ush processes do not all pile up on slot 0.
+ * If all slots are busy, back off and try again.  Back off starts
+ * at 1ms and doubles, up to 128ms, so that a slot is taken soon after
+ * it is freed, without a herd of processes spinning.
+ *
+ */
+int
+limit_acquire(cmd_t *cmd)
+{
+    const char *dir;
+    size_t keylen;
+    unsigned int start;
+    unsigned int i;
+    long backoff_ns;
+    struct timespec ts;
+
+    if (cmd->limit_key == NULL || cmd->limit_held) {
+        return (0);
+    }
+
+    dir = limit_dir();
+    if (dir == NULL) {
+        eprintf("--limit: No usable directory for slot files.\n");
+        return (EACCES);
+    }
+
+    keylen = strrchr(cmd->limit_key, ':') - cmd->limit_key;
+    start = (unsigned int)getpid() % cmd->limit_slots;
+    backoff_ns = 1000000;
+    while (true) {
+        for (i = 0; i < cmd->limit_slots; ++i) {
+            unsigned int slot;
+            int fd;
+            int err;
+
+            slot = (start + i) % cmd->limit_slots;
+            err = open_slot(dir, cmd->limit_key, keylen, slot, &fd);
+            if (err != 0) {
+                return (err);
+            }
+            if (flock(fd, LOCK_EX|LOCK_NB) == 0) {
+                cmd->limit_fd = fd;
+                cmd->limit_held = true;
+                if (cmd->verbose) {
+                    eprintf("limit %.*s: slot %u of %u\n",
+                        (int)keylen, cmd->limit_key, slot, cmd->limit_slots);
+                }
+                return (0);
+            }
+            err = errno;
+            close(fd);
+            if (err != EWOULDBLOCK && err != EINTR) {
+                eprintf("--limit: flock() failed.\n");
+                eexplain_err(err);
+                return (err);
+            }
+        }
+
+        ts.tv_sec = 0;
+        ts.tv_nsec = backoff_ns;
+        nanosleep(&ts, NULL);
+        if (backoff_ns < 128000000) {
+            backoff_ns *= 2;
+        }
+    }
+}
+
+void
+limit_release(cmd_t *cmd)
+{
+    if (cmd->limit_held) {
+        close(cmd->limit_fd);
+        cmd->limit_held = false;
+    }
+}
@@ -0,0 +1,176 @@
+/*
+ * Filename: cmd-mempolicy.c
+ * Library: libush
+ * Brief: Set NUMA memory policy and THP mode before running child process
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <limits.h>
+    // Import CHAR_BIT
+#include <string.h>
+    // Import strcmp()
+    // Import strncmp()
+#include <sys/prctl.h>
+    // Import prctl()
+#include <sys/syscall.h>
+    // Import SYS_set_mempolicy
+#include <linux/mempolicy.h>
+    // Import MPOL_BIND
+    // Import MPOL_INTERLEAVE
+    // Import MPOL_PREFERRED
+
+#ifndef PR_SET_THP_DISABLE
+#define PR_SET_THP_DISABLE 41
+#endif
+
+#define BITS_PER_LONG  (sizeof (unsigned long) * CHAR_BIT)
+
+extern void eexplain_err(int err);
+
+struct mpol_name {
+    const char *name;
+    int mode;
+};
+
+static struct mpol_name mpol_names[] = {
+    { "bind",       MPOL_BIND       },
+    { "interleave", MPOL_INTERLEAVE },
+    { "preferred",  MPOL_PREFERRED  },
+    { NULL, 0 }
+};
+
+/**
+ * @brief Command-line option to set the NUMA memory policy
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  [<policy>:]<nodes>
+ * @return errno-style status
+ *
+ */
+int
+cmd_numa_node(cmd_t *cmd, const char *arg)
+{
+    const char *list;
+    size_t count;
+    int mode;
+    int rv;
+
+    mode = MPOL_BIND;
+    list = arg;
+    if (!(*arg >= '0' && *arg <= '9')) {
+        struct mpol_name *mp;
+
+        for (mp = mpol_names; mp->name != NULL; ++mp) {
+            size_t len = strlen(mp->name);
+            if (strncmp(arg, mp->name, len) == 0 && arg[len] == ':') {
+                mode = mp->mode;
+                list = arg + len + 1;
+                break;
+            }
+        }
+        if (mp->name == NULL) {
+            eprintf("--numa-node: Invalid policy in '%s'.\n", arg);
+            eprintf("Policy must be one of { bind | interleave | preferred }.\n");
+            cmd->ioerr = EINVAL;
+            return (EINVAL);
+        }
+    }
+
+    rv = parse_id_list(list, cmd->numa_nodes, USH_NODES_MAX, &count);
+    if (rv != 0) {
+        eprintf("--numa-node: Invalid node list, '%s'.\n", list);
+        cmd->ioerr = rv;
+        return (rv);
+    }
+    if (mode == MPOL_PREFERRED && count != 1) {
+        eprintf("--numa-node: preferred takes exactly one node.\n");
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+
+    cmd->numa_set = true;
+    cmd->numa_mode = mode;
+    return (0);
+}
+
+/**
+ * @brief Command-line option to disable or enable transparent huge pages
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  disable | enable
+ * @return errno-style status
+ *
+ */
+int
+cmd_thp(cmd_t *cmd, const char *arg)
+{
+    if (strcmp(arg, "disable") == 0) {
+        cmd->thp_disable = true;
+    }
+    else if (strcmp(arg, "enable") == 0) {
+        cmd->thp_disable = false;
+    }
+    else {
+        eprintf("--thp: '%s' must be one of { disable | enable }.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+
+    cmd->thp_set = true;
+    return (0);
+}
+
+/**
+ * @brief Set the memory policy and THP mode asked for by --numa-node and --thp.
+ *
+ * @param cmd  IN  Command "object"
+ * @return errno-style status
+ *
+ * In the child, after fork() and before exec();
+ * or, without --fork, in ush itself, just before exec().
+ *
+ */
+int
+mempolicy_apply(cmd_t *cmd)
+{
+    int err;
+
+    if (cmd->numa_set) {
+        // The kernel wants one more than the number of bits in the mask.
+        if (syscall(SYS_set_mempolicy, cmd->numa_mode, cmd->numa_nodes, USH_NODES_MAX + 1) != 0) {
+            err = errno;
+            eprintf("set_mempolicy(%d) failed.\n", cmd->numa_mode);
+            eexplain_err(err);
+            return (err);
+        }
+    }
+    if (cmd->thp_set) {
+        if (prctl(PR_SET_THP_DISABLE, (unsigned long)cmd->thp_disable, 0, 0, 0) != 0) {
+            err = errno;
+            eprintf("prctl(PR_SET_THP_DISABLE, %d) failed.\n", (int)cmd->thp_disable);
+            eexplain_err(err);
+            return (err);
+        }
+    }
+    return (0);
+}
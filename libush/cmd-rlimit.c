@@ -0,0 +1,288 @@
+/*
+ * Filename: cmd-rlimit.c
+ * Library: libush
+ * Brief: Set resource limits and OOM score adjustment before running
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import open()
+#include <stdio.h>
+    // Import snprintf()
+#include <stdlib.h>
+    // Import strtol()
+    // Import strtoull()
+#include <string.h>
+    // Import strchr()
+    // Import strcmp()
+    // Import strncmp()
+#include <sys/resource.h>
+    // Import getrlimit()
+    // Import setrlimit()
+    // Import RLIMIT_*
+
+extern void eexplain_err(int err);
+
+struct rlimit_name {
+    const char *name;
+    int resource;
+};
+
+static struct rlimit_name rlimit_names[] = {
+    { "as",         RLIMIT_AS         },
+    { "core",       RLIMIT_CORE       },
+    { "cpu",        RLIMIT_CPU        },
+    { "data",       RLIMIT_DATA       },
+    { "fsize",      RLIMIT_FSIZE      },
+    { "locks",      RLIMIT_LOCKS      },
+    { "memlock",    RLIMIT_MEMLOCK    },
+    { "msgqueue",   RLIMIT_MSGQUEUE   },
+    { "nice",       RLIMIT_NICE       },
+    { "nofile",     RLIMIT_NOFILE     },
+    { "nproc",      RLIMIT_NPROC      },
+    { "rss",        RLIMIT_RSS        },
+    { "rtprio",     RLIMIT_RTPRIO     },
+    { "rttime",     RLIMIT_RTTIME     },
+    { "sigpending", RLIMIT_SIGPENDING },
+    { "stack",      RLIMIT_STACK      },
+    { NULL, 0 }
+};
+
+/*
+ * Parse one limit, which ends at |end|.
+ */
+static int
+parse_rlim(const char *str, const char *end, rlim_t *ret)
+{
+    unsigned long long n;
+    size_t len;
+    char *sfx;
+
+    len = end - str;
+    if ((len == 9 && strncmp(str, "unlimited", 9) == 0)
+        || (len == 8 && strncmp(str, "infinity", 8) == 0)) {
+        *ret = RLIM_INFINITY;
+        return (0);
+    }
+    if (!(*str >= '0' && *str <= '9')) {
+        return (EINVAL);
+    }
+    errno = 0;
+    n = strtoull(str, &sfx, 10);
+    if (errno != 0) {
+        return (errno);
+    }
+    if (sfx < end) {
+        unsigned int shift;
+
+        switch (*sfx) {
+        case 'K': case 'k':
+            shift = 10;
+            break;
+        case 'M': case 'm':
+            shift = 20;
+            break;
+        case 'G': case 'g':
+            shift = 30;
+            break;
+        default:
+            return (EINVAL);
+        }
+        ++sfx;
+        if (n > (~0ULL >> shift)) {
+            return (ERANGE);
+        }
+        n <<= shift;
+    }
+    if (sfx != end) {
+        return (EINVAL);
+    }
+    *ret = (rlim_t)n;
+    return (0);
+}
+
+/**
+ * @brief Command-line option to set a resource limit
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  <resource>=<limits>
+ * @return errno-style status
+ *
+ */
+int
+cmd_rlimit(cmd_t *cmd, const char *arg)
+{
+    struct rlimit_name *rn;
+    struct rlimit rl;
+    const char *eq;
+    const char *lim;
+    const char *colon;
+    const char *end;
+    int rv;
+
+    eq = strchr(arg, '=');
+    rn = NULL;
+    if (eq != NULL) {
+        for (rn = rlimit_names; rn->name != NULL; ++rn) {
+            if (strlen(rn->name) == (size_t)(eq - arg)
+                && strncmp(arg, rn->name, eq - arg) == 0) {
+                break;
+            }
+        }
+    }
+    if (rn == NULL || rn->name == NULL) {
+        eprintf("--rlimit: Unknown resource in '%s'.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+
+    // A limit given only in part keeps the rest of any earlier --rlimit.
+    rv = 0;
+    if (cmd->rlimit_set & (1U << rn->resource)) {
+        rl = cmd->rlimit[rn->resource];
+    }
+    else {
+        rv = getrlimit(rn->resource, &rl);
+    }
+    if (rv != 0) {
+        int err = errno;
+        eprintf("getrlimit(%s) failed.\n", rn->name);
+        eexplain_err(err);
+        cmd->ioerr = err;
+        return (err);
+    }
+
+    lim = eq + 1;
+    end = lim + strlen(lim);
+    colon = strchr(lim, ':');
+    if (colon == NULL) {
+        rv = parse_rlim(lim, end, &rl.rlim_cur);
+        rl.rlim_max = rl.rlim_cur;
+    }
+    else {
+        rv = 0;
+        if (colon > lim) {
+            rv = parse_rlim(lim, colon, &rl.rlim_cur);
+        }
+        if (rv == 0 && colon + 1 < end) {
+            rv = parse_rlim(colon + 1, end, &rl.rlim_max);
+        }
+        if (rv == 0 && colon == lim && colon + 1 == end) {
+            rv = EINVAL;
+        }
+    }
+    if (rv != 0) {
+        eprintf("--rlimit: Invalid limit, '%s'.\n", lim);
+        cmd->ioerr = rv;
+        return (rv);
+    }
+
+    if (rl.rlim_max != RLIM_INFINITY && rl.rlim_cur > rl.rlim_max) {
+        eprintf("--rlimit: soft limit is above the hard limit, in '%s'.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    cmd->rlimit[rn->resource] = rl;
+    cmd->rlimit_set |= 1U << rn->resource;
+    return (0);
+}
+
+/**
+ * @brief Command-line option to adjust the OOM-killer score
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  The adjustment, in -1000..1000
+ * @return errno-style status
+ *
+ */
+int
+cmd_oom_score_adj(cmd_t *cmd, const char *arg)
+{
+    char *end;
+    long adj;
+
+    errno = 0;
+    adj = strtol(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || adj < -1000 || adj > 1000) {
+        eprintf("--oom-score-adj: '%s' must be a number in -1000..1000.\n", arg);
+        cmd->ioerr = ERANGE;
+        return (ERANGE);
+    }
+
+    cmd->oom_score_set = true;
+    cmd->oom_score_adj = (int)adj;
+    return (0);
+}
+
+/**
+ * @brief Set the resource limits and OOM score adjustment, if asked.
+ *
+ * @param cmd  IN  Command "object"
+ * @return errno-style status
+ *
+ * In the child, after fork(), or, without --fork, in ush itself,
+ * just before exec().
+ *
+ */
+int
+rlimit_apply(cmd_t *cmd)
+{
+    struct rlimit_name *rn;
+    char buf[16];
+    ssize_t len;
+    int fd;
+    int err;
+
+    for (rn = rlimit_names; rn->name != NULL; ++rn) {
+        if ((cmd->rlimit_set & (1U << rn->resource)) == 0) {
+            continue;
+        }
+        if (setrlimit(rn->resource, &cmd->rlimit[rn->resource]) != 0) {
+            err = errno;
+            eprintf("setrlimit(%s) failed.\n", rn->name);
+            eexplain_err(err);
+            return (err);
+        }
+    }
+    if (!cmd->oom_score_set) {
+        return (0);
+    }
+
+    fd = open("/proc/self/oom_score_adj", O_WRONLY|O_CLOEXEC);
+    if (fd == -1) {
+        err = errno;
+        eprintf("open('/proc/self/oom_score_adj') failed.\n");
+        eexplain_err(err);
+        return (err);
+    }
+    snprintf(buf, sizeof (buf), "%d", cmd->oom_score_adj);
+    len = write(fd, buf, strlen(buf));
+    err = (len == -1) ? errno : 0;
+    close(fd);
+    if (err != 0) {
+        eprintf("Write of %d to oom_score_adj failed.\n", cmd->oom_score_adj);
+        eexplain_err(err);
+        return (err);
+    }
+    return (0);
+}
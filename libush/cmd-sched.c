@@ -0,0 +1,281 @@
+/*
+ * Filename: cmd-sched.c
+ * Library: libush
+ * Brief: Set scheduling policy, nice value and I/O priority before running
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <sched.h>
+    // Import sched_setscheduler()
+    // Import SCHED_BATCH
+    // Import SCHED_IDLE
+#include <stdlib.h>
+    // Import strtol()
+#include <string.h>
+    // Import strcmp()
+    // Import strncmp()
+#include <sys/resource.h>
+    // Import setpriority()
+#include <sys/syscall.h>
+    // Import SYS_ioprio_set
+
+// glibc has no ioprio.h.  These are from the kernel's include/uapi/linux/ioprio.h
+//
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_CLASS_RT     1
+#define IOPRIO_CLASS_BE     2
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+
+extern void eexplain_err(int err);
+
+struct name_value {
+    const char *name;
+    int value;
+};
+
+static struct name_value sched_names[] = {
+    { "other",  SCHED_OTHER },
+    { "batch",  SCHED_BATCH },
+    { "idle",   SCHED_IDLE  },
+    { "fifo",   SCHED_FIFO  },
+    { "rr",     SCHED_RR    },
+    { NULL, 0 }
+};
+
+static struct name_value ioprio_names[] = {
+    { "idle",        IOPRIO_CLASS_IDLE },
+    { "best-effort", IOPRIO_CLASS_BE   },
+    { "be",          IOPRIO_CLASS_BE   },
+    { "realtime",    IOPRIO_CLASS_RT   },
+    { "rt",          IOPRIO_CLASS_RT   },
+    { NULL, 0 }
+};
+
+/*
+ * Look up the name at the start of |arg|, which is terminated
+ * by either ':' or '\0'.  Set |*rest| to point to what follows
+ * the ':', or NULL if there is no ':'.
+ */
+static struct name_value *
+lookup_name(struct name_value *tbl, const char *arg, const char **rest)
+{
+    const char *colon;
+    size_t len;
+
+    colon = strchr(arg, ':');
+    len = (colon != NULL) ? (size_t)(colon - arg) : strlen(arg);
+    for (; tbl->name != NULL; ++tbl) {
+        if (strlen(tbl->name) == len && strncmp(arg, tbl->name, len) == 0) {
+            *rest = (colon != NULL) ? colon + 1 : NULL;
+            return (tbl);
+        }
+    }
+    return (NULL);
+}
+
+static int
+parse_int(const char *str, long lo, long hi, int *ret)
+{
+    char *end;
+    long n;
+
+    errno = 0;
+    n = strtol(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0') {
+        return (EINVAL);
+    }
+    if (n < lo || n > hi) {
+        return (ERANGE);
+    }
+    *ret = (int)n;
+    return (0);
+}
+
+/**
+ * @brief Command-line option to set the scheduling policy
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  <policy>[:<priority>]
+ * @return errno-style status
+ *
+ */
+int
+cmd_sched(cmd_t *cmd, const char *arg)
+{
+    struct name_value *nv;
+    struct sched_param param;
+    const char *prio;
+    int policy;
+    int rv;
+
+    nv = lookup_name(sched_names, arg, &prio);
+    if (nv == NULL) {
+        eprintf("--sched: Invalid policy, '%s'.\n", arg);
+        eprintf("Policy must be one of { other | batch | idle | fifo | rr }.\n");
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    policy = nv->value;
+
+    param.sched_priority = 0;
+    if (policy == SCHED_FIFO || policy == SCHED_RR) {
+        param.sched_priority = sched_get_priority_min(policy);
+        if (prio != NULL) {
+            rv = parse_int(prio,
+                    sched_get_priority_min(policy),
+                    sched_get_priority_max(policy),
+                    &param.sched_priority);
+            if (rv != 0) {
+                eprintf("--sched: Invalid priority, '%s'.\n", prio);
+                cmd->ioerr = rv;
+                return (rv);
+            }
+        }
+    }
+    else if (prio != NULL) {
+        eprintf("--sched: Policy '%s' takes no priority.\n", nv->name);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+
+    cmd->sched_set = true;
+    cmd->sched_policy = policy;
+    cmd->sched_priority = param.sched_priority;
+    return (0);
+}
+
+/**
+ * @brief Command-line option to set the nice value
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  The nice value, in -20..19
+ * @return errno-style status
+ *
+ */
+int
+cmd_nice(cmd_t *cmd, const char *arg)
+{
+    int nice;
+    int rv;
+
+    rv = parse_int(arg, -20, 19, &nice);
+    if (rv != 0) {
+        eprintf("--nice: '%s' must be a number in -20..19.\n", arg);
+        cmd->ioerr = rv;
+        return (rv);
+    }
+
+    cmd->nice_set = true;
+    cmd->nice = nice;
+    return (0);
+}
+
+/**
+ * @brief Command-line option to set the I/O scheduling class and priority
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  <class>[:<level>]
+ * @return errno-style status
+ *
+ */
+int
+cmd_ioprio(cmd_t *cmd, const char *arg)
+{
+    struct name_value *nv;
+    const char *level_str;
+    int level;
+    int rv;
+
+    nv = lookup_name(ioprio_names, arg, &level_str);
+    if (nv == NULL) {
+        eprintf("--ioprio: Invalid class, '%s'.\n", arg);
+        eprintf("Class must be one of { idle | best-effort | realtime }.\n");
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+
+    level = (nv->value == IOPRIO_CLASS_IDLE) ? 0 : 4;
+    if (level_str != NULL) {
+        if (nv->value == IOPRIO_CLASS_IDLE) {
+            eprintf("--ioprio: Class 'idle' takes no level.\n");
+            cmd->ioerr = EINVAL;
+            return (EINVAL);
+        }
+        rv = parse_int(level_str, 0, 7, &level);
+        if (rv != 0) {
+            eprintf("--ioprio: '%s' must be a level in 0..7.\n", level_str);
+            cmd->ioerr = rv;
+            return (rv);
+        }
+    }
+
+    cmd->ioprio = IOPRIO_PRIO_VALUE(nv->value, level);
+    return (0);
+}
+
+/**
+ * @brief Set the scheduling policy, nice value and I/O priority, if asked.
+ *
+ * @param cmd  IN  Command "object"
+ * @return errno-style status
+ *
+ * In the child, after fork(), or, without --fork, in ush itself,
+ * just before exec().
+ *
+ */
+int
+sched_apply(cmd_t *cmd)
+{
+    struct sched_param param;
+    int err;
+
+    if (cmd->sched_set) {
+        param.sched_priority = cmd->sched_priority;
+        if (sched_setscheduler(0, cmd->sched_policy, &param) != 0) {
+            err = errno;
+            eprintf("sched_setscheduler(%d, %d) failed.\n",
+                cmd->sched_policy, cmd->sched_priority);
+            eexplain_err(err);
+            return (err);
+        }
+    }
+    if (cmd->nice_set) {
+        if (setpriority(PRIO_PROCESS, 0, cmd->nice) != 0) {
+            err = errno;
+            eprintf("setpriority(%d) failed.\n", cmd->nice);
+            eexplain_err(err);
+            return (err);
+        }
+    }
+    if (cmd->ioprio != 0) {
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, cmd->ioprio) != 0) {
+            err = errno;
+            eprintf("ioprio_set(0x%x) failed.\n", cmd->ioprio);
+            eexplain_err(err);
+            return (err);
+        }
+    }
+    return (0);
+}
@@ -0,0 +1,623 @@
+/*
+ * Filename: cmd-timeout.c
+ * Library: libush
+ * Brief: Time limit for the child, and teardown of its whole process tree
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <dirent.h>
+    // Import opendir()
+    // Import readdir()
+#include <errno.h>
+    // Import var errno
+#include <signal.h>
+    // Import kill()
+    // Import sigaction()
+    // Import sigprocmask()
+#include <stdlib.h>
+    // Import strtol()
+    // Import realloc()
+#include <stdio.h>
+    // Import fopen()
+    // Import sscanf()
+#include <string.h>
+    // Import strcmp()
+    // Import strncmp()
+    // Import strrchr()
+#include <sys/prctl.h>
+    // Import prctl()
+    // Import PR_SET_CHILD_SUBREAPER
+#include <sys/signalfd.h>
+    // Import signalfd()
+#include <sys/wait.h>
+    // Import waitpid()
+#include <time.h>
+    // Import nanosleep()
+
+extern void *guard_mem(void *obj);
+
+struct signal_name {
+    const char *name;
+    int signo;
+};
+
+static struct signal_name signal_names[] = {
+    { "HUP",  SIGHUP  },
+    { "INT",  SIGINT  },
+    { "QUIT", SIGQUIT },
+    { "KILL", SIGKILL },
+    { "USR1", SIGUSR1 },
+    { "USR2", SIGUSR2 },
+    { "PIPE", SIGPIPE },
+    { "ALRM", SIGALRM },
+    { "TERM", SIGTERM },
+    { "CONT", SIGCONT },
+    { "STOP", SIGSTOP },
+    { NULL, 0 }
+};
+
+static int forwarded_signals[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM, 0 };
+
+static struct sigaction saved_actions[sizeof (forwarded_signals) / sizeof (int)];
+
+static volatile pid_t forward_pgid;
+
+// --batch takes the forwarded signals from a signalfd, instead.
+// This is the signal mask from before they were blocked.
+//
+static sigset_t saved_mask;
+
+static int saved_subreaper;
+
+// Children that ush already had, before the child was started.
+// Those must never be touched by the teardown.
+//
+static pid_t *pre_children;
+static size_t pre_children_count;
+
+// The child's process tree, when time ran out.
+//
+static pid_t *tree;
+static size_t tree_count;
+
+// Orphans that were reparented to ush, as subreaper, and left running,
+// because there was no timeout.  They are reaped, without waiting,
+// the next time around.
+//
+static pid_t *adopted;
+static size_t adopted_count;
+
+/**
+ * @brief Parse a signal name or number.
+ *
+ * @param str  IN  A name, with or without "SIG", or a number
+ * @return the signal number, or 0 if |str| is not a valid signal
+ *
+ */
+int
+parse_signal(const char *str)
+{
+    struct signal_name *sn;
+    char *end;
+    long n;
+
+    if (str[0] >= '0' && str[0] <= '9') {
+        n = strtol(str, &end, 10);
+        if (*end != '\0' || n <= 0 || n >= NSIG) {
+            return (0);
+        }
+        return ((int)n);
+    }
+    if (strncmp(str, "SIG", 3) == 0) {
+        str += 3;
+    }
+    for (sn = signal_names; sn->name != NULL; ++sn) {
+        if (strcmp(str, sn->name) == 0) {
+            return (sn->signo);
+        }
+    }
+    return (0);
+}
+
+/**
+ * @brief Command-line option to set a time limit on the child
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  A duration
+ * @return errno-style status
+ *
+ * --timeout implies --fork.
+ *
+ */
+int
+cmd_timeout(cmd_t *cmd, const char *arg)
+{
+    int rv;
+
+    rv = parse_duration(arg, &cmd->timeout_ns);
+    if (rv != 0 || cmd->timeout_ns == 0) {
+        eprintf("--timeout: Invalid duration, '%s'.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    cmd->cmd_fork = true;
+    return (0);
+}
+
+int
+cmd_kill_after(cmd_t *cmd, const char *arg)
+{
+    int rv;
+
+    rv = parse_duration(arg, &cmd->kill_after_ns);
+    if (rv != 0) {
+        eprintf("--kill-after: Invalid duration, '%s'.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    return (0);
+}
+
+int
+cmd_signal(cmd_t *cmd, const char *arg)
+{
+    cmd->timeout_signal = parse_signal(arg);
+    if (cmd->timeout_signal == 0) {
+        eprintf("--signal: Invalid signal, '%s'.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    return (0);
+}
+
+/*
+ * Append all current children of process |pid| (of any thread) to |*pidv|.
+ * |pid| 0 is ush itself.
+ */
+static void
+add_children(pid_t pid, pid_t **pidv, size_t *count)
+{
+    char dir[64];
+    DIR *dirp;
+    struct dirent *dp;
+
+    if (pid == 0) {
+        snprintf(dir, sizeof (dir), "/proc/self/task");
+    }
+    else {
+        snprintf(dir, sizeof (dir), "/proc/%d/task", (int)pid);
+    }
+    dirp = opendir(dir);
+    if (dirp == NULL) {
+        return;
+    }
+    while ((dp = readdir(dirp)) != NULL) {
+        char path[sizeof (dir) + 256 + sizeof ("//children")];
+        FILE *f;
+        long kid;
+
+        if (dp->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, sizeof (path), "%s/%s/children", dir, dp->d_name);
+        f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        while (fscanf(f, "%ld", &kid) == 1) {
+            *pidv = (pid_t *)guard_mem(realloc(*pidv, (*count + 1) * sizeof (pid_t)));
+            (*pidv)[(*count)++] = (pid_t)kid;
+        }
+        fclose(f);
+    }
+    closedir(dirp);
+}
+
+/*
+ * All current children of ush (of any thread).
+ */
+static void
+list_children(pid_t **pidv, size_t *count)
+{
+    *count = 0;
+    add_children(0, pidv, count);
+}
+
+/*
+ * The whole process tree under |root|, not counting |root| itself.
+ */
+static void
+list_descendants(pid_t root, pid_t **pidv, size_t *count)
+{
+    size_t i;
+
+    *count = 0;
+    add_children(root, pidv, count);
+    for (i = 0; i < *count && *count < 65536; ++i) {
+        add_children((*pidv)[i], pidv, count);
+    }
+}
+
+static bool
+pid_in(pid_t pid, const pid_t *pidv, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        if (pidv[i] == pid) {
+            return (true);
+        }
+    }
+    return (false);
+}
+
+/*
+ * Process group and session of |pid|, from /proc/<pid>/stat.
+ */
+static bool
+pid_pgrp_sid(pid_t pid, pid_t *pgrp, pid_t *sid)
+{
+    char path[64];
+    char buf[512];
+    char *p;
+    FILE *f;
+    size_t n;
+    int pg;
+    int sess;
+
+    snprintf(path, sizeof (path), "/proc/%d/stat", (int)pid);
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return (false);
+    }
+    n = fread(buf, 1, sizeof (buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    // The command name, in parentheses, can have spaces in it.
+    p = strrchr(buf, ')');
+    if (p == NULL || sscanf(p + 1, " %*c %*d %d %d", &pg, &sess) != 2) {
+        return (false);
+    }
+    *pgrp = pg;
+    *sid = sess;
+    return (true);
+}
+
+/*
+ * Is |pid|, a child of ush, one that the timed-out child left behind?
+ *
+ * Never one that ush had before the child was started.  Otherwise,
+ * only if it was in the child's process tree when time ran out, or
+ * in the child's process group, or in a session other than ours
+ * (a daemon that called setsid(), and was reparented to us, as
+ * subreaper).  So, children that other threads of a library caller
+ * started in the meantime, like other ush_popen2() handles, are left
+ * alone, exit status and all.
+ */
+static bool
+is_left_behind(cmd_t *cmd, pid_t pid)
+{
+    pid_t pgrp;
+    pid_t sid;
+
+    if (pid_in(pid, pre_children, pre_children_count)) {
+        return (false);
+    }
+    if (pid_in(pid, tree, tree_count)) {
+        return (true);
+    }
+    if (!pid_pgrp_sid(pid, &pgrp, &sid)) {
+        return (false);
+    }
+    return (pgrp == cmd->child || sid != getsid(0));
+}
+
+/*
+ * Reap any orphans that were taken in, as subreaper, and have exited.
+ */
+static void
+reap_adopted(void)
+{
+    size_t i;
+
+    i = 0;
+    while (i < adopted_count) {
+        if (waitpid(adopted[i], NULL, WNOHANG) != 0) {
+            adopted[i] = adopted[--adopted_count];
+        }
+        else {
+            ++i;
+        }
+    }
+}
+
+/*
+ * Is anything that the timed-out child left behind still around?
+ * A process that was killed might not be gone yet, or might be
+ * a zombie that is not yet reparented to us, to be reaped.
+ */
+static bool
+left_behind_alive(cmd_t *cmd)
+{
+    size_t i;
+
+    if (kill(-cmd->child, 0) == 0) {
+        return (true);
+    }
+    for (i = 0; i < tree_count; ++i) {
+        if (kill(tree[i], 0) == 0) {
+            return (true);
+        }
+    }
+    return (false);
+}
+
+static void
+forward_signal(int sig)
+{
+    if (forward_pgid > 0) {
+        kill(-forward_pgid, sig);
+    }
+}
+
+/**
+ * @brief Get ready to run a child with a time limit.  Before fork().
+ *
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+timeout_prepare(cmd_t *cmd)
+{
+    int i;
+
+    cmd->timed_out = false;
+    if (cmd->timeout_ns == 0) {
+        return;
+    }
+    reap_adopted();
+    tree_count = 0;
+
+    saved_subreaper = 0;
+    prctl(PR_GET_CHILD_SUBREAPER, &saved_subreaper, 0, 0, 0);
+    prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+    list_children(&pre_children, &pre_children_count);
+
+    // With --supervise, the supervisor passes on signals, itself.
+    //
+    forward_pgid = 0;
+    if (cmd->supervise) {
+        return;
+    }
+    for (i = 0; forwarded_signals[i] != 0; ++i) {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof (sa));
+        sa.sa_handler = forward_signal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(forwarded_signals[i], &sa, &saved_actions[i]);
+    }
+}
+
+/**
+ * @brief The child side of a time limit.  After fork(), before exec().
+ *
+ * @param cmd  IN  Command "object"
+ *
+ * Put the child in a process group of its own,
+ * and give back the default handling of the forwarded signals.
+ *
+ */
+void
+timeout_child_setup(cmd_t *cmd)
+{
+    int i;
+
+    if (cmd->own_pgrp) {
+        setpgid(0, 0);
+        sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    }
+    if (cmd->timeout_ns == 0) {
+        return;
+    }
+    setpgid(0, 0);
+    if (cmd->supervise) {
+        return;
+    }
+    for (i = 0; forwarded_signals[i] != 0; ++i) {
+        sigaction(forwarded_signals[i], &saved_actions[i], NULL);
+    }
+}
+
+/**
+ * @brief The parent side of a time limit.  After fork().
+ *
+ * @param cmd  IN  Command "object"
+ *
+ * Also call setpgid() in the parent, so that the process group
+ * surely exists by the time we might want to signal it.
+ *
+ */
+void
+timeout_parent_setup(cmd_t *cmd)
+{
+    if (cmd->own_pgrp) {
+        setpgid(cmd->child, cmd->child);
+    }
+    if (cmd->timeout_ns == 0) {
+        return;
+    }
+    setpgid(cmd->child, cmd->child);
+    forward_pgid = cmd->child;
+}
+
+/**
+ * @brief Take the forwarded signals from a signalfd.  For --batch.
+ *
+ * @return the signalfd, or -1
+ *
+ * The jobs of a batch are each in a process group of its own
+ * (cmd->own_pgrp), so that a job that ran out of time can be killed,
+ * with its descendants.  So, they do not get INT, QUIT, TERM or HUP
+ * from the terminal; ush reads them from the signalfd, and passes them on.
+ * The forwarded signals are blocked until timeout_signalfd_close().
+ *
+ */
+int
+timeout_signalfd(void)
+{
+    sigset_t set;
+    int i;
+
+    sigemptyset(&set);
+    for (i = 0; forwarded_signals[i] != 0; ++i) {
+        sigaddset(&set, forwarded_signals[i]);
+    }
+    sigprocmask(SIG_BLOCK, &set, &saved_mask);
+    return (signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC));
+}
+
+/**
+ * @brief Stop taking the forwarded signals from a signalfd.
+ *
+ * @param sfd  IN  What timeout_signalfd() returned
+ *
+ */
+void
+timeout_signalfd_close(int sfd)
+{
+    if (sfd >= 0) {
+        close(sfd);
+    }
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+}
+
+/**
+ * @brief Signal the child's whole process tree.
+ *
+ * @param cmd  IN  Command "object"
+ * @param sig  IN  Signal number
+ *
+ */
+void
+timeout_kill(cmd_t *cmd, int sig)
+{
+    if (cmd->verbose) {
+        eprintf("timeout: signal %d to process group %d\n",
+            sig, (int)cmd->child);
+    }
+    if (tree_count == 0) {
+        list_descendants(cmd->child, &tree, &tree_count);
+    }
+    kill(-cmd->child, sig);
+    kill(cmd->child, sig);
+    if (sig == SIGKILL && cmd->cgroup_parent != NULL) {
+        cgroup_kill(cmd);
+    }
+}
+
+/**
+ * @brief After the child has been reaped, finish off its descendants.
+ *
+ * @param cmd  IN  Command "object"
+ *
+ * Only if the time limit was hit.  Otherwise, anything the child
+ * left running is left running, as it would be without --timeout.
+ * Either way, stop being a subreaper, and put back the signal handlers.
+ *
+ */
+void
+timeout_teardown(cmd_t *cmd)
+{
+    pid_t *kids;
+    size_t nkids;
+    size_t i;
+    int pass;
+
+    // Orphans from earlier runs, that have exited since.
+    //
+    reap_adopted();
+    if (cmd->timeout_ns == 0) {
+        return;
+    }
+
+    forward_pgid = 0;
+    kids = NULL;
+    if (cmd->timed_out) {
+        kill(-cmd->child, SIGKILL);
+        if (cmd->cgroup_parent != NULL) {
+            cgroup_kill(cmd);
+        }
+
+        // Orphans that were reparented to us, as subreaper.
+        // Killing one can orphan more, so go around until there are none,
+        // and nothing is left that has yet to be handed to us.
+        // Give up after about a second.
+        //
+        for (pass = 0; pass < 1000; ++pass) {
+            bool found = false;
+
+            list_children(&kids, &nkids);
+            for (i = 0; i < nkids; ++i) {
+                if (is_left_behind(cmd, kids[i])) {
+                    kill(kids[i], SIGKILL);
+                    waitpid(kids[i], NULL, 0);
+                    found = true;
+                }
+            }
+            if (!found) {
+                struct timespec ts;
+
+                if (!left_behind_alive(cmd)) {
+                    break;
+                }
+                ts.tv_sec = 0;
+                ts.tv_nsec = 1000000;
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+    else {
+        // Left running, as they would be without --timeout.
+        // But, they are ours to reap, now.
+        //
+        list_children(&kids, &nkids);
+        for (i = 0; i < nkids; ++i) {
+            if (is_left_behind(cmd, kids[i])
+                && !pid_in(kids[i], adopted, adopted_count)) {
+                adopted = (pid_t *)guard_mem(realloc(adopted,
+                    (adopted_count + 1) * sizeof (pid_t)));
+                adopted[adopted_count++] = kids[i];
+            }
+        }
+    }
+    free(kids);
+    tree_count = 0;
+    reap_adopted();
+
+    prctl(PR_SET_CHILD_SUBREAPER, saved_subreaper, 0, 0, 0);
+    if (cmd->supervise) {
+        return;
+    }
+    for (i = 0; forwarded_signals[i] != 0; ++i) {
+        sigaction(forwarded_signals[i], &saved_actions[i], NULL);
+    }
+}
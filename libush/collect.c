@@ -0,0 +1,677 @@
+/*
+ * Filename: collect.c
+ * Library: libush
+ * Brief: Collect the output of many children, without mangling it
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <batch.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <stdlib.h>
+    // Import realloc()
+    // Import free()
+#include <string.h>
+    // Import memchr()
+    // Import memrchr()
+    // Import memmove()
+    // Import strcmp()
+    // Import strcspn()
+    // Import strncmp()
+#include <sys/epoll.h>
+    // Import epoll_create1()
+    // Import epoll_ctl()
+#include <time.h>
+    // Import clock_gettime()
+    // Import localtime_r()
+    // Import strftime()
+
+extern void *guard_mem(void *obj);
+extern void eexplain_err(int err);
+
+#define OUTPUT_SPILL_DEFAULT (1024 * 1024)
+
+/**
+ * @brief Command-line option to choose how job output is interleaved
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  "lines" or "job"
+ * @return errno-style status
+ *
+ */
+int
+cmd_output_order(cmd_t *cmd, const char *arg)
+{
+    if (strcmp(arg, "lines") == 0) {
+        cmd->output_keep_order = false;
+    }
+    else if (strcmp(arg, "job") == 0) {
+        cmd->output_keep_order = true;
+    }
+    else {
+        eprintf("--output-order: '%s' must be 'lines' or 'job'.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    return (0);
+}
+
+/**
+ * @brief Command-line option to choose what goes at the start of each line
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  A comma-separated list of "tag" and "time", or "none"
+ * @return errno-style status
+ *
+ */
+int
+cmd_output_prefix(cmd_t *cmd, const char *arg)
+{
+    const char *s;
+    size_t len;
+    unsigned int prefix;
+
+    prefix = 0;
+    for (s = arg; *s != '\0'; s += len + (s[len] == ',')) {
+        len = strcspn(s, ",");
+        if (len == 3 && strncmp(s, "tag", 3) == 0) {
+            prefix |= OUTPUT_PREFIX_TAG;
+        }
+        else if (len == 4 && strncmp(s, "time", 4) == 0) {
+            prefix |= OUTPUT_PREFIX_TIME;
+        }
+        else if (len == 4 && strncmp(s, "none", 4) == 0) {
+            prefix |= OUTPUT_PREFIX_NONE;
+        }
+        else {
+            eprintf("--output-prefix: '%s' must be a list of 'tag' and 'time', or 'none'.\n", arg);
+            cmd->ioerr = EINVAL;
+            return (EINVAL);
+        }
+    }
+    cmd->output_prefix = prefix ? prefix : OUTPUT_PREFIX_NONE;
+    return (0);
+}
+
+/**
+ * @brief Command-line option to limit the output held in memory, per job
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  Bytes, with an optional suffix of K, M or G
+ * @return errno-style status
+ *
+ */
+int
+cmd_output_spill(cmd_t *cmd, const char *arg)
+{
+    unsigned long long n;
+
+    if (parse_size(arg, &n) != 0 || n == 0) {
+        eprintf("--output-spill: '%s' must be a size in bytes, like 64K or 1M.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    cmd->output_spill = (size_t)n;
+    return (0);
+}
+
+/**
+ * @brief Get ready to collect the output of the jobs in a job table.
+ *
+ * @param c    OUT  The collector
+ * @param cmd  IN   Command "object", with the --output-* options
+ * @param tab  IN   All of the jobs, in manifest order
+ * @return errno-style status
+ *
+ */
+int
+collect_init(struct collector *c, cmd_t *cmd, struct job_table *tab)
+{
+    int fd;
+
+    c->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (c->epfd == -1) {
+        int err = errno;
+        eprintf("epoll_create1() failed.\n");
+        eexplain_err(err);
+        return (err);
+    }
+    c->keep_order = cmd->output_keep_order;
+    c->prefix = cmd->output_prefix ? cmd->output_prefix : OUTPUT_PREFIX_TAG;
+    c->prefix &= ~OUTPUT_PREFIX_NONE;
+    c->spill_limit = cmd->output_spill ? cmd->output_spill : OUTPUT_SPILL_DEFAULT;
+    c->tab = tab;
+    c->head = 0;
+    c->free_list = NULL;
+    if (c->keep_order) {
+        jobtab_index_live(tab);
+    }
+    for (fd = 0; fd < 3; ++fd) {
+        c->w[fd].fd = fd;
+        c->w[fd].niov = 0;
+        c->w[fd].npinned = 0;
+    }
+    return (0);
+}
+
+static int
+epoll_add(struct collector *c, int fd, struct job_ref *ref)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = ref;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        int err = errno;
+        eprintf("epoll_ctl() failed.\n");
+        eexplain_err(err);
+        return (err);
+    }
+    return (0);
+}
+
+/**
+ * @brief Watch a job that has just been started.
+ *
+ * @param c    IN  The collector
+ * @param job  IN  The job, with its pipes in |job->fd| and its pidfd in |job->cmd|
+ * @return errno-style status
+ *
+ */
+int
+collect_add(struct collector *c, struct batch_job *job)
+{
+    int i;
+    int rv;
+
+    rv = 0;
+    for (i = 0; i < 3; ++i) {
+        job->ref[i].job = job;
+        job->ref[i].which = i;
+    }
+    if (job->cmd->child_pidfd >= 0) {
+        rv = epoll_add(c, job->cmd->child_pidfd, &job->ref[0]);
+    }
+    for (i = 1; rv == 0 && i <= 2; ++i) {
+        rv = epoll_add(c, job->fd[i], &job->ref[i]);
+    }
+    return (rv);
+}
+
+/*
+ * Write all of |iov|, even if writev() takes only some of it.
+ */
+static int
+writev_all(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t n;
+
+    while (cnt > 0) {
+        n = writev(fd, iov, cnt);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno);
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --cnt;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return (0);
+}
+
+static void
+writer_flush(struct writer *w)
+{
+    struct out_buf *ob;
+    int err;
+    int i;
+
+    if (w->niov != 0 && w->fd >= 0) {
+        err = writev_all(w->fd, w->iov, w->niov);
+        if (err != 0) {
+            eprintf("Write of collected output to fd %d failed.\n", w->fd);
+            eexplain_err(err);
+            // Nowhere for it to go.  Keep draining the children, anyway.
+            w->fd = -1;
+        }
+    }
+    w->niov = 0;
+
+    // Now that nothing points into them, the buffers can be moved.
+    //
+    for (i = 0; i < w->npinned; ++i) {
+        ob = w->pinned[i];
+        ob->len -= ob->off;
+        memmove(ob->buf, ob->buf + ob->off, ob->len);
+        ob->off = 0;
+        ob->pinned = false;
+        if (ob->len == 0 && ob->cap > 65536) {
+            free(ob->buf);
+            ob->buf = NULL;
+            ob->cap = 0;
+        }
+    }
+    w->npinned = 0;
+}
+
+static void
+writers_flush(struct collector *c)
+{
+    writer_flush(&c->w[1]);
+    writer_flush(&c->w[2]);
+}
+
+/**
+ * @brief Write everything that has been gathered, one writev() per destination.
+ *
+ * @param c  IN  The collector
+ *
+ * Then, let go of the jobs that are all written.  Not before the end
+ * of a pass around the event loop, which may still have events for them.
+ *
+ */
+void
+collect_flush(struct collector *c)
+{
+    struct batch_job *job;
+
+    writers_flush(c);
+    while ((job = c->free_list) != NULL) {
+        c->free_list = job->next_free;
+        job_free(c->tab, job);
+    }
+}
+
+/*
+ * Hand the next |n| bytes of |ob->buf|, from |ob->off|, to the writer
+ * for |fd|.  A count, not an end offset: writers_flush() can move
+ * the data to the start of the buffer, and then |ob->off| is 0.
+ */
+static void
+writer_add(struct collector *c, int fd, struct out_buf *ob, size_t n)
+{
+    struct writer *w;
+
+    if (n == 0) {
+        return;
+    }
+    w = &c->w[fd];
+    if (w->niov == WRITER_IOV || w->npinned == WRITER_IOV) {
+        writers_flush(c);
+    }
+    w->iov[w->niov].iov_base = ob->buf + ob->off;
+    w->iov[w->niov].iov_len = n;
+    ++w->niov;
+    ob->off += n;
+    if (!ob->pinned) {
+        ob->pinned = true;
+        w->pinned[w->npinned] = ob;
+        ++w->npinned;
+    }
+}
+
+/*
+ * Make room for |n| more bytes in |ob|.  If the writer points into
+ * |ob|, the buffer may not move, so write first.
+ */
+static void
+out_reserve(struct collector *c, struct out_buf *ob, size_t n)
+{
+    size_t cap;
+
+    if (ob->len + n <= ob->cap) {
+        return;
+    }
+    if (ob->pinned) {
+        writers_flush(c);
+        if (ob->len + n <= ob->cap) {
+            return;
+        }
+    }
+    cap = ob->cap ? ob->cap * 2 : 4096;
+    while (cap < ob->len + n) {
+        cap *= 2;
+    }
+    ob->buf = (char *)guard_mem(realloc(ob->buf, cap));
+    ob->cap = cap;
+}
+
+static void
+out_append(struct collector *c, struct out_buf *ob, const char *data, size_t len)
+{
+    out_reserve(c, ob, len);
+    memcpy(ob->buf + ob->len, data, len);
+    ob->len += len;
+}
+
+static size_t
+format_prefix(struct collector *c, struct batch_job *job, char *buf, size_t sz)
+{
+    struct timespec ts;
+    struct tm tm;
+    size_t len;
+
+    if (c->prefix == 0) {
+        return (0);
+    }
+    len = snprintf(buf, sz, "[");
+    if (c->prefix & OUTPUT_PREFIX_TAG) {
+        len += snprintf(buf + len, sz - len, "%u", job->id);
+    }
+    if (c->prefix & OUTPUT_PREFIX_TIME) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        localtime_r(&ts.tv_sec, &tm);
+        if (c->prefix & OUTPUT_PREFIX_TAG) {
+            buf[len++] = ' ';
+        }
+        len += strftime(buf + len, sz - len, "%H:%M:%S", &tm);
+        len += snprintf(buf + len, sz - len, ".%03ld", ts.tv_nsec / 1000000);
+    }
+    len += snprintf(buf + len, sz - len, "] ");
+    return (len);
+}
+
+/*
+ * Move everything held for |ob| to its spill file, if there is too much.
+ */
+static void
+out_spill(struct collector *c, struct out_buf *ob)
+{
+    if (ob->len - ob->off <= c->spill_limit || ob->pinned) {
+        return;
+    }
+    if (ob->spill == NULL) {
+        ob->spill = tmpfile();
+        if (ob->spill == NULL) {
+            // Keep it in memory, then.
+            return;
+        }
+    }
+    if (fwrite(ob->buf, 1, ob->len, ob->spill) != ob->len) {
+        eprintf("Write to spill file failed.\n");
+        return;
+    }
+    ob->len = 0;
+}
+
+/*
+ * Write the spill file of |ob|, if any, then hand over the rest.
+ * Only for the job that is going out live.
+ */
+static void
+out_replay(struct collector *c, int fd, struct out_buf *ob)
+{
+    char buf[65536];
+    struct iovec iov;
+    size_t n;
+
+    if (ob->spill != NULL) {
+        writers_flush(c);
+        rewind(ob->spill);
+        while ((n = fread(buf, 1, sizeof (buf), ob->spill)) != 0) {
+            if (c->w[fd].fd >= 0) {
+                iov.iov_base = buf;
+                iov.iov_len = n;
+                writev_all(c->w[fd].fd, &iov, 1);
+            }
+        }
+        fclose(ob->spill);
+        ob->spill = NULL;
+    }
+    writer_add(c, fd, ob, ob->len - ob->off);
+}
+
+/*
+ * Send out whatever of |job|'s stream |fd| can go out now.
+ */
+static void
+out_emit(struct collector *c, struct batch_job *job, int fd)
+{
+    struct out_buf *ob;
+    char *nl;
+
+    ob = &job->out[fd];
+    if (c->keep_order) {
+        if (job->id - 1 == c->head) {
+            writer_add(c, fd, ob, ob->len - ob->off);
+        }
+        else {
+            out_spill(c, ob);
+        }
+        return;
+    }
+
+    // Whole lines only.  But, a line longer than the spill limit
+    // is not held forever; it goes out in pieces.
+    //
+    nl = (char *)memrchr(ob->buf + ob->off, '\n', ob->len - ob->off);
+    if (nl != NULL) {
+        writer_add(c, fd, ob, nl + 1 - (ob->buf + ob->off));
+    }
+    if (ob->len - ob->off > c->spill_limit) {
+        writer_add(c, fd, ob, ob->len - ob->off);
+    }
+}
+
+/**
+ * @brief Read what is in a job's pipe, and send out what can go out.
+ *
+ * @param c    IN  The collector
+ * @param job  IN  The job
+ * @param fd   IN  1 for stdout, or 2 for stderr
+ * @return true if anything was read; false at end of file, or if there
+ *         is nothing to read, right now
+ *
+ */
+bool
+collect_read(struct collector *c, struct batch_job *job, int fd)
+{
+    static char rbuf[65536];
+    char prefix[64];
+    size_t plen;
+    struct out_buf *ob;
+    const char *p;
+    const char *nl;
+    size_t len;
+    size_t seg;
+    ssize_t n;
+
+    if (job->fd[fd] < 0) {
+        return (false);
+    }
+    do {
+        n = read(job->fd[fd], rbuf, sizeof (rbuf));
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        if (n == -1 && errno == EAGAIN) {
+            return (false);
+        }
+        collect_close(c, job, fd);
+        return (false);
+    }
+
+    ob = &job->out[fd];
+    plen = format_prefix(c, job, prefix, sizeof (prefix));
+    for (p = rbuf, len = n; len != 0; p += seg, len -= seg) {
+        if (ob->bol && plen != 0) {
+            out_append(c, ob, prefix, plen);
+        }
+        nl = (const char *)memchr(p, '\n', len);
+        seg = (nl != NULL) ? (size_t)(nl - p + 1) : len;
+        out_append(c, ob, p, seg);
+        ob->bol = (nl != NULL);
+    }
+    out_emit(c, job, fd);
+    return (true);
+}
+
+/**
+ * @brief Stop reading one of a job's pipes.
+ *
+ * @param c    IN  The collector
+ * @param job  IN  The job
+ * @param fd   IN  1 for stdout, or 2 for stderr
+ *
+ */
+void
+collect_close(struct collector *c, struct batch_job *job, int fd)
+{
+    if (job->fd[fd] < 0) {
+        return;
+    }
+    // Take it out of the epoll set explicitly.  A child that has
+    // not yet reached exec() may still have a copy of it.
+    //
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, job->fd[fd], NULL);
+    close(job->fd[fd]);
+    job->fd[fd] = -1;
+}
+
+/*
+ * All of |job|'s output can go out, now.
+ */
+static void
+out_finish(struct collector *c, struct batch_job *job)
+{
+    int fd;
+
+    for (fd = 1; fd <= 2; ++fd) {
+        out_replay(c, fd, &job->out[fd]);
+    }
+}
+
+/*
+ * Done with |job|; let go of it after the next flush.
+ */
+static void
+job_retire(struct collector *c, struct batch_job *job)
+{
+    job->next_free = c->free_list;
+    c->free_list = job;
+}
+
+/*
+ * In job order, send out the jobs at the head, as far as they can go.
+ * The first unfinished job goes out live.
+ */
+static void
+head_advance(struct collector *c)
+{
+    struct job_table *tab;
+    struct batch_job *job;
+
+    tab = c->tab;
+    while (c->head < tab->njobs) {
+        job = tab->live[c->head];
+        if (job != NULL) {
+            // Whatever it has so far goes out now; the rest goes out live.
+            out_finish(c, job);
+            if (!job->done) {
+                break;
+            }
+            tab->live[c->head] = NULL;
+            job_retire(c, job);
+        }
+        else if ((tab->job[c->head].flags & JOB_DONE) == 0) {
+            // Not started
+            break;
+        }
+        ++c->head;
+    }
+}
+
+/**
+ * @brief A job has exited, and both of its pipes are closed.
+ *
+ * @param c    IN  The collector
+ * @param job  IN  The job; the collector has it, from now on
+ *
+ * A last line without a newline gets one, so that it cannot be
+ * run together with some other job's output.
+ * In job order, the next jobs go out, as far as they can.
+ *
+ */
+void
+collect_done(struct collector *c, struct batch_job *job)
+{
+    struct out_buf *ob;
+    int fd;
+
+    job->done = true;
+    c->tab->job[job->id - 1].flags |= JOB_DONE;
+    for (fd = 1; fd <= 2; ++fd) {
+        ob = &job->out[fd];
+        if (!ob->bol) {
+            out_append(c, ob, "\n", 1);
+            ob->bol = true;
+        }
+        if (!c->keep_order) {
+            writer_add(c, fd, ob, ob->len - ob->off);
+        }
+    }
+    if (!c->keep_order) {
+        job_retire(c, job);
+        return;
+    }
+    if (job->id - 1 == c->head) {
+        head_advance(c);
+    }
+}
+
+/**
+ * @brief A job that is not to be run.
+ *
+ * @param c  IN  The collector
+ * @param i  IN  Index of the job
+ *
+ */
+void
+collect_skip(struct collector *c, unsigned int i)
+{
+    c->tab->job[i].flags |= JOB_DONE;
+    if (c->keep_order && i == c->head) {
+        head_advance(c);
+    }
+}
+
+/**
+ * @brief Write whatever is left, and let go of everything.
+ *
+ * @param c  IN  The collector
+ *
+ */
+void
+collect_fini(struct collector *c)
+{
+    collect_flush(c);
+    if (c->epfd >= 0) {
+        close(c->epfd);
+        c->epfd = -1;
+    }
+}
@@ -0,0 +1,629 @@
+/*
+ * Filename: compress.c
+ * Library: libush
+ * Brief: Compress the child's stdout or stderr, in parallel, as it is written
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import pipe2()
+#include <pthread.h>
+    // Import pthread_create()
+    // Import pthread_join()
+    // Import pthread_mutex_*()
+    // Import pthread_cond_*()
+#include <sched.h>
+    // Import sched_getaffinity()
+    // Import CPU_COUNT()
+#include <stdlib.h>
+    // Import calloc()
+    // Import malloc()
+    // Import strtol()
+#include <string.h>
+    // Import strncmp()
+    // Import strchr()
+#include <zlib.h>
+    // Import deflateInit2()
+    // Import deflate()
+    // Import deflateBound()
+#ifdef USH_ZSTD
+#include <zstd.h>
+    // Import ZSTD_compressCCtx()
+    // Import ZSTD_compressBound()
+#endif
+
+extern void *guard_mem(void *obj);
+extern void eexplain_err(int err);
+
+// The same block size as pigz.
+//
+#define BLOCK_SIZE (128 * 1024)
+
+enum {
+    COMPRESS_NONE,
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD,
+};
+
+enum slot_state {
+    SLOT_EMPTY,         // Free, for the reader
+    SLOT_QUEUED,        // Read, waiting for a worker
+    SLOT_BUSY,          // Being compressed
+    SLOT_DONE,          // Compressed, waiting to be written
+};
+
+struct slot {
+    enum slot_state state;
+    unsigned long long seq;
+    unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_cap;
+    size_t out_len;
+    int err;
+};
+
+struct compress_stream {
+    int fd;                     // 1 or 2
+    int src;                    // Read end of the child's pipe
+    int algo;
+    int level;
+
+    pthread_mutex_t mu;
+    pthread_cond_t  cv;
+    pthread_t reader;
+    bool reader_started;
+    pthread_t *workers;
+    unsigned int nworkers;      // Only those that were started
+    struct slot *slots;
+    unsigned int nslots;
+    unsigned long long next_write;
+    bool quit;
+    int err;
+};
+
+typedef struct compress_stream compress_stream_t;
+
+static unsigned int
+default_threads(void)
+{
+    cpu_set_t set;
+    int n;
+
+    if (sched_getaffinity(0, sizeof (set), &set) != 0) {
+        return (1);
+    }
+    n = CPU_COUNT(&set);
+    return (n > 0 ? (unsigned int)n : 1);
+}
+
+static int
+cmd_compress(cmd_t *cmd, int fd, const char *opt, const char *arg)
+{
+    const char *colon;
+    size_t len;
+    int algo;
+    long level;
+
+    colon = strchr(arg, ':');
+    len = colon ? (size_t)(colon - arg) : strlen(arg);
+    if (len == 4 && strncmp(arg, "gzip", 4) == 0) {
+        algo = COMPRESS_GZIP;
+        level = Z_DEFAULT_COMPRESSION;
+    }
+    else if (len == 4 && strncmp(arg, "zstd", 4) == 0) {
+#ifdef USH_ZSTD
+        algo = COMPRESS_ZSTD;
+        level = 3;
+#else
+        eprintf("%s: This ush was built without zstd.\n", opt);
+        cmd->ioerr = ENOTSUP;
+        return (ENOTSUP);
+#endif
+    }
+    else {
+        eprintf("%s: Expected gzip[:<level>] or zstd[:<level>], not '%s'.\n",
+            opt, arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+
+    if (colon != NULL) {
+        char *end;
+
+        errno = 0;
+        level = strtol(colon + 1, &end, 10);
+        if (errno != 0 || end == colon + 1 || *end != '\0'
+            || (algo == COMPRESS_GZIP && (level < 1 || level > 9))
+            || (algo == COMPRESS_ZSTD && (level < 1 || level > 22))) {
+            eprintf("%s: Invalid level, '%s'.\n", opt, colon + 1);
+            cmd->ioerr = EINVAL;
+            return (EINVAL);
+        }
+    }
+    cmd->compress_algo[fd] = algo;
+    cmd->compress_level[fd] = (int)level;
+    cmd->cmd_fork = true;
+    return (0);
+}
+
+/**
+ * @brief Command-line option to compress the child's stdout
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  gzip[:<level>] or zstd[:<level>]
+ * @return errno-style status
+ *
+ * --stdout-compress implies --fork.
+ *
+ */
+int
+cmd_stdout_compress(cmd_t *cmd, const char *arg)
+{
+    return (cmd_compress(cmd, 1, "--stdout-compress", arg));
+}
+
+int
+cmd_stderr_compress(cmd_t *cmd, const char *arg)
+{
+    return (cmd_compress(cmd, 2, "--stderr-compress", arg));
+}
+
+int
+cmd_compress_threads(cmd_t *cmd, const char *arg)
+{
+    char *end;
+    long n;
+
+    errno = 0;
+    n = strtol(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || n < 1 || n > 1024) {
+        eprintf("--compress-threads: '%s' must be a number in 1..1024.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    cmd->compress_threads = (unsigned int)n;
+    return (0);
+}
+
+/*
+ * Compress one block, as a complete gzip member.
+ * |zs| belongs to the worker, and is reused for every block.
+ */
+static int
+compress_gzip(z_stream *zs, struct slot *sp)
+{
+    int zrv;
+
+    deflateReset(zs);
+    zs->next_in = sp->in;
+    zs->avail_in = sp->in_len;
+    zs->next_out = sp->out;
+    zs->avail_out = sp->out_cap;
+    zrv = deflate(zs, Z_FINISH);
+    if (zrv != Z_STREAM_END) {
+        return (EIO);
+    }
+    sp->out_len = sp->out_cap - zs->avail_out;
+    return (0);
+}
+
+static void *
+compress_worker(void *arg)
+{
+    compress_stream_t *cs = (compress_stream_t *)arg;
+    z_stream zs;
+    bool zs_ok;
+#ifdef USH_ZSTD
+    ZSTD_CCtx *cctx = NULL;
+#endif
+
+    zs_ok = false;
+    if (cs->algo == COMPRESS_GZIP) {
+        memset(&zs, 0, sizeof (zs));
+        // windowBits 15, plus 16, for a gzip header and trailer.
+        zs_ok = deflateInit2(&zs, cs->level, Z_DEFLATED, 15 + 16, 8,
+            Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+#ifdef USH_ZSTD
+    if (cs->algo == COMPRESS_ZSTD) {
+        cctx = ZSTD_createCCtx();
+    }
+#endif
+
+    pthread_mutex_lock(&cs->mu);
+    while (true) {
+        struct slot *sp;
+        unsigned int i;
+
+        // The oldest queued block first, so that the writer is not held up.
+        sp = NULL;
+        for (i = 0; i < cs->nslots; ++i) {
+            if (cs->slots[i].state == SLOT_QUEUED
+                && (sp == NULL || cs->slots[i].seq < sp->seq)) {
+                sp = &cs->slots[i];
+            }
+        }
+        if (sp == NULL) {
+            if (cs->quit) {
+                break;
+            }
+            pthread_cond_wait(&cs->cv, &cs->mu);
+            continue;
+        }
+        sp->state = SLOT_BUSY;
+        pthread_mutex_unlock(&cs->mu);
+
+        sp->err = EIO;
+        if (cs->algo == COMPRESS_GZIP && zs_ok) {
+            sp->err = compress_gzip(&zs, sp);
+        }
+#ifdef USH_ZSTD
+        if (cs->algo == COMPRESS_ZSTD && cctx != NULL) {
+            size_t zrv;
+
+            zrv = ZSTD_compressCCtx(cctx, sp->out, sp->out_cap,
+                sp->in, sp->in_len, cs->level);
+            if (ZSTD_isError(zrv)) {
+                sp->err = EIO;
+            }
+            else {
+                sp->out_len = zrv;
+                sp->err = 0;
+            }
+        }
+#endif
+
+        pthread_mutex_lock(&cs->mu);
+        sp->state = SLOT_DONE;
+        pthread_cond_broadcast(&cs->cv);
+    }
+    pthread_mutex_unlock(&cs->mu);
+
+    if (zs_ok) {
+        deflateEnd(&zs);
+    }
+#ifdef USH_ZSTD
+    ZSTD_freeCCtx(cctx);
+#endif
+    return (NULL);
+}
+
+/*
+ * Write out every finished block that is next in sequence.
+ * Called, and returns, with the lock held.
+ */
+static void
+write_done(compress_stream_t *cs)
+{
+    struct slot *sp;
+    int err;
+
+    while (true) {
+        sp = &cs->slots[cs->next_write % cs->nslots];
+        if (sp->state != SLOT_DONE || sp->seq != cs->next_write) {
+            break;
+        }
+        pthread_mutex_unlock(&cs->mu);
+        err = sp->err;
+        if (err == 0 && cs->err == 0) {
+            err = write_all(cs->fd, sp->out, sp->out_len);
+        }
+        pthread_mutex_lock(&cs->mu);
+        if (err != 0 && cs->err == 0) {
+            cs->err = err;
+        }
+        sp->state = SLOT_EMPTY;
+        ++cs->next_write;
+        pthread_cond_broadcast(&cs->cv);
+    }
+}
+
+/*
+ * Fill |buf| from the pipe, or up to end of file.
+ */
+static ssize_t
+read_block(int fd, unsigned char *buf, size_t sz)
+{
+    size_t len;
+    ssize_t n;
+
+    len = 0;
+    while (len < sz) {
+        n = read(fd, buf + len, sz - len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (-1);
+        }
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    return ((ssize_t)len);
+}
+
+static void *
+compress_reader(void *arg)
+{
+    compress_stream_t *cs = (compress_stream_t *)arg;
+    unsigned long long seq;
+    struct slot *sp;
+    ssize_t len;
+
+    pthread_mutex_lock(&cs->mu);
+    for (seq = 0; ; ++seq) {
+        sp = &cs->slots[seq % cs->nslots];
+        while (sp->state != SLOT_EMPTY) {
+            write_done(cs);
+            if (sp->state != SLOT_EMPTY) {
+                pthread_cond_wait(&cs->cv, &cs->mu);
+            }
+        }
+        pthread_mutex_unlock(&cs->mu);
+        len = read_block(cs->src, sp->in, BLOCK_SIZE);
+        pthread_mutex_lock(&cs->mu);
+        if (len == -1 || (len == 0 && seq != 0)) {
+            if (len == -1 && cs->err == 0) {
+                cs->err = errno;
+            }
+            break;
+        }
+        sp->in_len = len;
+        sp->seq = seq;
+        sp->state = SLOT_QUEUED;
+        pthread_cond_broadcast(&cs->cv);
+        write_done(cs);
+        if (len == 0) {
+            // Empty output is still one, empty, gzip member,
+            // so that the result is a valid compressed file.
+            ++seq;
+            break;
+        }
+    }
+
+    // End of input.  Write out everything that is still in flight.
+    //
+    while (cs->next_write < seq) {
+        write_done(cs);
+        if (cs->next_write < seq) {
+            pthread_cond_wait(&cs->cv, &cs->mu);
+        }
+    }
+    cs->quit = true;
+    pthread_cond_broadcast(&cs->cv);
+    pthread_mutex_unlock(&cs->mu);
+    return (NULL);
+}
+
+static void
+compress_stream_free(compress_stream_t *cs)
+{
+    unsigned int i;
+
+    for (i = 0; i < cs->nslots; ++i) {
+        free(cs->slots[i].in);
+        free(cs->slots[i].out);
+    }
+    free(cs->slots);
+    free(cs->workers);
+    if (cs->src >= 0) {
+        close(cs->src);
+    }
+    pthread_mutex_destroy(&cs->mu);
+    pthread_cond_destroy(&cs->cv);
+    free(cs);
+}
+
+/*
+ * Compression could not be started.  Let the workers that were
+ * started go, and close the pipe, so that the child is not left
+ * writing to a pipe that nobody reads.
+ */
+static void
+compress_stop(compress_stream_t *cs)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&cs->mu);
+    cs->quit = true;
+    pthread_cond_broadcast(&cs->cv);
+    pthread_mutex_unlock(&cs->mu);
+    for (i = 0; i < cs->nworkers; ++i) {
+        pthread_join(cs->workers[i], NULL);
+    }
+    cs->nworkers = 0;
+    close(cs->src);
+    cs->src = -1;
+}
+
+/**
+ * @brief Make the pipes for compression.  Before fork().
+ *
+ * @param cmd  IN  Command "object"
+ * @return errno-style status
+ *
+ */
+int
+compress_prepare(cmd_t *cmd)
+{
+    int pfd[2];
+    int fd;
+
+    for (fd = 1; fd <= 2; ++fd) {
+        cmd->compress_src[fd] = -1;
+        cmd->compress_stream[fd] = NULL;
+    }
+    if (cmd->compress_algo[1] == COMPRESS_NONE && cmd->compress_algo[2] == COMPRESS_NONE) {
+        return (0);
+    }
+
+    if (!cmd->child_fd_plan) {
+        for (fd = 0; fd < 3; ++fd) {
+            cmd->child_fd[fd] = -1;
+        }
+        cmd->child_fd_plan = true;
+    }
+    for (fd = 1; fd <= 2; ++fd) {
+        if (cmd->compress_algo[fd] == COMPRESS_NONE) {
+            continue;
+        }
+        if (cmd->child_fd[fd] >= 0) {
+            eprintf("Compression of fd %d cannot be combined with tee"
+                " or in-memory capture.\n", fd);
+            compress_finish(cmd);
+            return (EINVAL);
+        }
+        if (pipe2(pfd, O_CLOEXEC) != 0) {
+            int err = errno;
+            eprintf("pipe2() failed, for compression.\n");
+            eexplain_err(err);
+            compress_finish(cmd);
+            return (err);
+        }
+        cmd->compress_src[fd] = pfd[0];
+        cmd->child_fd[fd] = pfd[1];
+    }
+    return (0);
+}
+
+/**
+ * @brief Start compressing.  After fork(), in the parent.
+ *
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+compress_parent_setup(cmd_t *cmd)
+{
+    compress_stream_t *cs;
+    size_t out_cap;
+    unsigned int i;
+    int err;
+    int fd;
+
+    for (fd = 1; fd <= 2; ++fd) {
+        if (cmd->compress_src[fd] < 0) {
+            continue;
+        }
+        close(cmd->child_fd[fd]);
+        cmd->child_fd[fd] = -1;
+
+        cs = (compress_stream_t *)guard_mem(calloc(1, sizeof (*cs)));
+        cs->fd = fd;
+        cs->src = cmd->compress_src[fd];
+        cmd->compress_src[fd] = -1;
+        cs->algo = cmd->compress_algo[fd];
+        cs->level = cmd->compress_level[fd];
+        cs->nworkers = cmd->compress_threads ? cmd->compress_threads : default_threads();
+        cs->nslots = 2 * cs->nworkers;
+        pthread_mutex_init(&cs->mu, NULL);
+        pthread_cond_init(&cs->cv, NULL);
+
+        out_cap = deflateBound(NULL, BLOCK_SIZE) + 64;
+#ifdef USH_ZSTD
+        if (cs->algo == COMPRESS_ZSTD) {
+            out_cap = ZSTD_compressBound(BLOCK_SIZE);
+        }
+#endif
+        cs->slots = (struct slot *)guard_mem(calloc(cs->nslots, sizeof (struct slot)));
+        for (i = 0; i < cs->nslots; ++i) {
+            cs->slots[i].in = (unsigned char *)guard_mem(malloc(BLOCK_SIZE));
+            cs->slots[i].out = (unsigned char *)guard_mem(malloc(out_cap));
+            cs->slots[i].out_cap = out_cap;
+        }
+        cs->workers = (pthread_t *)guard_mem(calloc(cs->nworkers, sizeof (pthread_t)));
+        err = 0;
+        for (i = 0; i < cs->nworkers; ++i) {
+            err = pthread_create(&cs->workers[i], NULL, compress_worker, cs);
+            if (err != 0) {
+                break;
+            }
+        }
+        // Fewer workers than asked for will do; none will not.
+        cs->nworkers = i;
+        if (i != 0) {
+            err = pthread_create(&cs->reader, NULL, compress_reader, cs);
+            cs->reader_started = (err == 0);
+        }
+        if (!cs->reader_started) {
+            eprintf("pthread_create() failed, for compression of fd %d.\n", fd);
+            eexplain_err(err);
+            compress_stop(cs);
+            cs->err = err;
+        }
+        cmd->compress_stream[fd] = cs;
+    }
+}
+
+/**
+ * @brief Wait for the compressed output to be written.  After the child exits.
+ *
+ * @param cmd  IN  Command "object"
+ * @return errno-style status
+ *
+ * This waits for end of file on the child's pipe; that is, until
+ * every process that holds the write end of it has closed it.
+ *
+ */
+int
+compress_finish(cmd_t *cmd)
+{
+    compress_stream_t *cs;
+    unsigned int i;
+    int rv;
+    int fd;
+
+    rv = 0;
+    for (fd = 1; fd <= 2; ++fd) {
+        if (cmd->compress_src[fd] >= 0) {
+            // There never was a child.
+            close(cmd->compress_src[fd]);
+            cmd->compress_src[fd] = -1;
+            if (cmd->child_fd[fd] >= 0) {
+                close(cmd->child_fd[fd]);
+                cmd->child_fd[fd] = -1;
+            }
+        }
+        cs = (compress_stream_t *)cmd->compress_stream[fd];
+        if (cs == NULL) {
+            continue;
+        }
+        if (cs->reader_started) {
+            pthread_join(cs->reader, NULL);
+        }
+        for (i = 0; i < cs->nworkers; ++i) {
+            pthread_join(cs->workers[i], NULL);
+        }
+        if (cs->err != 0) {
+            eprintf("Compression of fd %d failed.\n", fd);
+            eexplain_err(cs->err);
+            rv = cs->err;
+        }
+        compress_stream_free(cs);
+        cmd->compress_stream[fd] = NULL;
+    }
+    return (rv);
+}
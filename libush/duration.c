@@ -0,0 +1,87 @@
+/*
+ * Filename: duration.c
+ * Library: libush
+ * Brief: Parse a duration, like "90", "1.5s", "250ms", "2m", "1h"
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ush.h>
+#include <cscript.h>
+
+#include <errno.h>
+    // Import var EINVAL
+    // Import var ERANGE
+#include <stdlib.h>
+    // Import strtod()
+#include <string.h>
+    // Import strcmp()
+
+struct duration_unit {
+    const char *sfx;
+    double ns;
+};
+
+static struct duration_unit duration_units[] = {
+    { "",   1e9     },
+    { "s",  1e9     },
+    { "ms", 1e6     },
+    { "us", 1e3     },
+    { "ns", 1.0     },
+    { "m",  60e9    },
+    { "h",  3600e9  },
+    { "d",  86400e9 },
+    { NULL, 0.0     }
+};
+
+/**
+ * @brief Parse a duration into nanoseconds
+ *
+ * @param str  IN   A number, possibly with a fraction, and a unit suffix
+ * @param ret  OUT  The duration in nanoseconds
+ * @return errno-style status
+ *
+ * The units are ns, us, ms, s, m, h, d.
+ * A plain number, with no unit, is in seconds, like sleep(1).
+ *
+ */
+int
+parse_duration(const char *str, unsigned long long *ret)
+{
+    struct duration_unit *u;
+    char *end;
+    double n;
+
+    if (!((*str >= '0' && *str <= '9') || *str == '.')) {
+        return (EINVAL);
+    }
+    n = strtod(str, &end);
+    if (end == str) {
+        return (EINVAL);
+    }
+    for (u = duration_units; u->sfx != NULL; ++u) {
+        if (strcmp(end, u->sfx) == 0) {
+            break;
+        }
+    }
+    if (u->sfx == NULL) {
+        return (EINVAL);
+    }
+    n *= u->ns;
+    if (n >= 18e18) {
+        return (ERANGE);
+    }
+    *ret = (unsigned long long)n;
+    return (0);
+}
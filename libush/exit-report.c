@@ -0,0 +1,99 @@
+/*
+ * Filename: exit-report.c
+ * Library: libush
+ * Brief: Report how the child exited, and what resources it used
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <signal.h>
+#include <string.h>
+    // Import strsignal()
+#include <sys/wait.h>
+
+static double
+tv_seconds(const struct timeval *tv)
+{
+    return ((double)tv->tv_sec + (double)tv->tv_usec / 1e6);
+}
+
+static void
+fshow_status(FILE *f, int status)
+{
+    if (WIFEXITED(status)) {
+        fprintf(f, "exit %d", WEXITSTATUS(status));
+    }
+    else if (WIFSIGNALED(status)) {
+        fprintf(f, "signal %d (%s)%s", WTERMSIG(status),
+            strsignal(WTERMSIG(status)),
+            WCOREDUMP(status) ? ", core dumped" : "");
+    }
+    else {
+        fprintf(f, "status 0x%x", status);
+    }
+}
+
+/**
+ * @brief Show the exit report for the last run of the program.
+ *
+ * @param f    IN  Write to this stdio file handle
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+fshow_exit_report(FILE *f, cmd_t *cmd)
+{
+    struct rusage *ru;
+
+    ru = &cmd->child_rusage;
+    fprintf(f, "%s: pid %d: ", cmd->cmd_name, (int)cmd->child);
+    fshow_status(f, cmd->child_status);
+    if (cmd->timed_out) {
+        fprintf(f, ", timed out after %.3f s", (double)cmd->timeout_ns / 1e9);
+    }
+    fputc('\n', f);
+    fprintf(f, "  wall     %.6f s\n",
+        (double)(cmd->child_end_ns - cmd->child_start_ns) / 1e9);
+    fprintf(f, "  user     %.6f s\n", tv_seconds(&ru->ru_utime));
+    fprintf(f, "  sys      %.6f s\n", tv_seconds(&ru->ru_stime));
+    fprintf(f, "  maxrss   %ld KiB\n", ru->ru_maxrss);
+    fprintf(f, "  faults   %ld minor, %ld major\n", ru->ru_minflt, ru->ru_majflt);
+    fprintf(f, "  ctxsw    %ld voluntary, %ld involuntary\n",
+        ru->ru_nvcsw, ru->ru_nivcsw);
+    fprintf(f, "  blocks   %ld in, %ld out\n", ru->ru_inblock, ru->ru_oublock);
+    fshow_perf_stat(f, cmd);
+
+    if (cmd->cgroup_parent != NULL && cmd->cgroup_path[0] != '\0') {
+        fprintf(f, "  cgroup   %s\n", cmd->cgroup_path);
+        if (cmd->cg_have_memory_peak) {
+            fprintf(f, "    memory.peak  %llu\n", cmd->cg_memory_peak);
+        }
+        if (cmd->cg_have_cpu_stat) {
+            fprintf(f, "    cpu.stat     usage %llu us, user %llu us,"
+                " system %llu us\n",
+                cmd->cg_usage_usec, cmd->cg_user_usec, cmd->cg_system_usec);
+            if (cmd->cg_nr_throttled != 0) {
+                fprintf(f, "    throttled    %llu times, %llu us\n",
+                    cmd->cg_nr_throttled, cmd->cg_throttled_usec);
+            }
+        }
+    }
+    fflush(f);
+}
@@ -0,0 +1,300 @@
+/*
+ * Filename: flight.c
+ * Library: libush
+ * Brief: Flight recorder: the last few hundred things ush did, in memory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <trace.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <signal.h>
+    // Import sigaction()
+#include <string.h>
+    // Import memset()
+
+#define FLIGHT_RECS  256        // A power of 2
+#define FLIGHT_STR   19
+
+/*
+ * 48 bytes.  |name| is always a string constant, or an option name
+ * from the (static) option table, so it is safe to keep a pointer.
+ */
+struct flight_rec {
+    unsigned long long ts_ns;
+    const char *name;
+    long long num;
+    int   err;
+    char  ph;
+    char  str[FLIGHT_STR];
+};
+
+static struct flight_rec flight_ring[FLIGHT_RECS];
+static unsigned int flight_next;
+
+/**
+ * @brief Record an event.
+ *
+ * @param ph    IN  TRACE_BEGIN, TRACE_END, TRACE_INSTANT, or TRACE_FAIL
+ * @param name  IN  Event name; a string constant
+ * @param num   IN  A number, or 0
+ * @param str   IN  A string, of which only the start is kept, or NULL
+ * @param err   IN  An errno, or 0
+ *
+ */
+void
+flight_event(int ph, const char *name, long long num, const char *str, int err)
+{
+    struct flight_rec *rec;
+    unsigned int i;
+
+    rec = &flight_ring[__atomic_fetch_add(&flight_next, 1, __ATOMIC_RELAXED) % FLIGHT_RECS];
+    rec->ts_ns = mono_ns();
+    rec->name = name;
+    rec->num = num;
+    rec->err = err;
+    rec->ph = (char)ph;
+    i = 0;
+    if (str != NULL) {
+        for (; i < FLIGHT_STR - 1 && str[i] != '\0'; ++i) {
+            rec->str[i] = str[i];
+        }
+    }
+    rec->str[i] = '\0';
+}
+
+// ################ Async-signal-safe formatting
+
+struct fbuf {
+    char   buf[4096];
+    size_t len;
+};
+
+static void
+fb_flush(struct fbuf *fb)
+{
+    size_t off;
+    ssize_t n;
+
+    for (off = 0; off < fb->len; off += n) {
+        n = write(2, fb->buf + off, fb->len - off);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            break;
+        }
+    }
+    fb->len = 0;
+}
+
+static void
+fb_puts(struct fbuf *fb, const char *s)
+{
+    for (; *s != '\0'; ++s) {
+        if (fb->len == sizeof (fb->buf)) {
+            fb_flush(fb);
+        }
+        fb->buf[fb->len++] = *s;
+    }
+}
+
+static void
+fb_putu(struct fbuf *fb, unsigned long long n, int width)
+{
+    char tmp[24];
+    int i;
+
+    i = sizeof (tmp) - 1;
+    tmp[i] = '\0';
+    do {
+        tmp[--i] = '0' + (n % 10);
+        n /= 10;
+        --width;
+    } while (n != 0 || width > 0);
+    fb_puts(fb, &tmp[i]);
+}
+
+static void
+fb_putd(struct fbuf *fb, long long n)
+{
+    if (n < 0) {
+        fb_puts(fb, "-");
+        fb_putu(fb, -(unsigned long long)n, 0);
+    }
+    else {
+        fb_putu(fb, (unsigned long long)n, 0);
+    }
+}
+
+/*
+ * Only printable ASCII; the rest as '?'.
+ */
+static void
+fb_putstr(struct fbuf *fb, const char *s)
+{
+    char c[2];
+
+    c[1] = '\0';
+    for (; *s != '\0'; ++s) {
+        c[0] = (*s >= 0x20 && *s < 0x7f) ? *s : '?';
+        fb_puts(fb, c);
+    }
+}
+
+/**
+ * @brief Write out the flight recorder, oldest first, to stderr.
+ *
+ * @param why  IN  What happened
+ * @param err  IN  An errno, or 0
+ *
+ * Safe to call from a signal handler.
+ *
+ */
+void
+flight_dump(const char *why, int err)
+{
+    struct fbuf fb;
+    struct flight_rec *rec;
+    unsigned long long t0;
+    unsigned long long dt;
+    unsigned int next;
+    unsigned int first;
+    unsigned int i;
+    char ph[4];
+
+    next = __atomic_load_n(&flight_next, __ATOMIC_RELAXED);
+    first = (next > FLIGHT_RECS) ? next - FLIGHT_RECS : 0;
+    fb.len = 0;
+    fb_puts(&fb, "ush: ");
+    fb_putstr(&fb, why);
+    if (err != 0) {
+        fb_puts(&fb, ", errno=");
+        fb_putd(&fb, err);
+    }
+    fb_puts(&fb, "; the last ");
+    fb_putu(&fb, next - first, 0);
+    fb_puts(&fb, " events:\n");
+
+    t0 = flight_ring[first % FLIGHT_RECS].ts_ns;
+    ph[0] = ' ';
+    ph[2] = ' ';
+    ph[3] = '\0';
+    for (i = first; i != next; ++i) {
+        rec = &flight_ring[i % FLIGHT_RECS];
+        dt = (rec->ts_ns >= t0) ? rec->ts_ns - t0 : 0;
+        fb_puts(&fb, "  +");
+        fb_putu(&fb, dt / 1000000000ULL, 0);
+        fb_puts(&fb, ".");
+        fb_putu(&fb, (dt / 1000) % 1000000, 6);
+        ph[1] = rec->ph;
+        fb_puts(&fb, ph);
+        fb_putstr(&fb, rec->name ? rec->name : "?");
+        if (rec->str[0] != '\0') {
+            fb_puts(&fb, " '");
+            fb_putstr(&fb, rec->str);
+            fb_puts(&fb, "'");
+        }
+        if (rec->num != 0) {
+            fb_puts(&fb, " ");
+            fb_putd(&fb, rec->num);
+        }
+        if (rec->err != 0) {
+            fb_puts(&fb, " errno=");
+            fb_putd(&fb, rec->err);
+        }
+        fb_puts(&fb, "\n");
+    }
+    fb_flush(&fb);
+}
+
+/**
+ * @brief Something ush did has failed.  Record it, and dump the recorder.
+ *
+ * @param what  IN  What failed; a string constant
+ * @param err   IN  errno, or 0
+ *
+ */
+void
+flight_fail(const char *what, int err)
+{
+    flight_event(TRACE_FAIL, what, 0, NULL, err);
+    flight_dump(what, err);
+}
+
+/**
+ * @brief Something failed that is for the user to fix: a bad option,
+ *        or a program that is not there.  Record it.
+ *
+ * @param what  IN  What failed; a string constant
+ * @param err   IN  errno, or 0
+ * @param dump  IN  Dump the recorder, too; that is, with --verbose
+ *
+ * The error message says it all; 256 events on top of that
+ * for every typo would be noise.
+ *
+ */
+void
+flight_user_fail(const char *what, int err, int dump)
+{
+    if (dump) {
+        flight_fail(what, err);
+    }
+    else {
+        flight_event(TRACE_FAIL, what, 0, NULL, err);
+    }
+}
+
+static void
+flight_sigusr1(int sig)
+{
+    int save_errno = errno;
+
+    (void)sig;
+    flight_dump("SIGUSR1", 0);
+    errno = save_errno;
+}
+
+/**
+ * @brief Dump the flight recorder on SIGUSR1.
+ *
+ * Called by the ush command's main().  Library callers that want it
+ * call it themselves, since it takes over their SIGUSR1.
+ * The handler is not inherited through exec().
+ *
+ */
+void
+flight_init(void)
+{
+    static bool done;
+    struct sigaction sa;
+
+    if (done) {
+        return;
+    }
+    done = true;
+    memset(&sa, 0, sizeof (sa));
+    sa.sa_handler = flight_sigusr1;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
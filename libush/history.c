@@ -0,0 +1,287 @@
+/*
+ * Filename: history.c
+ * Library: libush
+ * Brief: Run-time history: how long each command took, the last times
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import open()
+#include <limits.h>
+    // Import PATH_MAX
+#include <stdint.h>
+    // Import uint64_t
+#include <stdlib.h>
+    // Import calloc()
+    // Import free()
+#include <string.h>
+    // Import strcmp()
+    // Import strdup()
+#include <sys/mman.h>
+    // Import mmap()
+    // Import munmap()
+#include <sys/stat.h>
+    // Import fstat()
+#include <time.h>
+    // Import time()
+
+extern void *guard_mem(void *obj);
+extern void eexplain_err(int err);
+
+#define HIST_TAG    0x5531      // "U1"
+#define HIST_ALPHA  0.3         // Weight of the newest run
+
+struct hist_rec {
+    uint64_t key;       // Hash of cwd and argv
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+    uint32_t when;      // time(), in seconds
+    uint16_t status;    // Exit code, or 256 + signal number
+    uint16_t tag;
+};
+
+/**
+ * @brief Command-line option to record run times, and use them for --batch
+ *
+ * @param cmd    IN  Command "object" that hold context/control information
+ * @param fname  IN  The history file; created if need be
+ * @return errno-style status
+ *
+ * Implies --fork.
+ *
+ */
+int
+cmd_history(cmd_t *cmd, const char *fname)
+{
+    int fd;
+
+    fd = open(fname, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0666);
+    if (fd == -1) {
+        int err = errno;
+        eprintf("--history: open('%s') failed.\n", fname);
+        eexplain_err(err);
+        cmd->ioerr = err;
+        return (err);
+    }
+    if (cmd->history_file != NULL) {
+        close(cmd->history_fd);
+        free(cmd->history_file);
+    }
+    cmd->history_file = (char *)guard_mem(strdup(fname));
+    cmd->history_fd = fd;
+    cmd->cmd_fork = true;
+    return (0);
+}
+
+/**
+ * @brief Command-line option to choose the order in which --batch starts jobs
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  file|longest|shortest
+ * @return errno-style status
+ *
+ */
+int
+cmd_job_order(cmd_t *cmd, const char *arg)
+{
+    if (strcmp(arg, "file") == 0) {
+        cmd->job_order = JOB_ORDER_FILE;
+    }
+    else if (strcmp(arg, "longest") == 0) {
+        cmd->job_order = JOB_ORDER_LONGEST;
+    }
+    else if (strcmp(arg, "shortest") == 0) {
+        cmd->job_order = JOB_ORDER_SHORTEST;
+    }
+    else {
+        eprintf("--job-order: expected file, longest or shortest, not '%s'.\n", arg);
+        return (EINVAL);
+    }
+    return (0);
+}
+
+static uint64_t
+fnv_add(uint64_t h, const char *s, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return (h);
+}
+
+/**
+ * @brief The history key of a command: a hash of the cwd and argv.
+ *
+ * @param argc  IN  Number of arguments
+ * @param argv  IN  Arguments, program name first
+ * @return the key; never 0
+ *
+ */
+uint64_t
+history_key(int argc, char **argv)
+{
+    char cwd[PATH_MAX];
+    uint64_t h;
+    int i;
+
+    h = 14695981039346656037ULL;
+    if (getcwd(cwd, sizeof (cwd)) != NULL) {
+        h = fnv_add(h, cwd, strlen(cwd) + 1);
+    }
+    for (i = 0; i < argc && argv[i] != NULL; ++i) {
+        h = fnv_add(h, argv[i], strlen(argv[i]) + 1);
+    }
+    return (h ? h : 1);
+}
+
+/**
+ * @brief Append a record for a child that has been reaped.
+ *
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+history_record(cmd_t *cmd)
+{
+    struct hist_rec rec;
+    struct rusage *ru;
+    int status;
+
+    if (cmd->history_file == NULL || cmd->child_end_ns < cmd->child_start_ns) {
+        return;
+    }
+    ru = &cmd->child_rusage;
+    status = cmd->child_status;
+    rec.key = history_key(cmd->argc, cmd->argv);
+    rec.wall_ns = cmd->child_end_ns - cmd->child_start_ns;
+    rec.cpu_ns = (uint64_t)(ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000000ULL
+        + (uint64_t)(ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1000ULL;
+    rec.when = (uint32_t)time(NULL);
+    if (cmd->timed_out) {
+        rec.status = 256 + SIGKILL;
+    }
+    else if (WIFSIGNALED(status)) {
+        rec.status = 256 + WTERMSIG(status);
+    }
+    else {
+        rec.status = WEXITSTATUS(status);
+    }
+    rec.tag = HIST_TAG;
+    if (write(cmd->history_fd, &rec, sizeof (rec)) != sizeof (rec) && cmd->verbose) {
+        eprintf("--history: write() to '%s' failed.\n", cmd->history_file);
+    }
+}
+
+/**
+ * @brief Expected wall time of some commands, from their past runs.
+ *
+ * @param cmd   IN   Command "object", with the history file
+ * @param keys  IN   History keys of the commands
+ * @param est   OUT  Expected wall time, in ns, of each; 0 if there is no history
+ * @param n     IN   How many
+ * @return the number of commands that have history
+ *
+ */
+unsigned int
+history_estimate(cmd_t *cmd, const uint64_t *keys, unsigned long long *est, unsigned int n)
+{
+    const struct hist_rec *rec;
+    const struct hist_rec *end;
+    struct stat st;
+    unsigned int *table;
+    unsigned int tsize;
+    unsigned int known;
+    unsigned int i;
+    unsigned int j;
+    void *map;
+
+    for (i = 0; i < n; ++i) {
+        est[i] = 0;
+    }
+    if (cmd->history_file == NULL || n == 0) {
+        return (0);
+    }
+    if (fstat(cmd->history_fd, &st) != 0 || st.st_size < (off_t)sizeof (*rec)) {
+        return (0);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, cmd->history_fd, 0);
+    if (map == MAP_FAILED) {
+        return (0);
+    }
+
+    // Open-addressing table of the commands we want, by key.
+    // Entries are index + 1; 0 is empty.
+    for (tsize = 16; tsize < n * 2; tsize *= 2) {
+        continue;
+    }
+    table = (unsigned int *)guard_mem(calloc(tsize, sizeof (unsigned int)));
+    for (i = 0; i < n; ++i) {
+        for (j = keys[i] & (tsize - 1); table[j] != 0; j = (j + 1) & (tsize - 1)) {
+            if (keys[table[j] - 1] == keys[i]) {
+                break;
+            }
+        }
+        if (table[j] == 0) {
+            table[j] = i + 1;
+        }
+    }
+
+    rec = (const struct hist_rec *)map;
+    end = rec + st.st_size / sizeof (*rec);
+    for (; rec < end; ++rec) {
+        if (rec->tag != HIST_TAG || rec->status != 0) {
+            continue;
+        }
+        for (j = rec->key & (tsize - 1); table[j] != 0; j = (j + 1) & (tsize - 1)) {
+            i = table[j] - 1;
+            if (keys[i] == rec->key) {
+                if (est[i] == 0) {
+                    est[i] = rec->wall_ns ? rec->wall_ns : 1;
+                }
+                else {
+                    est[i] = (unsigned long long)
+                        (HIST_ALPHA * rec->wall_ns + (1.0 - HIST_ALPHA) * est[i]);
+                }
+                break;
+            }
+        }
+    }
+
+    // Duplicate commands share the first one's entry.
+    known = 0;
+    for (i = 0; i < n; ++i) {
+        for (j = keys[i] & (tsize - 1); table[j] != 0; j = (j + 1) & (tsize - 1)) {
+            if (keys[table[j] - 1] == keys[i]) {
+                est[i] = est[table[j] - 1];
+                break;
+            }
+        }
+        known += (est[i] != 0);
+    }
+    free(table);
+    munmap(map, st.st_size);
+    return (known);
+}
@@ -0,0 +1,114 @@
+/*
+ * Filename: id-list.c
+ * Library: libush
+ * Brief: Parse a list of small numbers, like "0-3,8,10-11", into a bitmask
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ush.h>
+#include <cscript.h>
+
+#include <errno.h>
+    // Import var EINVAL
+    // Import var ERANGE
+#include <limits.h>
+    // Import CHAR_BIT
+#include <string.h>
+    // Import memset()
+
+#define BITS_PER_LONG (sizeof (unsigned long) * CHAR_BIT)
+
+static const char *
+parse_id(const char *s, size_t *ret)
+{
+    size_t n;
+
+    if (!(*s >= '0' && *s <= '9')) {
+        return (NULL);
+    }
+    n = 0;
+    while (*s >= '0' && *s <= '9') {
+        n = n * 10 + (*s - '0');
+        if (n > 0xffff) {
+            return (NULL);
+        }
+        ++s;
+    }
+    *ret = n;
+    return (s);
+}
+
+/**
+ * @brief Parse a list of ids and ranges of ids into a bitmask.
+ *
+ * @param str    IN   The list, for example, "0-3,8,10-11"
+ * @param mask   OUT  Array of |nbits| bits
+ * @param nbits  IN   Capacity of |mask|, in bits
+ * @param count  OUT  How many ids were set in |mask|
+ * @return errno-style status
+ *
+ * A range may have a stride, as in "0-15:2", meaning every other id.
+ *
+ */
+int
+parse_id_list(const char *str, unsigned long *mask, size_t nbits, size_t *count)
+{
+    const char *s;
+
+    memset(mask, 0, ((nbits + BITS_PER_LONG - 1) / BITS_PER_LONG)
+        * sizeof (unsigned long));
+    *count = 0;
+    s = str;
+    while (true) {
+        size_t lo, hi, stride, id;
+
+        s = parse_id(s, &lo);
+        if (s == NULL) {
+            return (EINVAL);
+        }
+        hi = lo;
+        stride = 1;
+        if (*s == '-') {
+            s = parse_id(s + 1, &hi);
+            if (s == NULL || hi < lo) {
+                return (EINVAL);
+            }
+            if (*s == ':') {
+                s = parse_id(s + 1, &stride);
+                if (s == NULL || stride == 0) {
+                    return (EINVAL);
+                }
+            }
+        }
+        if (hi >= nbits) {
+            return (ERANGE);
+        }
+        for (id = lo; id <= hi; id += stride) {
+            unsigned long bit = 1UL << (id % BITS_PER_LONG);
+            if (!(mask[id / BITS_PER_LONG] & bit)) {
+                mask[id / BITS_PER_LONG] |= bit;
+                ++*count;
+            }
+        }
+        if (*s == '\0') {
+            break;
+        }
+        if (*s != ',') {
+            return (EINVAL);
+        }
+        ++s;
+    }
+    return (0);
+}
@@ -0,0 +1,244 @@
+/*
+ * Filename: io-memfd.c
+ * Library: libush
+ * Brief: In-memory stdin, stdout and stderr for library callers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import fcntl()
+    // Import F_ADD_SEALS
+#include <sys/mman.h>
+    // Import memfd_create()
+    // Import mmap()
+    // Import munmap()
+#include <sys/stat.h>
+    // Import fstat()
+
+extern void eexplain_err(int err);
+
+static const char *memfd_names[3] = { "ush-stdin", "ush-stdout", "ush-stderr" };
+
+static int
+io_memfd_create(int fd, unsigned int flags)
+{
+    int mfd;
+
+    mfd = memfd_create(memfd_names[fd], MFD_CLOEXEC | flags);
+    if (mfd == -1) {
+        int err = errno;
+        eprintf("memfd_create('%s') failed.\n", memfd_names[fd]);
+        eexplain_err(err);
+        errno = err;
+    }
+    return (mfd);
+}
+
+/**
+ * @brief Make the memfds for an in-memory run.  Before any fork().
+ *
+ * @param cmd  IN  Command "object"
+ * @param io   IN  What to feed the child, and what to capture
+ * @return errno-style status
+ *
+ */
+int
+io_memfd_open(cmd_t *cmd, ush_io_t *io)
+{
+    int i;
+    int rv;
+
+    cmd->io = io;
+    if (!cmd->child_fd_plan) {
+        for (i = 0; i < 3; ++i) {
+            cmd->child_fd[i] = -1;
+        }
+        cmd->child_fd_plan = true;
+    }
+    io->stdout_buf = NULL;
+    io->stdout_len = 0;
+    io->stderr_buf = NULL;
+    io->stderr_len = 0;
+
+    // --stdin, --stdout and --stderr, if any, are already in the plan.
+    //
+    if ((io->stdin_buf != NULL && cmd->child_fd[0] >= 0)
+        || (io->capture_stdout && cmd->child_fd[1] >= 0)
+        || (io->capture_stderr && cmd->child_fd[2] >= 0)) {
+        eprintf("In-memory I/O cannot be combined with --stdin, --stdout"
+            " or --stderr, for the same file descriptor.\n");
+        rv = EINVAL;
+        goto fail;
+    }
+
+    if (io->stdin_buf != NULL) {
+        cmd->child_fd[0] = io_memfd_create(0, MFD_ALLOW_SEALING);
+        if (cmd->child_fd[0] == -1) {
+            rv = errno;
+            goto fail;
+        }
+        rv = write_all(cmd->child_fd[0], (const char *)io->stdin_buf, io->stdin_len);
+        if (rv != 0) {
+            eprintf("Write to memfd '%s' failed.\n", memfd_names[0]);
+            eexplain_err(rv);
+            goto fail;
+        }
+        // The child gets exactly what the caller gave, and cannot change it.
+        if (fcntl(cmd->child_fd[0], F_ADD_SEALS,
+                F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+            rv = errno;
+            eprintf("Sealing of memfd '%s' failed.\n", memfd_names[0]);
+            eexplain_err(rv);
+            goto fail;
+        }
+    }
+    if (io->capture_stdout) {
+        cmd->child_fd[1] = io_memfd_create(1, 0);
+        if (cmd->child_fd[1] == -1) {
+            rv = errno;
+            goto fail;
+        }
+    }
+    if (io->capture_stderr) {
+        cmd->child_fd[2] = io_memfd_create(2, 0);
+        if (cmd->child_fd[2] == -1) {
+            rv = errno;
+            goto fail;
+        }
+    }
+    return (0);
+
+fail:
+    io_memfd_close(cmd);
+    return (rv);
+}
+
+/**
+ * @brief Rewind the stdin memfd.  After fork(), before exec().
+ *
+ * @param cmd  IN  Command "object"
+ *
+ * With --repeat or --supervise, every run reads stdin from the start.
+ * The memfds themselves are put in place by the child fd plan.
+ *
+ */
+void
+io_memfd_child_setup(cmd_t *cmd)
+{
+    if (cmd->io != NULL && cmd->child_fd[0] >= 0) {
+        lseek(cmd->child_fd[0], 0, SEEK_SET);
+    }
+}
+
+static int
+io_memfd_map(int fd, void **bufp, size_t *lenp)
+{
+    struct stat st;
+    void *buf;
+
+    *bufp = NULL;
+    *lenp = 0;
+    if (fstat(fd, &st) != 0) {
+        return (errno);
+    }
+    if (st.st_size == 0) {
+        return (0);
+    }
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED) {
+        return (errno);
+    }
+    *bufp = buf;
+    *lenp = st.st_size;
+    return (0);
+}
+
+/**
+ * @brief Hand the captured output back to the caller.  After the last run.
+ *
+ * @param cmd  IN  Command "object"
+ * @return errno-style status
+ *
+ * The mappings outlive the memfds, which are closed, here.
+ *
+ */
+int
+io_memfd_collect(cmd_t *cmd)
+{
+    ush_io_t *io;
+    int rv;
+
+    io = cmd->io;
+    if (io == NULL) {
+        return (0);
+    }
+    rv = 0;
+    if (io->capture_stdout && cmd->child_fd[1] >= 0) {
+        rv = io_memfd_map(cmd->child_fd[1], &io->stdout_buf, &io->stdout_len);
+    }
+    if (rv == 0 && io->capture_stderr && cmd->child_fd[2] >= 0) {
+        rv = io_memfd_map(cmd->child_fd[2], &io->stderr_buf, &io->stderr_len);
+    }
+    if (rv != 0) {
+        eprintf("mmap() of captured output failed.\n");
+        eexplain_err(rv);
+    }
+    io_memfd_close(cmd);
+    return (rv);
+}
+
+void
+io_memfd_close(cmd_t *cmd)
+{
+    int i;
+
+    for (i = 0; i < 3; ++i) {
+        if (cmd->child_fd[i] >= 0) {
+            close(cmd->child_fd[i]);
+            cmd->child_fd[i] = -1;
+        }
+    }
+    cmd->child_fd_plan = false;
+    cmd->io = NULL;
+}
+
+/**
+ * @brief Give back the captured output of ush_io().
+ *
+ * @param io  IN  The same |ush_io_t| that was given to ush_io()
+ *
+ */
+void
+ush_io_free(ush_io_t *io)
+{
+    if (io->stdout_buf != NULL) {
+        munmap(io->stdout_buf, io->stdout_len);
+        io->stdout_buf = NULL;
+        io->stdout_len = 0;
+    }
+    if (io->stderr_buf != NULL) {
+        munmap(io->stderr_buf, io->stderr_len);
+        io->stderr_buf = NULL;
+        io->stderr_len = 0;
+    }
+}
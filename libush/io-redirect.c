@@ -31,6 +31,30 @@
 
 #include <libexplain/open.h>
 
+/*
+ * With in-memory I/O (ush_io()), or with a child fd plan that is
+ * already made (ush_popen2()), the redirections are for the child
+ * only.  The file is opened now, but it is put in place by the child
+ * fd plan, after fork(), so the caller's own fd is left alone.
+ */
+static void
+plan_child_fd(cmd_t *cmd, int fd, int file_fd)
+{
+    int i;
+
+    if (!cmd->child_fd_plan) {
+        for (i = 0; i < 3; ++i) {
+            cmd->child_fd[i] = -1;
+        }
+        cmd->child_fd_plan = true;
+    }
+    if (cmd->child_fd[fd] >= 0) {
+        close(cmd->child_fd[fd]);
+    }
+    fcntl(file_fd, F_SETFD, FD_CLOEXEC);
+    cmd->child_fd[fd] = file_fd;
+}
+
 int
 set_stdin(cmd_t *cmd, const char *fname)
 {
@@ -43,6 +67,10 @@ set_stdin(cmd_t *cmd, const char *fname)
         cmd->ioerr = errno;
         return (old_fd);
     }
+    if (cmd->io != NULL || cmd->child_fd_plan) {
+        plan_child_fd(cmd, 0, old_fd);
+        return (0);
+    }
     new_fd = dup2(old_fd, 0);
     if (new_fd == -1) {
         cmd->ioerr = errno;
@@ -98,6 +126,10 @@ set_write_fd(int fd, cmd_t *cmd, const char *fname, bool append, bool new_file)
         cmd->ioerr = err;
         return (err);
     }
+    if (cmd->io != NULL || cmd->child_fd_plan) {
+        plan_child_fd(cmd, fd, old_fd);
+        return (0);
+    }
 
     new_fd = dup2(old_fd, fd);
     if (new_fd == -1) {
@@ -137,16 +169,6 @@ set_stderr(cmd_t *cmd, const char *fname, bool append, bool new_file)
     return (rv);
 }
 
-static bool
-isnumeric(const char *str)
-{
-    const char *s = str;
-    while (*s >= '0' && *s <= '9') {
-        ++s;
-    }
-    return (*s == '\0' && s > str);
-}
-
 int
 ush_close_from(const char *arg)
 {
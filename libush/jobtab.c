@@ -0,0 +1,341 @@
+/*
+ * Filename: jobtab.c
+ * Library: libush
+ * Brief: The job table of a --batch run: interned arguments, and live jobs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <batch.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <stdint.h>
+    // Import uint32_t
+#include <stdio.h>
+    // Import fclose()
+#include <stdlib.h>
+    // Import calloc()
+    // Import free()
+    // Import realloc()
+#include <string.h>
+    // Import memcmp()
+    // Import memcpy()
+    // Import memset()
+
+extern void *guard_mem(void *obj);
+
+#define JOBTAB_MAX  0xffffffffU     // Pool bytes, or arguments
+#define JOB_ARGC_MAX 0xffffffU
+
+/**
+ * @brief Start an empty job table.
+ *
+ * @param tab  OUT  The job table
+ *
+ */
+void
+jobtab_init(struct job_table *tab)
+{
+    memset(tab, 0, sizeof (*tab));
+}
+
+static uint32_t
+str_hash(const char *s, size_t len)
+{
+    uint32_t h;
+    size_t i;
+
+    h = 2166136261U;
+    for (i = 0; i < len; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619U;
+    }
+    return (h);
+}
+
+static void
+hash_grow(struct job_table *tab)
+{
+    uint32_t *old;
+    size_t old_cap;
+    size_t i;
+    size_t j;
+    const char *s;
+
+    old = tab->hash;
+    old_cap = tab->hash_cap;
+    tab->hash_cap = old_cap ? old_cap * 2 : 1024;
+    tab->hash = (uint32_t *)guard_mem(calloc(tab->hash_cap, sizeof (uint32_t)));
+    for (i = 0; i < old_cap; ++i) {
+        if (old[i] == 0) {
+            continue;
+        }
+        s = tab->pool + old[i] - 1;
+        for (j = str_hash(s, strlen(s)) & (tab->hash_cap - 1);
+             tab->hash[j] != 0;
+             j = (j + 1) & (tab->hash_cap - 1)) {
+            continue;
+        }
+        tab->hash[j] = old[i];
+    }
+    free(old);
+}
+
+/*
+ * The pool offset of |len| bytes at |s|, stored once.
+ */
+static int
+intern(struct job_table *tab, const char *s, size_t len, uint32_t *offp)
+{
+    const char *p;
+    size_t j;
+    size_t cap;
+
+    if (tab->nstr * 2 >= tab->hash_cap) {
+        hash_grow(tab);
+    }
+    for (j = str_hash(s, len) & (tab->hash_cap - 1);
+         tab->hash[j] != 0;
+         j = (j + 1) & (tab->hash_cap - 1)) {
+        p = tab->pool + tab->hash[j] - 1;
+        if (memcmp(p, s, len) == 0 && p[len] == '\0') {
+            *offp = tab->hash[j] - 1;
+            return (0);
+        }
+    }
+
+    if (tab->pool_len + len + 1 >= JOBTAB_MAX) {
+        return (EFBIG);
+    }
+    if (tab->pool_len + len + 1 > tab->pool_cap) {
+        cap = tab->pool_cap ? tab->pool_cap * 2 : 65536;
+        while (cap < tab->pool_len + len + 1) {
+            cap *= 2;
+        }
+        tab->pool = (char *)guard_mem(realloc(tab->pool, cap));
+        tab->pool_cap = cap;
+    }
+    *offp = (uint32_t)tab->pool_len;
+    memcpy(tab->pool + tab->pool_len, s, len);
+    tab->pool[tab->pool_len + len] = '\0';
+    tab->pool_len += len + 1;
+    tab->hash[j] = *offp + 1;
+    ++tab->nstr;
+    return (0);
+}
+
+/**
+ * @brief Add an argument to the job that is being read.
+ *
+ * @param tab  IN  The job table
+ * @param arg  IN  The argument; need not be null-terminated
+ * @param len  IN  Its length
+ * @return errno-style status
+ *
+ */
+int
+jobtab_add_arg(struct job_table *tab, const char *arg, size_t len)
+{
+    uint32_t off;
+    int err;
+
+    if (tab->nargs - tab->job_arg >= JOB_ARGC_MAX || tab->nargs >= JOBTAB_MAX) {
+        return (E2BIG);
+    }
+    err = intern(tab, arg, len, &off);
+    if (err != 0) {
+        return (err);
+    }
+    if (tab->nargs == tab->args_cap) {
+        tab->args_cap = tab->args_cap ? tab->args_cap * 2 : 4096;
+        tab->args = (uint32_t *)guard_mem(realloc(tab->args,
+            tab->args_cap * sizeof (uint32_t)));
+    }
+    tab->args[tab->nargs++] = off;
+    return (0);
+}
+
+/**
+ * @brief The arguments added since the last job are a job.
+ *
+ * @param tab  IN  The job table
+ *
+ * No arguments, no job.
+ *
+ */
+void
+jobtab_end_job(struct job_table *tab)
+{
+    struct job_ent *ent;
+
+    if (tab->nargs == tab->job_arg) {
+        return;
+    }
+    if (tab->njobs == tab->cap) {
+        tab->cap = tab->cap ? tab->cap * 2 : 1024;
+        tab->job = (struct job_ent *)guard_mem(realloc(tab->job,
+            tab->cap * sizeof (struct job_ent)));
+    }
+    ent = &tab->job[tab->njobs++];
+    ent->arg = tab->job_arg;
+    ent->argc = tab->nargs - tab->job_arg;
+    ent->flags = 0;
+    tab->job_arg = (uint32_t)tab->nargs;
+}
+
+/**
+ * @brief One argument of a job.
+ *
+ * @param tab  IN  The job table
+ * @param i    IN  Index of the job
+ * @param a    IN  Which argument; 0 is the program name
+ * @return the argument, in the pool
+ *
+ */
+const char *
+jobtab_arg(struct job_table *tab, unsigned int i, unsigned int a)
+{
+    return (tab->pool + tab->args[tab->job[i].arg + a]);
+}
+
+/**
+ * @brief A job's argument vector, null-terminated, for exec().
+ *
+ * @param tab  IN  The job table
+ * @param i    IN  Index of the job
+ * @return a new vector of pointers into the pool; free() it
+ *
+ */
+char **
+jobtab_argv(struct job_table *tab, unsigned int i)
+{
+    char **argv;
+    unsigned int argc;
+    unsigned int a;
+
+    argc = tab->job[i].argc;
+    argv = (char **)guard_mem(calloc(argc + 1, sizeof (char *)));
+    for (a = 0; a < argc; ++a) {
+        argv[a] = tab->pool + tab->args[tab->job[i].arg + a];
+    }
+    argv[argc] = NULL;
+    return (argv);
+}
+
+/**
+ * @brief Keep track of live jobs by index, for those that need to find them.
+ *
+ * @param tab  IN  The job table, all read
+ *
+ * That is, --output-order=job, and --broadcast-stdin.
+ *
+ */
+void
+jobtab_index_live(struct job_table *tab)
+{
+    if (tab->live == NULL && tab->njobs != 0) {
+        tab->live = (struct batch_job **)guard_mem(calloc(tab->njobs,
+            sizeof (struct batch_job *)));
+    }
+}
+
+/**
+ * @brief Make what it takes to run a job.
+ *
+ * @param tab  IN  The job table
+ * @param i    IN  Index of the job
+ * @return the new live job
+ *
+ */
+struct batch_job *
+job_alloc(struct job_table *tab, unsigned int i)
+{
+    struct batch_job *job;
+
+    job = (struct batch_job *)guard_mem(calloc(1, sizeof (struct batch_job)));
+    job->id = i + 1;
+    job->argc = tab->job[i].argc;
+    job->argv = jobtab_argv(tab, i);
+    job->cmd = (cmd_t *)guard_mem(calloc(1, sizeof (cmd_t)));
+    job->fd[0] = -1;
+    job->fd[1] = -1;
+    job->fd[2] = -1;
+    job->out[1].bol = true;
+    job->out[2].bol = true;
+    if (tab->live != NULL) {
+        tab->live[i] = job;
+    }
+    return (job);
+}
+
+/**
+ * @brief Let go of a live job.
+ *
+ * @param tab  IN  The job table
+ * @param job  IN  The job; its output, if any, must be written
+ *
+ */
+void
+job_free(struct job_table *tab, struct batch_job *job)
+{
+    int fd;
+
+    for (fd = 0; fd < 3; ++fd) {
+        if (job->fd[fd] >= 0) {
+            close(job->fd[fd]);
+        }
+        free(job->out[fd].buf);
+        if (job->out[fd].spill != NULL) {
+            fclose(job->out[fd].spill);
+        }
+    }
+    if (tab->live != NULL) {
+        tab->live[job->id - 1] = NULL;
+    }
+    free(job->cmd);
+    free(job->argv);
+    free(job);
+}
+
+/**
+ * @brief Let go of the job table, and of any live jobs.
+ *
+ * @param tab  IN  The job table
+ *
+ */
+void
+jobtab_free(struct job_table *tab)
+{
+    unsigned int i;
+
+    if (tab->live != NULL) {
+        for (i = 0; i < tab->njobs; ++i) {
+            if (tab->live[i] != NULL) {
+                job_free(tab, tab->live[i]);
+            }
+        }
+        free(tab->live);
+    }
+    free(tab->job);
+    free(tab->args);
+    free(tab->hash);
+    free(tab->pool);
+    memset(tab, 0, sizeof (*tab));
+}
@@ -0,0 +1,352 @@
+/*
+ * Filename: journal.c
+ * Library: libush
+ * Brief: --journal and --shard: resumable, and split up, --batch runs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <batch.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import open()
+#include <stdio.h>
+    // Import snprintf()
+    // Import sscanf()
+#include <stdlib.h>
+    // Import free()
+    // Import realloc()
+    // Import strtoul()
+#include <string.h>
+    // Import memchr()
+    // Import memcpy()
+    // Import memset()
+    // Import strdup()
+#include <sys/mman.h>
+    // Import mmap()
+    // Import munmap()
+#include <sys/stat.h>
+    // Import fstat()
+
+extern void *guard_mem(void *obj);
+extern void eexplain_err(int err);
+
+/**
+ * @brief Command-line option to keep a journal of finished --batch jobs
+ *
+ * @param cmd    IN  Command "object" that hold context/control information
+ * @param fname  IN  The journal; created if need be
+ * @return errno-style status
+ *
+ */
+int
+cmd_journal(cmd_t *cmd, const char *fname)
+{
+    free(cmd->journal_file);
+    cmd->journal_file = (char *)guard_mem(strdup(fname));
+    return (0);
+}
+
+/**
+ * @brief Command-line option to run only one share of a --batch
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  <i>/<n>, with i in 1..n
+ * @return errno-style status
+ *
+ */
+int
+cmd_shard(cmd_t *cmd, const char *arg)
+{
+    char *end;
+    unsigned long i;
+    unsigned long n;
+
+    errno = 0;
+    i = strtoul(arg, &end, 10);
+    n = 0;
+    if (errno == 0 && end != arg && *end == '/') {
+        const char *s = end + 1;
+
+        n = strtoul(s, &end, 10);
+        if (end == s || *end != '\0') {
+            n = 0;
+        }
+    }
+    if (errno != 0 || n == 0 || n > 65536 || i == 0 || i > n) {
+        eprintf("--shard: '%s' must be <i>/<n>, with i in 1..n.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    cmd->shard_index = (unsigned int)i;
+    cmd->shard_count = (unsigned int)n;
+    return (0);
+}
+
+/*
+ * FNV-1a of a job's arguments.
+ */
+static unsigned long long
+job_hash(struct job_table *tab, unsigned int i)
+{
+    unsigned long long h;
+    const char *s;
+    unsigned int a;
+
+    h = 14695981039346656037ULL;
+    for (a = 0; a < tab->job[i].argc; ++a) {
+        for (s = jobtab_arg(tab, i, a); ; ++s) {
+            h ^= (unsigned char)*s;
+            h *= 1099511628211ULL;
+            if (*s == '\0') {
+                break;
+            }
+        }
+    }
+    return (h);
+}
+
+/*
+ * Mark the jobs that a journal says are done.
+ */
+static void
+journal_replay(const char *buf, size_t size, struct job_table *tab)
+{
+    const char *line;
+    const char *nl;
+    const char *end;
+    unsigned long long hash;
+    unsigned int id;
+    int status;
+    char tmp[128];
+    size_t len;
+
+    end = buf + size;
+    for (line = buf; line < end; line = nl + 1) {
+        nl = (const char *)memchr(line, '\n', end - line);
+        if (nl == NULL) {
+            // Cut short
+            break;
+        }
+        len = nl - line;
+        if (len >= sizeof (tmp)) {
+            continue;
+        }
+        memcpy(tmp, line, len);
+        tmp[len] = '\0';
+        if (sscanf(tmp, "%u %llx %d", &id, &hash, &status) != 3
+            || id == 0 || id > tab->njobs || job_hash(tab, id - 1) != hash) {
+            continue;
+        }
+        // The last line for a job is the one that counts.
+        if (status == 0) {
+            tab->job[id - 1].flags |= JOB_JOURNAL_DONE;
+        }
+        else {
+            tab->job[id - 1].flags &= ~JOB_JOURNAL_DONE;
+        }
+    }
+}
+
+/**
+ * @brief Open the journal, and the shard; mark the jobs that are not to be run.
+ *
+ * @param jn   OUT  The journal
+ * @param cmd  IN   Command "object", with the options
+ * @param tab  IN   All of the jobs in the manifest
+ * @return errno-style status
+ *
+ */
+int
+journal_open(struct journal *jn, cmd_t *cmd, struct job_table *tab)
+{
+    struct job_ent *ent;
+    struct stat st;
+    unsigned int njobs;
+    unsigned int nskip;
+    unsigned int nshard;
+    unsigned int i;
+    void *map;
+    int err;
+
+    memset(jn, 0, sizeof (*jn));
+    jn->fd = -1;
+
+    njobs = tab->njobs;
+    nshard = njobs;
+    if (cmd->shard_count != 0) {
+        nshard = 0;
+        for (i = 0; i < njobs; ++i) {
+            if (i % cmd->shard_count != cmd->shard_index - 1) {
+                tab->job[i].flags |= JOB_SKIP;
+            }
+            else {
+                ++nshard;
+            }
+        }
+        if (cmd->verbose) {
+            eprintf("--shard=%u/%u: %u of %u jobs.\n",
+                cmd->shard_index, cmd->shard_count, nshard, njobs);
+        }
+    }
+
+    if (cmd->journal_file == NULL) {
+        return (0);
+    }
+    jn->fd = open(cmd->journal_file, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0666);
+    if (jn->fd == -1) {
+        err = errno;
+        eprintf("--journal: open('%s') failed.\n", cmd->journal_file);
+        eexplain_err(err);
+        return (err);
+    }
+    if (fstat(jn->fd, &st) != 0) {
+        err = errno;
+        eprintf("--journal: fstat('%s') failed.\n", cmd->journal_file);
+        eexplain_err(err);
+        journal_close(jn);
+        return (err);
+    }
+    if (st.st_size == 0) {
+        return (0);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, jn->fd, 0);
+    if (map == MAP_FAILED) {
+        err = errno;
+        eprintf("--journal: mmap('%s') failed.\n", cmd->journal_file);
+        eexplain_err(err);
+        journal_close(jn);
+        return (err);
+    }
+    journal_replay((const char *)map, st.st_size, tab);
+    if (((const char *)map)[st.st_size - 1] != '\n') {
+        // Do not add to a line that was cut short.
+        jn->need_nl = true;
+    }
+    munmap(map, st.st_size);
+
+    nskip = 0;
+    for (i = 0; i < njobs; ++i) {
+        ent = &tab->job[i];
+        if ((ent->flags & (JOB_JOURNAL_DONE|JOB_SKIP)) == JOB_JOURNAL_DONE) {
+            ent->flags |= JOB_SKIP;
+            ++nskip;
+        }
+    }
+    if (cmd->verbose) {
+        eprintf("--journal: %u of %u jobs are already done.\n", nskip, nshard);
+    }
+    return (0);
+}
+
+/**
+ * @brief Add a line for a job that has finished.  It is not yet written.
+ *
+ * @param jn   IN  The journal
+ * @param tab  IN  The job table
+ * @param job  IN  The job, not yet let go of
+ *
+ */
+void
+journal_add(struct journal *jn, struct job_table *tab, struct batch_job *job)
+{
+    unsigned long long ms;
+    char line[96];
+    int status;
+    int len;
+
+    if (jn->fd < 0) {
+        return;
+    }
+    status = job->status;
+    if (WIFSIGNALED(status)) {
+        status = 128 + WTERMSIG(status);
+    }
+    else {
+        status = WEXITSTATUS(status);
+    }
+    ms = 0;
+    if (job->cmd->child_end_ns > job->cmd->child_start_ns) {
+        ms = (job->cmd->child_end_ns - job->cmd->child_start_ns) / 1000000;
+    }
+    len = snprintf(line, sizeof (line), "%s%u %016llx %d %llu\n",
+        jn->need_nl ? "\n" : "", job->id, job_hash(tab, job->id - 1), status, ms);
+    jn->need_nl = false;
+    if (jn->len + len > jn->cap) {
+        jn->cap = (jn->cap + len) * 2;
+        jn->buf = (char *)guard_mem(realloc(jn->buf, jn->cap));
+    }
+    memcpy(jn->buf + jn->len, line, len);
+    jn->len += len;
+}
+
+/**
+ * @brief Write out what has been added, and sync it.
+ *
+ * @param jn  IN  The journal
+ *
+ */
+void
+journal_flush(struct journal *jn)
+{
+    ssize_t n;
+    size_t off;
+
+    if (jn->fd < 0 || jn->len == 0) {
+        return;
+    }
+    for (off = 0; off < jn->len; off += n) {
+        n = write(jn->fd, jn->buf + off, jn->len - off);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            eprintf("--journal: write() failed.\n");
+            eexplain_err(errno);
+            break;
+        }
+    }
+    jn->len = 0;
+    if (fdatasync(jn->fd) != 0) {
+        eprintf("--journal: fdatasync() failed.\n");
+        eexplain_err(errno);
+    }
+}
+
+/**
+ * @brief Write out what is left, and close the journal.
+ *
+ * @param jn  IN  The journal
+ *
+ */
+void
+journal_close(struct journal *jn)
+{
+    journal_flush(jn);
+    if (jn->fd >= 0) {
+        close(jn->fd);
+        jn->fd = -1;
+    }
+    free(jn->buf);
+    jn->buf = NULL;
+    jn->cap = 0;
+}
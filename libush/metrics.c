@@ -0,0 +1,472 @@
+/*
+ * Filename: metrics.c
+ * Library: libush
+ * Brief: Counters and latency histograms, shared by all ush processes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import open()
+#include <stddef.h>
+    // Import offsetof()
+#include <stdint.h>
+    // Import uint64_t
+#include <stdio.h>
+    // Import printf()
+#include <string.h>
+    // Import memcmp()
+    // Import memcpy()
+    // Import strlen()
+#include <sys/mman.h>
+    // Import mmap()
+    // Import munmap()
+#include <sys/stat.h>
+    // Import fstat()
+#include <sys/wait.h>
+    // Import WIFEXITED()
+
+extern void eexplain_err(int err);
+
+#define METRICS_MAGIC     "USHMETR1"
+#define METRICS_VERSION   1
+#define METRICS_SLOTS     512
+#define METRICS_NAME_MAX  64
+#define METRICS_BUCKETS   33    // <= 2^k microseconds, k = 0..31; and more
+
+struct m_hist {
+    uint64_t bucket[METRICS_BUCKETS];
+    uint64_t sum_us;
+};
+
+struct m_slot {
+    uint64_t key;               // Hash of the name; 0 for a free slot
+    uint32_t named;             // name[] is complete
+    uint32_t pad;
+    char     name[METRICS_NAME_MAX];
+    uint64_t launches;
+    uint64_t failures;
+    uint64_t signaled;
+    uint64_t timeouts;
+    struct m_hist run;
+    struct m_hist startup;
+};
+
+struct m_region {
+    char     magic[8];
+    uint32_t version;
+    uint32_t nslots;
+    uint64_t pad[7];
+    struct m_slot slot[METRICS_SLOTS];
+};
+
+static struct m_region *metrics;
+
+/*
+ * Map a metrics file.  If it is new (empty), make it the right size.
+ * Two processes that do that at once both do the same thing.
+ */
+static struct m_region *
+metrics_map(const char *fname, bool create)
+{
+    static const char zeros[8];
+    struct m_region *region;
+    struct stat st;
+    int flags;
+    int fd;
+
+    flags = create ? (O_RDWR|O_CREAT|O_CLOEXEC) : (O_RDONLY|O_CLOEXEC);
+    fd = open(fname, flags, 0666);
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        int err = errno;
+        eprintf("--metrics: open('%s') failed.\n", fname);
+        eexplain_err(err);
+        if (fd != -1) {
+            close(fd);
+        }
+        errno = err;
+        return (NULL);
+    }
+    if (create && st.st_size == 0) {
+        if (ftruncate(fd, sizeof (struct m_region)) != 0) {
+            int err = errno;
+            eprintf("--metrics: ftruncate('%s') failed.\n", fname);
+            eexplain_err(err);
+            close(fd);
+            errno = err;
+            return (NULL);
+        }
+        st.st_size = sizeof (struct m_region);
+    }
+    if ((size_t)st.st_size != sizeof (struct m_region)) {
+        eprintf("--metrics: '%s' is not a metrics file.\n", fname);
+        close(fd);
+        errno = EINVAL;
+        return (NULL);
+    }
+
+    region = (struct m_region *)mmap(NULL, sizeof (struct m_region),
+        create ? (PROT_READ|PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) {
+        int err = errno;
+        eprintf("--metrics: mmap('%s') failed.\n", fname);
+        eexplain_err(err);
+        errno = err;
+        return (NULL);
+    }
+    if (create && memcmp(region->magic, zeros, sizeof (zeros)) == 0) {
+        region->version = METRICS_VERSION;
+        region->nslots = METRICS_SLOTS;
+        memcpy(region->magic, METRICS_MAGIC, sizeof (region->magic));
+    }
+    if (memcmp(region->magic, METRICS_MAGIC, sizeof (region->magic)) != 0
+        || region->version != METRICS_VERSION
+        || region->nslots != METRICS_SLOTS) {
+        eprintf("--metrics: '%s' is not a metrics file.\n", fname);
+        munmap(region, sizeof (struct m_region));
+        errno = EINVAL;
+        return (NULL);
+    }
+    return (region);
+}
+
+/**
+ * @brief Command-line option to count this run in a shared metrics file
+ *
+ * @param cmd    IN  Command "object" that hold context/control information
+ * @param fname  IN  The metrics file; created if need be
+ * @return errno-style status
+ *
+ */
+int
+cmd_metrics(cmd_t *cmd, const char *fname)
+{
+    struct m_region *region;
+
+    region = metrics_map(fname, true);
+    if (region == NULL) {
+        cmd->ioerr = errno;
+        return (cmd->ioerr);
+    }
+    if (metrics != NULL) {
+        munmap(metrics, sizeof (struct m_region));
+    }
+    metrics = region;
+    return (0);
+}
+
+/*
+ * FNV-1a.  Never 0, which marks a free slot.
+ */
+static uint64_t
+name_hash(const char *name, size_t len)
+{
+    uint64_t h;
+    size_t i;
+
+    h = 14695981039346656037ULL;
+    for (i = 0; i < len; ++i) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return (h ? h : 1);
+}
+
+/*
+ * Find, or claim, the slot for a command name.
+ */
+static struct m_slot *
+metrics_slot(const char *name)
+{
+    struct m_slot *slot;
+    uint64_t key;
+    uint64_t old;
+    size_t len;
+    unsigned int i;
+    unsigned int n;
+
+    if (name == NULL) {
+        name = "?";
+    }
+    len = strlen(name);
+    if (len > METRICS_NAME_MAX - 1) {
+        len = METRICS_NAME_MAX - 1;
+    }
+    key = name_hash(name, len);
+    i = key % METRICS_SLOTS;
+    for (n = 0; n < METRICS_SLOTS; ++n) {
+        slot = &metrics->slot[i];
+        old = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (old == 0) {
+            if (__atomic_compare_exchange_n(&slot->key, &old, key, false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                memcpy(slot->name, name, len);
+                slot->name[len] = '\0';
+                __atomic_store_n(&slot->named, 1, __ATOMIC_RELEASE);
+                return (slot);
+            }
+            // Someone else got it first; |old| is now theirs.
+        }
+        if (old == key) {
+            return (slot);
+        }
+        i = (i + 1) % METRICS_SLOTS;
+    }
+    return (NULL);
+}
+
+static void
+count(uint64_t *ctr, uint64_t n)
+{
+    __atomic_fetch_add(ctr, n, __ATOMIC_RELAXED);
+}
+
+static void
+hist_add(struct m_hist *hist, unsigned long long ns)
+{
+    unsigned long long us;
+    unsigned int b;
+
+    us = ns / 1000;
+    for (b = 0; b < METRICS_BUCKETS - 1 && (1ULL << b) < us; ++b) {
+        continue;
+    }
+    count(&hist->bucket[b], 1);
+    count(&hist->sum_us, us);
+}
+
+/*
+ * How long it took to get from the start of ush to exec() (or fork()).
+ * Only for the first run; later ones, with --repeat or --supervise,
+ * waited for the ones before.
+ */
+static void
+record_startup(struct m_slot *slot, cmd_t *cmd, unsigned long long launch_ns)
+{
+    if (cmd->metrics_started || cmd->start_ns == 0 || launch_ns < cmd->start_ns) {
+        return;
+    }
+    cmd->metrics_started = true;
+    hist_add(&slot->startup, launch_ns - cmd->start_ns);
+}
+
+/**
+ * @brief Count a child that has been reaped, or that could not be started.
+ *
+ * @param cmd     IN  Command "object"
+ * @param status  IN  Its wait status, or a made-up one
+ *
+ */
+void
+metrics_record(cmd_t *cmd, int status)
+{
+    struct m_slot *slot;
+
+    if (metrics == NULL) {
+        return;
+    }
+    slot = metrics_slot(cmd->cmd_name);
+    if (slot == NULL) {
+        return;
+    }
+    count(&slot->launches, 1);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        count(&slot->failures, 1);
+    }
+    if (WIFSIGNALED(status)) {
+        count(&slot->signaled, 1);
+    }
+    if (cmd->timed_out) {
+        count(&slot->timeouts, 1);
+    }
+    if (cmd->child_start_ns != 0 && cmd->child_end_ns >= cmd->child_start_ns) {
+        record_startup(slot, cmd, cmd->child_start_ns);
+        hist_add(&slot->run, cmd->child_end_ns - cmd->child_start_ns);
+    }
+}
+
+/**
+ * @brief Count a program that ush is about to become, with exec().
+ *
+ * @param cmd  IN  Command "object"
+ *
+ * Nothing more is known about it, after that.
+ *
+ */
+void
+metrics_exec(cmd_t *cmd)
+{
+    struct m_slot *slot;
+
+    if (metrics == NULL) {
+        return;
+    }
+    slot = metrics_slot(cmd->cmd_name);
+    if (slot == NULL) {
+        return;
+    }
+    count(&slot->launches, 1);
+    record_startup(slot, cmd, mono_ns());
+}
+
+/**
+ * @brief exec() failed, after metrics_exec().
+ *
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+metrics_exec_failed(cmd_t *cmd)
+{
+    struct m_slot *slot;
+
+    if (metrics == NULL) {
+        return;
+    }
+    slot = metrics_slot(cmd->cmd_name);
+    if (slot != NULL) {
+        count(&slot->failures, 1);
+    }
+}
+
+// ################ Prometheus text exposition format
+
+static void
+print_label(const char *name)
+{
+    const char *s;
+
+    printf("{command=\"");
+    for (s = name; *s != '\0'; ++s) {
+        if (*s == '\\' || *s == '"') {
+            printf("\\%c", *s);
+        }
+        else if (*s == '\n') {
+            printf("\\n");
+        }
+        else {
+            putchar(*s);
+        }
+    }
+    printf("\"");
+}
+
+static void
+print_counter(struct m_region *region, const char *metric, const char *help, size_t off)
+{
+    struct m_slot *slot;
+    unsigned int i;
+
+    printf("# HELP %s %s\n", metric, help);
+    printf("# TYPE %s counter\n", metric);
+    for (i = 0; i < METRICS_SLOTS; ++i) {
+        slot = &region->slot[i];
+        if (!__atomic_load_n(&slot->named, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        printf("%s", metric);
+        print_label(slot->name);
+        printf("} %llu\n", (unsigned long long)
+            __atomic_load_n((uint64_t *)((char *)slot + off), __ATOMIC_RELAXED));
+    }
+}
+
+/*
+ * The buckets are cumulative, and _count is the last of them, so that
+ * they agree with each other, even if some ush adds to them meanwhile.
+ */
+static void
+print_hist(struct m_region *region, const char *metric, const char *help, size_t off)
+{
+    struct m_slot *slot;
+    struct m_hist *hist;
+    unsigned long long cum;
+    unsigned int i;
+    unsigned int b;
+
+    printf("# HELP %s %s\n", metric, help);
+    printf("# TYPE %s histogram\n", metric);
+    for (i = 0; i < METRICS_SLOTS; ++i) {
+        slot = &region->slot[i];
+        if (!__atomic_load_n(&slot->named, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        hist = (struct m_hist *)((char *)slot + off);
+        cum = 0;
+        for (b = 0; b < METRICS_BUCKETS; ++b) {
+            cum += __atomic_load_n(&hist->bucket[b], __ATOMIC_RELAXED);
+            printf("%s_bucket", metric);
+            print_label(slot->name);
+            if (b < METRICS_BUCKETS - 1) {
+                printf(",le=\"%.6f\"} %llu\n", (double)(1ULL << b) / 1e6, cum);
+            }
+            else {
+                printf(",le=\"+Inf\"} %llu\n", cum);
+            }
+        }
+        printf("%s_sum", metric);
+        print_label(slot->name);
+        printf("} %.6f\n",
+            (double)__atomic_load_n(&hist->sum_us, __ATOMIC_RELAXED) / 1e6);
+        printf("%s_count", metric);
+        print_label(slot->name);
+        printf("} %llu\n", cum);
+    }
+}
+
+/**
+ * @brief Write a metrics file to stdout, in Prometheus text format.
+ *
+ * @param fname  IN  The metrics file
+ * @return errno-style status
+ *
+ */
+int
+metrics_dump(const char *fname)
+{
+    struct m_region *region;
+
+    region = metrics_map(fname, false);
+    if (region == NULL) {
+        return (errno);
+    }
+    print_counter(region, "ush_launches_total",
+        "Programs started by ush.", offsetof(struct m_slot, launches));
+    print_counter(region, "ush_failures_total",
+        "Programs that exited non-zero, were killed, or could not be started.",
+        offsetof(struct m_slot, failures));
+    print_counter(region, "ush_signaled_total",
+        "Programs killed by a signal.", offsetof(struct m_slot, signaled));
+    print_counter(region, "ush_timeouts_total",
+        "Programs stopped by --timeout.", offsetof(struct m_slot, timeouts));
+    print_hist(region, "ush_run_seconds",
+        "Time from fork() to reaping the program.", offsetof(struct m_slot, run));
+    print_hist(region, "ush_startup_seconds",
+        "Time from the start of ush to fork() or exec() of the program.",
+        offsetof(struct m_slot, startup));
+    munmap(region, sizeof (struct m_region));
+    if (fflush(stdout) != 0) {
+        return (errno);
+    }
+    return (0);
+}
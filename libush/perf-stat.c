@@ -0,0 +1,334 @@
+/*
+ * Filename: perf-stat.c
+ * Library: libush
+ * Brief: --perf-stat: count the child's events with perf_event_open()
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import pipe2()
+#include <linux/perf_event.h>
+    // Import struct perf_event_attr
+    // Import PERF_*
+#include <stdint.h>
+    // Import uint64_t
+#include <stdio.h>
+    // Import fprintf()
+#include <string.h>
+    // Import memset()
+    // Import strchr()
+    // Import strlen()
+    // Import strncmp()
+#include <sys/syscall.h>
+    // Import SYS_perf_event_open
+
+extern void eexplain_err(int err);
+
+struct perf_event {
+    const char *name;
+    unsigned int type;
+    unsigned long long config;
+};
+
+static const struct perf_event perf_events[] = {
+    { "task-clock",       PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "cpu-migrations",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+    { "page-faults",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { "cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "branches",         PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { "branch-misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+    { "cache-misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+};
+
+#define PERF_NEVENTS (sizeof (perf_events) / sizeof (perf_events[0]))
+#define PERF_DEFAULT 0x3f       // The first six
+
+#define EV_CYCLES       4
+#define EV_INSTRUCTIONS 5
+
+/**
+ * @brief Command-line option to count the child's events
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  A comma-separated list of events, or NULL, for the default
+ * @return errno-style status
+ *
+ * Implies --fork and --report.
+ *
+ */
+int
+cmd_perf_stat(cmd_t *cmd, const char *arg)
+{
+    const char *name;
+    const char *end;
+    unsigned int mask;
+    size_t len;
+    size_t i;
+
+    mask = 0;
+    if (arg == NULL || *arg == '\0') {
+        mask = PERF_DEFAULT;
+    }
+    for (name = arg; name != NULL && *name != '\0'; name = end) {
+        end = strchr(name, ',');
+        len = (end == NULL) ? strlen(name) : (size_t)(end - name);
+        for (i = 0; i < PERF_NEVENTS; ++i) {
+            if (strlen(perf_events[i].name) == len
+                && strncmp(perf_events[i].name, name, len) == 0) {
+                break;
+            }
+        }
+        if (i == PERF_NEVENTS) {
+            eprintf("--perf-stat: unknown event, '%.*s'.\n", (int)len, name);
+            eprintf("Known events are:");
+            for (i = 0; i < PERF_NEVENTS; ++i) {
+                eprintf(" %s", perf_events[i].name);
+            }
+            eprintf("\n");
+            return (EINVAL);
+        }
+        mask |= 1U << i;
+        if (end != NULL) {
+            ++end;
+        }
+    }
+
+    cmd->perf_events = mask;
+    cmd->cmd_fork = true;
+    cmd->report = true;
+    return (0);
+}
+
+/**
+ * @brief Make the pipe that holds the child back.  Before fork().
+ *
+ * @param cmd  IN  Command "object"
+ * @return errno-style status
+ *
+ */
+int
+perf_prepare(cmd_t *cmd)
+{
+    unsigned int i;
+
+    cmd->perf_go[0] = -1;
+    cmd->perf_go[1] = -1;
+    for (i = 0; i < USH_PERF_MAX; ++i) {
+        cmd->perf_fd[i] = -1;
+    }
+    cmd->perf_have = 0;
+    if (cmd->perf_events == 0) {
+        return (0);
+    }
+    if (pipe2(cmd->perf_go, O_CLOEXEC) != 0) {
+        int err = errno;
+        eprintf("--perf-stat: pipe2() failed.\n");
+        eexplain_err(err);
+        return (err);
+    }
+    return (0);
+}
+
+/**
+ * @brief The child side.  Wait for the counters.  After fork(), before exec().
+ *
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+perf_child_setup(cmd_t *cmd)
+{
+    char c;
+
+    if (cmd->perf_go[0] < 0) {
+        return;
+    }
+    close(cmd->perf_go[1]);
+    while (read(cmd->perf_go[0], &c, 1) == -1 && errno == EINTR) {
+        continue;
+    }
+    close(cmd->perf_go[0]);
+}
+
+static int
+perf_open(const struct perf_event *ev, pid_t pid, bool user_only)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof (attr));
+    attr.size = sizeof (attr);
+    attr.type = ev->type;
+    attr.config = ev->config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return ((int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+}
+
+/**
+ * @brief The parent side.  Open the counters, and let the child go on.
+ *
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+perf_parent_setup(cmd_t *cmd)
+{
+    unsigned int i;
+    bool user_only;
+
+    if (cmd->perf_go[0] < 0) {
+        return;
+    }
+    close(cmd->perf_go[0]);
+    cmd->perf_go[0] = -1;
+
+    user_only = false;
+    for (i = 0; i < PERF_NEVENTS; ++i) {
+        if ((cmd->perf_events & (1U << i)) == 0) {
+            continue;
+        }
+        cmd->perf_fd[i] = perf_open(&perf_events[i], cmd->child, user_only);
+        if (cmd->perf_fd[i] < 0 && (errno == EACCES || errno == EPERM) && !user_only) {
+            user_only = true;
+            cmd->perf_fd[i] = perf_open(&perf_events[i], cmd->child, user_only);
+        }
+        if (cmd->perf_fd[i] < 0 && cmd->verbose) {
+            eprintf("--perf-stat: %s: ", perf_events[i].name);
+            eexplain_err(errno);
+        }
+    }
+    if (user_only && cmd->verbose) {
+        eprintf("--perf-stat: counting user-mode events only.\n");
+    }
+
+    if (write(cmd->perf_go[1], "", 1) < 0) {
+        // Closing it lets the child go on, anyway.
+    }
+    close(cmd->perf_go[1]);
+    cmd->perf_go[1] = -1;
+}
+
+/**
+ * @brief Read the counters, after the child is reaped, and close them.
+ *
+ * @param cmd  IN  Command "object"
+ *
+ * A count is scaled up if its counter had to share the hardware
+ * with others, and so was running only part of the time.
+ *
+ */
+void
+perf_collect(cmd_t *cmd)
+{
+    uint64_t val[3];    // value, time enabled, time running
+    unsigned int i;
+
+    for (i = 0; i < USH_PERF_MAX; ++i) {
+        if (cmd->perf_fd[i] < 0) {
+            continue;
+        }
+        if (read(cmd->perf_fd[i], val, sizeof (val)) == sizeof (val)) {
+            if (val[2] != 0 && val[2] < val[1]) {
+                val[0] = (uint64_t)((double)val[0] * val[1] / val[2]);
+            }
+            cmd->perf_count[i] = val[0];
+            cmd->perf_have |= 1U << i;
+        }
+        close(cmd->perf_fd[i]);
+        cmd->perf_fd[i] = -1;
+    }
+}
+
+/**
+ * @brief Let go of everything, if there never was a child.
+ *
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+perf_teardown(cmd_t *cmd)
+{
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+        if (cmd->perf_go[i] >= 0) {
+            close(cmd->perf_go[i]);
+            cmd->perf_go[i] = -1;
+        }
+    }
+    perf_collect(cmd);
+}
+
+/**
+ * @brief Show the counts, for the exit report.
+ *
+ * @param f    IN  Write to this stdio file handle
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+fshow_perf_stat(FILE *f, cmd_t *cmd)
+{
+    unsigned long long wall_ns;
+    unsigned int i;
+    unsigned int bit;
+
+    if (cmd->perf_events == 0) {
+        return;
+    }
+    wall_ns = cmd->child_end_ns - cmd->child_start_ns;
+    fprintf(f, "  perf\n");
+    for (i = 0; i < PERF_NEVENTS; ++i) {
+        bit = 1U << i;
+        if ((cmd->perf_events & bit) == 0) {
+            continue;
+        }
+        fprintf(f, "    %-17s", perf_events[i].name);
+        if ((cmd->perf_have & bit) == 0) {
+            fprintf(f, "not supported\n");
+            continue;
+        }
+        if (i == 0) {
+            fprintf(f, "%.3f ms", (double)cmd->perf_count[i] / 1e6);
+            if (wall_ns != 0) {
+                fprintf(f, ", %.2f CPUs", (double)cmd->perf_count[i] / wall_ns);
+            }
+        }
+        else {
+            fprintf(f, "%llu", cmd->perf_count[i]);
+        }
+        if (i == EV_INSTRUCTIONS && (cmd->perf_have & (1U << EV_CYCLES))
+            && cmd->perf_count[EV_CYCLES] != 0) {
+            fprintf(f, ", %.2f per cycle",
+                (double)cmd->perf_count[i] / cmd->perf_count[EV_CYCLES]);
+        }
+        fputc('\n', f);
+    }
+}
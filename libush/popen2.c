@@ -0,0 +1,427 @@
+/*
+ * Filename: popen2.c
+ * Library: libush
+ * Brief: Run a prepared command with pipes to its stdin, stdout and stderr
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import pipe2()
+    // Import splice()
+    // Import vmsplice()
+    // Import fcntl()
+#include <poll.h>
+    // Import poll()
+#include <stdlib.h>
+    // Import calloc()
+    // Import free()
+#include <string.h>
+    // Import memcpy()
+#include <sys/uio.h>
+    // Import type struct iovec
+
+extern int ush_getopt(cmd_t *cmd, int argc, char **argv, bool setargv);
+extern void *guard_mem(void *obj);
+extern void eexplain_err(int err);
+
+static void
+close_fd(int *fdp)
+{
+    if (*fdp >= 0) {
+        close(*fdp);
+        *fdp = -1;
+    }
+}
+
+/*
+ * Make the pipe for child fd |fd|.
+ * The child's end goes in the child fd plan.  The caller's end is returned.
+ */
+static int
+make_pipe(cmd_t *cmd, int fd, int *ret)
+{
+    int pfd[2];
+    int mine;
+    int theirs;
+
+    if (cmd->child_fd[fd] >= 0) {
+        eprintf("ush_popen2: A pipe to fd %d cannot be combined"
+            " with a redirection of the same fd.\n", fd);
+        return (EINVAL);
+    }
+    if (pipe2(pfd, O_CLOEXEC) != 0) {
+        int err = errno;
+        eprintf("pipe2() failed.\n");
+        eexplain_err(err);
+        return (err);
+    }
+    // fd 0 reads from the pipe; fd 1 and fd 2 write to it.
+    mine   = (fd == 0) ? pfd[1] : pfd[0];
+    theirs = (fd == 0) ? pfd[0] : pfd[1];
+    fcntl(mine, F_SETFL, fcntl(mine, F_GETFL) | O_NONBLOCK);
+    cmd->child_fd[fd] = theirs;
+    *ret = mine;
+    return (0);
+}
+
+/*
+ * Options that need ush to pump the child's output, or to watch
+ * the child, while it runs, cannot work here.  ush gets control
+ * back only in ush_pclose2(); until then, the caller runs its own
+ * event loop, on the pipes and the pidfd.
+ */
+static int
+popen2_check(cmd_t *cmd)
+{
+    const char *opt;
+
+    opt = NULL;
+    if (cmd->timeout_ns != 0) {
+        opt = "--timeout";
+    }
+    else if (cmd->tee_count[1] != 0 || cmd->tee_count[2] != 0) {
+        opt = "--stdout-tee or --stderr-tee";
+    }
+    else if (cmd->compress_algo[1] != 0 || cmd->compress_algo[2] != 0) {
+        opt = "--stdout-compress or --stderr-compress";
+    }
+    else if (cmd->ring[1] != NULL || cmd->ring[2] != NULL) {
+        opt = "--stdout-ring or --stderr-ring";
+    }
+    else if (cmd->ready_fd != 0) {
+        opt = "--ready-fd";
+    }
+    else if (cmd->sample_ns != 0) {
+        opt = "--sample";
+    }
+    else if (cmd->supervise || cmd->repeat != 0 || cmd->batch_manifest != NULL) {
+        opt = "--supervise, --repeat or --batch";
+    }
+    if (opt != NULL) {
+        eprintf("ush_popen2: %s cannot be used;"
+            " ush does not run while the child does.\n", opt);
+        return (EINVAL);
+    }
+    return (0);
+}
+
+/*
+ * With the spawn helper running, the child is started by the helper.
+ * The options are acted on there, too, in the child, not here;
+ * a bad option shows up in the wait status from ush_pclose2().
+ */
+static int
+popen2_helper(int argc, char **argv, int pipes, ush_proc_t *proc)
+{
+    cmd_t *cmd;
+    char **cmd_argv;
+    char ush_path[] = "ush";
+    char opt_command[] = "--command";
+    int child_fd[3];
+    int fd;
+    int rv;
+
+    cmd = (cmd_t *)guard_mem(calloc(1, sizeof (*cmd)));
+    for (fd = 0; fd < 3; ++fd) {
+        cmd->child_fd[fd] = -1;
+    }
+    rv = 0;
+    if (rv == 0 && (pipes & USH_PIPE_STDIN)) {
+        rv = make_pipe(cmd, 0, &proc->stdin_fd);
+    }
+    if (rv == 0 && (pipes & USH_PIPE_STDOUT)) {
+        rv = make_pipe(cmd, 1, &proc->stdout_fd);
+    }
+    if (rv == 0 && (pipes & USH_PIPE_STDERR)) {
+        rv = make_pipe(cmd, 2, &proc->stderr_fd);
+    }
+
+    if (rv == 0) {
+        cmd_argv = (char **)guard_mem(calloc(argc + 3, sizeof (char *)));
+        cmd_argv[0] = ush_path;
+        cmd_argv[1] = opt_command;
+        memcpy(cmd_argv + 2, argv, argc * sizeof (char *));
+        for (fd = 0; fd < 3; ++fd) {
+            child_fd[fd] = (cmd->child_fd[fd] >= 0) ? cmd->child_fd[fd] : fd;
+        }
+        rv = helper_spawn(argc + 2, cmd_argv, child_fd,
+            &cmd->helper_fd, &cmd->child, &cmd->child_pidfd);
+        free(cmd_argv);
+    }
+    for (fd = 0; fd < 3; ++fd) {
+        close_fd(&cmd->child_fd[fd]);
+    }
+
+    if (rv != 0) {
+        close_fd(&proc->stdin_fd);
+        close_fd(&proc->stdout_fd);
+        close_fd(&proc->stderr_fd);
+        free(cmd);
+        return (rv);
+    }
+    cmd->helper = true;
+    proc->pid = cmd->child;
+    proc->pidfd = cmd->child_pidfd;
+    proc->cmd = cmd;
+    return (0);
+}
+
+/**
+ * @brief Start a program, with pipes to any of its stdin, stdout, stderr.
+ *
+ * @param argc   IN   Count of arguments
+ * @param argv   IN   Options, then the program and its arguments
+ * @param pipes  IN   Any of USH_PIPE_STDIN | USH_PIPE_STDOUT | USH_PIPE_STDERR
+ * @param proc   OUT  Handle for the running child
+ * @return errno-style status
+ *
+ */
+int
+ush_popen2(int argc, char **argv, int pipes, ush_proc_t *proc)
+{
+    cmd_t *cmd;
+    char **cmd_argv;
+    char ush_path[] = "ush";
+    int fd;
+    int rv;
+
+    proc->pid = -1;
+    proc->pidfd = -1;
+    proc->stdin_fd = -1;
+    proc->stdout_fd = -1;
+    proc->stderr_fd = -1;
+    proc->cmd = NULL;
+
+    set_print_fh();
+    if (helper_running()) {
+        return (popen2_helper(argc, argv, pipes, proc));
+    }
+    cmd = (cmd_t *)guard_mem(calloc(1, sizeof (*cmd)));
+    cmd_argv = (char **)guard_mem(calloc(argc + 2, sizeof (char *)));
+    cmd_argv[0] = ush_path;
+    memcpy(cmd_argv + 1, argv, argc * sizeof (char *));
+
+    // --stdin, --stdout and --stderr go in the child fd plan,
+    // not over the caller's own fds; see set_stdin().
+    //
+    for (fd = 0; fd < 3; ++fd) {
+        cmd->child_fd[fd] = -1;
+    }
+    cmd->child_fd_plan = true;
+    rv = ush_getopt(cmd, argc + 1, cmd_argv, true);
+    if (rv == 0 && cmd->ioerr != 0) {
+        rv = cmd->ioerr;
+    }
+    else if (rv == 0 && cmd->argc == 0) {
+        eprintf("ush_popen2: Must supply at least a command name.\n");
+        rv = EINVAL;
+    }
+    else if (rv != 0) {
+        rv = EINVAL;
+    }
+    if (rv == 0) {
+        rv = popen2_check(cmd);
+    }
+    if (rv != 0) {
+        for (fd = 0; fd < 3; ++fd) {
+            close_fd(&cmd->child_fd[fd]);
+        }
+        free(cmd_argv);
+        cmd_free_args(cmd);
+        free(cmd);
+        return (rv);
+    }
+    cmd->cmd_fork = true;
+
+    if (rv == 0 && (pipes & USH_PIPE_STDIN)) {
+        rv = make_pipe(cmd, 0, &proc->stdin_fd);
+    }
+    if (rv == 0 && (pipes & USH_PIPE_STDOUT)) {
+        rv = make_pipe(cmd, 1, &proc->stdout_fd);
+    }
+    if (rv == 0 && (pipes & USH_PIPE_STDERR)) {
+        rv = make_pipe(cmd, 2, &proc->stderr_fd);
+    }
+
+    if (rv == 0) {
+        rv = limit_acquire(cmd);
+    }
+    if (rv == 0) {
+        rv = start_child_program(cmd);
+        if (rv != 0) {
+            rv = WEXITSTATUS(rv) ? WEXITSTATUS(rv) : EIO;
+            limit_release(cmd);
+        }
+    }
+
+    // The child has its own copies, by now, or there is no child.
+    //
+    for (fd = 0; fd < 3; ++fd) {
+        close_fd(&cmd->child_fd[fd]);
+    }
+    cmd->child_fd_plan = false;
+    free(cmd_argv);
+    cmd->argv = NULL;
+
+    if (rv != 0) {
+        close_fd(&proc->stdin_fd);
+        close_fd(&proc->stdout_fd);
+        close_fd(&proc->stderr_fd);
+        cmd_free_args(cmd);
+        free(cmd);
+        return (rv);
+    }
+    proc->pid = cmd->child;
+    proc->pidfd = cmd->child_pidfd;
+    proc->cmd = cmd;
+    return (0);
+}
+
+/**
+ * @brief Close the pipes, and wait for the child.
+ *
+ * @param proc  IN  Handle from ush_popen2()
+ * @return the wait status of the child, like pclose(3), or -1
+ *
+ * The caller must not close |proc->pidfd|.
+ *
+ */
+int
+ush_pclose2(ush_proc_t *proc)
+{
+    cmd_t *cmd;
+    int rv;
+
+    cmd = proc->cmd;
+    if (cmd == NULL) {
+        errno = ECHILD;
+        return (-1);
+    }
+    close_fd(&proc->stdin_fd);
+    close_fd(&proc->stdout_fd);
+    close_fd(&proc->stderr_fd);
+    if (cmd->helper) {
+        rv = helper_wait(cmd->helper_fd);
+        close_fd(&cmd->child_pidfd);
+    }
+    else {
+        rv = wait_child_program(cmd);
+        limit_release(cmd);
+    }
+    cmd_free_args(cmd);
+    free(cmd);
+    proc->cmd = NULL;
+    proc->pid = -1;
+    proc->pidfd = -1;
+    return (rv);
+}
+
+/**
+ * @brief Move up to |len| bytes from |in_fd| to |out_fd|, in the kernel.
+ *
+ * @param in_fd   IN  Read from here
+ * @param out_fd  IN  Write to here
+ * @param len     IN  At most this many bytes
+ * @return bytes moved, 0 at end of file, or -1 with errno set;
+ *         EAGAIN if either side is not ready.
+ *
+ * One of the two must be a pipe, such as one from ush_popen2().
+ *
+ */
+ssize_t
+ush_splice(int in_fd, int out_fd, size_t len)
+{
+    ssize_t n;
+
+    do {
+        n = splice(in_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (n == -1 && errno == EINTR);
+    return (n);
+}
+
+/**
+ * @brief Map up to |len| bytes of the caller's memory into a pipe.
+ *
+ * @param pipe_fd  IN  Write end of a pipe, such as |proc->stdin_fd|
+ * @param buf      IN  The data
+ * @param len      IN  Its length
+ * @return bytes accepted, or -1 with errno set
+ *
+ * The pages are not copied.  The caller must not change that part
+ * of |buf| until the child has read it.
+ *
+ */
+ssize_t
+ush_vmsplice(int pipe_fd, const void *buf, size_t len)
+{
+    struct iovec iov;
+    ssize_t n;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    do {
+        n = vmsplice(pipe_fd, &iov, 1, SPLICE_F_NONBLOCK);
+    } while (n == -1 && errno == EINTR);
+    return (n);
+}
+
+/**
+ * @brief Move everything from |in_fd| to |out_fd|, until end of file.
+ *
+ * @param in_fd   IN  Read from here
+ * @param out_fd  IN  Write to here
+ * @return errno-style status
+ *
+ * Waits, as need be, for either side.
+ *
+ */
+int
+ush_splice_all(int in_fd, int out_fd)
+{
+    struct pollfd pfd;
+    ssize_t n;
+
+    while (true) {
+        n = ush_splice(in_fd, out_fd, 1 << 20);
+        if (n > 0) {
+            continue;
+        }
+        if (n == 0) {
+            return (0);
+        }
+        if (errno != EAGAIN) {
+            return (errno);
+        }
+
+        // Not ready.  It might be either side.
+        pfd.fd = in_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLIN | POLLHUP))) {
+            pfd.fd = out_fd;
+            pfd.events = POLLOUT;
+        }
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            return (errno);
+        }
+    }
+}
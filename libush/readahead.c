@@ -0,0 +1,288 @@
+/*
+ * Filename: readahead.c
+ * Library: libush
+ * Brief: Start reading files into the page cache, before the child needs them
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import open()
+    // Import readahead()
+    // Import posix_fadvise()
+#include <pthread.h>
+    // Import pthread_create()
+    // Import pthread_detach()
+    // Import pthread_mutex_*()
+    // Import pthread_cond_*()
+#include <stdlib.h>
+    // Import calloc()
+    // Import malloc()
+    // Import getenv()
+    // Import free()
+#include <string.h>
+    // Import memcpy()
+    // Import strchr()
+    // Import strcmp()
+    // Import strdup()
+    // Import strlen()
+#include <sys/stat.h>
+    // Import fstat()
+    // Import S_ISREG()
+
+extern void *guard_mem(void *obj);
+extern void eexplain_err(int err);
+
+#define RA_CHUNK (2 * 1024 * 1024)
+
+struct ra_item {
+    struct ra_item *next;
+    char   *path;       // Open this, or
+    int    fd;          // ... use this, which is ours to close
+};
+
+static pthread_mutex_t ra_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cv = PTHREAD_COND_INITIALIZER;
+static struct ra_item *ra_head;
+static struct ra_item **ra_tail = &ra_head;
+static pthread_cond_t ra_idle_cv = PTHREAD_COND_INITIALIZER;
+static bool ra_busy;
+static bool ra_started;
+static bool ra_inline;
+static bool ra_verbose;
+
+static void
+ra_file(struct ra_item *item)
+{
+    struct stat st;
+    off_t off;
+    int fd;
+
+    fd = item->fd;
+    if (fd < 0) {
+        fd = open(item->path, O_RDONLY|O_CLOEXEC);
+        if (fd == -1) {
+            if (ra_verbose) {
+                eprintf("--readahead: open('%s') failed; skipped.\n", item->path);
+            }
+            return;
+        }
+    }
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        // The kernel reads only so much for any one call.
+        for (off = 0; off < st.st_size; off += RA_CHUNK) {
+            if (readahead(fd, off, RA_CHUNK) != 0) {
+                posix_fadvise(fd, off, 0, POSIX_FADV_WILLNEED);
+                break;
+            }
+        }
+    }
+    close(fd);
+}
+
+static void *
+ra_thread(void *arg)
+{
+    struct ra_item *item;
+
+    (void)arg;
+    while (true) {
+        pthread_mutex_lock(&ra_mu);
+        ra_busy = false;
+        while (ra_head == NULL) {
+            pthread_cond_broadcast(&ra_idle_cv);
+            pthread_cond_wait(&ra_cv, &ra_mu);
+        }
+        item = ra_head;
+        ra_head = item->next;
+        if (ra_head == NULL) {
+            ra_tail = &ra_head;
+        }
+        ra_busy = true;
+        pthread_mutex_unlock(&ra_mu);
+
+        ra_file(item);
+        free(item->path);
+        free(item);
+    }
+    return (NULL);
+}
+
+/*
+ * Hand a file to the helper thread, starting it, if need be.
+ */
+static void
+ra_queue(char *path, int fd)
+{
+    struct ra_item *item;
+    pthread_t thread;
+
+    item = (struct ra_item *)guard_mem(calloc(1, sizeof (*item)));
+    item->path = path;
+    item->fd = fd;
+
+    pthread_mutex_lock(&ra_mu);
+    if (!ra_started) {
+        ra_started = true;
+        if (pthread_create(&thread, NULL, ra_thread, NULL) == 0) {
+            pthread_detach(thread);
+        }
+        else {
+            ra_inline = true;
+        }
+    }
+    if (!ra_inline) {
+        *ra_tail = item;
+        ra_tail = &item->next;
+        pthread_cond_signal(&ra_cv);
+        item = NULL;
+    }
+    pthread_mutex_unlock(&ra_mu);
+
+    if (item != NULL) {
+        // No thread.  It is still worth doing.
+        ra_file(item);
+        free(item->path);
+        free(item);
+    }
+}
+
+/**
+ * @brief Command-line option to start reading a file into the page cache
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  A file, or "auto", for the program and stdin
+ * @return errno-style status
+ *
+ */
+int
+cmd_readahead(cmd_t *cmd, const char *arg)
+{
+    ra_verbose = cmd->verbose;
+    if (strcmp(arg, "auto") == 0) {
+        cmd->readahead_auto = true;
+        return (0);
+    }
+    ra_queue((char *)guard_mem(strdup(arg)), -1);
+    return (0);
+}
+
+/**
+ * @brief Start reading a program into the page cache.
+ *
+ * @param cmd_path  IN  The program, as for execvp()
+ *
+ * The program is looked for in $PATH, the way execvp() will.
+ *
+ */
+void
+readahead_program(const char *cmd_path)
+{
+    const char *path;
+    const char *dir;
+    const char *end;
+    size_t dlen;
+    size_t nlen;
+    char *fname;
+
+    if (cmd_path == NULL) {
+        return;
+    }
+    if (strchr(cmd_path, '/') != NULL) {
+        ra_queue((char *)guard_mem(strdup(cmd_path)), -1);
+        return;
+    }
+
+    path = getenv("PATH");
+    if (path == NULL) {
+        path = "/bin:/usr/bin";
+    }
+    nlen = strlen(cmd_path);
+    for (dir = path; ; dir = end + 1) {
+        end = strchr(dir, ':');
+        if (end == NULL) {
+            end = dir + strlen(dir);
+        }
+        dlen = end - dir;
+        fname = (char *)guard_mem(malloc(dlen + nlen + 3));
+        if (dlen == 0) {
+            fname[0] = '.';
+            dlen = 1;
+        }
+        else {
+            memcpy(fname, dir, dlen);
+        }
+        fname[dlen] = '/';
+        memcpy(fname + dlen + 1, cmd_path, nlen + 1);
+        if (access(fname, X_OK) == 0) {
+            ra_queue(fname, -1);
+            return;
+        }
+        free(fname);
+        if (*end == '\0') {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief With --readahead=auto, start reading the program and its stdin.
+ *
+ * @param cmd  IN  Command "object"
+ *
+ * Called once the program is known, just before fork() or exec().
+ *
+ */
+void
+readahead_exec(cmd_t *cmd)
+{
+    struct stat st;
+    int fd;
+
+    if (!cmd->readahead_auto) {
+        return;
+    }
+    ra_verbose = cmd->verbose;
+    readahead_program(cmd->cmd_path);
+    if (fstat(0, &st) == 0 && S_ISREG(st.st_mode)) {
+        fd = fcntl(0, F_DUPFD_CLOEXEC, 3);
+        if (fd >= 0) {
+            ra_queue(NULL, fd);
+        }
+    }
+}
+
+/**
+ * @brief Wait until every read asked for so far has been started.
+ *
+ * Before exec(), which would end the helper thread.
+ *
+ */
+void
+readahead_wait(void)
+{
+    pthread_mutex_lock(&ra_mu);
+    while (ra_started && !ra_inline && (ra_head != NULL || ra_busy)) {
+        pthread_cond_wait(&ra_idle_cv, &ra_mu);
+    }
+    pthread_mutex_unlock(&ra_mu);
+}
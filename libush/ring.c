@@ -0,0 +1,448 @@
+/*
+ * Filename: ring.c
+ * Library: libush
+ * Brief: Keep only the newest output of the child, in a fixed-size file
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import open()
+    // Import pipe2()
+    // Import fcntl()
+    // Import posix_fallocate()
+#include <stdint.h>
+    // Import type uint64_t
+#include <stdlib.h>
+    // Import calloc()
+    // Import malloc()
+    // Import free()
+#include <string.h>
+    // Import memcmp()
+    // Import memcpy()
+    // Import strrchr()
+    // Import strndup()
+#include <sys/mman.h>
+    // Import mmap()
+    // Import munmap()
+#include <sys/stat.h>
+    // Import fstat()
+    // Import S_IRUSR
+    // Import S_IWUSR
+
+extern void *guard_mem(void *obj);
+extern void eexplain_err(int err);
+
+#define RING_MAGIC   "USHRING1"
+#define RING_HDR_SZ  4096
+
+// Most to read from the pipe at a time.
+//
+#define RING_CHUNK   (256 * 1024)
+
+struct ring_header {
+    char     magic[8];
+    uint64_t size;
+    uint64_t head;
+    uint64_t tail;
+};
+
+struct ring {
+    struct ring_header *hdr;
+    char     *data;
+    size_t   size;
+    size_t   map_len;
+};
+
+static void
+ring_close(struct ring *ring)
+{
+    if (ring->hdr != NULL) {
+        munmap(ring->hdr, ring->map_len);
+    }
+    free(ring);
+}
+
+static int
+ring_open(const char *opt, const char *fname, size_t size, struct ring **ret)
+{
+    struct ring *ring;
+    struct stat st;
+    void *map;
+    int rfd;
+    int err;
+
+    rfd = open(fname, O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR);
+    if (rfd == -1 || fstat(rfd, &st) != 0) {
+        err = errno;
+        eprintf("%s: open('%s') failed.\n", opt, fname);
+        eexplain_err(err);
+        if (rfd != -1) {
+            close(rfd);
+        }
+        return (err);
+    }
+    if ((size_t)st.st_size != RING_HDR_SZ + size) {
+        // New, or of some other size.  Start over.
+        if (ftruncate(rfd, 0) != 0) {
+            err = errno;
+            eprintf("%s: ftruncate('%s') failed.\n", opt, fname);
+            eexplain_err(err);
+            close(rfd);
+            return (err);
+        }
+    }
+    // Allocate the blocks now, not as a sparse file.  Otherwise,
+    // a full disk would be found by a store into the mapping: SIGBUS.
+    //
+    err = posix_fallocate(rfd, 0, RING_HDR_SZ + size);
+    if (err != 0) {
+        eprintf("%s: posix_fallocate('%s') failed.\n", opt, fname);
+        eexplain_err(err);
+        close(rfd);
+        return (err);
+    }
+    map = mmap(NULL, RING_HDR_SZ + size, PROT_READ|PROT_WRITE, MAP_SHARED, rfd, 0);
+    err = errno;
+    close(rfd);
+    if (map == MAP_FAILED) {
+        eprintf("%s: mmap('%s') failed.\n", opt, fname);
+        eexplain_err(err);
+        return (err);
+    }
+
+    ring = (struct ring *)guard_mem(calloc(1, sizeof (*ring)));
+    ring->hdr = (struct ring_header *)map;
+    ring->data = (char *)map + RING_HDR_SZ;
+    ring->size = size;
+    ring->map_len = RING_HDR_SZ + size;
+    if (memcmp(ring->hdr->magic, RING_MAGIC, 8) != 0 || ring->hdr->size != size
+        || ring->hdr->tail > ring->hdr->head) {
+        ring->hdr->size = size;
+        ring->hdr->head = 0;
+        ring->hdr->tail = 0;
+        memcpy(ring->hdr->magic, RING_MAGIC, 8);
+    }
+    *ret = ring;
+    return (0);
+}
+
+static int
+cmd_ring(cmd_t *cmd, int fd, const char *opt, const char *arg)
+{
+    unsigned long long size;
+    const char *colon;
+    char *fname;
+    int rv;
+
+    colon = strrchr(arg, ':');
+    if (colon == NULL || colon == arg || parse_size(colon + 1, &size) != 0
+        || size < 4096 || size > (1ULL << 40)) {
+        eprintf("%s: '%s' must be <path>:<size>, with a size of 4K or more.\n", opt, arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    if (cmd->ring[fd] != NULL) {
+        ring_close((struct ring *)cmd->ring[fd]);
+        cmd->ring[fd] = NULL;
+    }
+    fname = (char *)guard_mem(strndup(arg, colon - arg));
+    rv = ring_open(opt, fname, (size_t)size, (struct ring **)&cmd->ring[fd]);
+    free(fname);
+    if (rv != 0) {
+        cmd->ioerr = rv;
+        return (rv);
+    }
+    cmd->cmd_fork = true;
+    return (0);
+}
+
+/**
+ * @brief Command-line option to send the child's stdout to a ring file
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  <path>:<size>
+ * @return errno-style status
+ *
+ * --stdout-ring implies --fork.
+ *
+ */
+int
+cmd_stdout_ring(cmd_t *cmd, const char *arg)
+{
+    return (cmd_ring(cmd, 1, "--stdout-ring", arg));
+}
+
+int
+cmd_stderr_ring(cmd_t *cmd, const char *arg)
+{
+    return (cmd_ring(cmd, 2, "--stderr-ring", arg));
+}
+
+/**
+ * @brief Make the pipes for the ring files.  Before fork().
+ *
+ * @param cmd  IN  Command "object"
+ * @return errno-style status
+ *
+ */
+int
+ring_prepare(cmd_t *cmd)
+{
+    int pfd[2];
+    int fd;
+
+    cmd->ring_src[1] = -1;
+    cmd->ring_src[2] = -1;
+    if (cmd->ring[1] == NULL && cmd->ring[2] == NULL) {
+        return (0);
+    }
+
+    if (!cmd->child_fd_plan) {
+        for (fd = 0; fd < 3; ++fd) {
+            cmd->child_fd[fd] = -1;
+        }
+        cmd->child_fd_plan = true;
+    }
+    for (fd = 1; fd <= 2; ++fd) {
+        if (cmd->ring[fd] == NULL) {
+            continue;
+        }
+        if (cmd->child_fd[fd] >= 0) {
+            eprintf("A ring file for fd %d cannot be combined with tee,"
+                " compression or in-memory capture.\n", fd);
+            ring_finish(cmd);
+            return (EINVAL);
+        }
+        if (pipe2(pfd, O_CLOEXEC) != 0) {
+            int err = errno;
+            eprintf("pipe2() failed, for ring file.\n");
+            eexplain_err(err);
+            ring_finish(cmd);
+            return (err);
+        }
+        fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+        cmd->ring_src[fd] = pfd[0];
+        cmd->child_fd[fd] = pfd[1];
+    }
+    return (0);
+}
+
+/**
+ * @brief Close the child's ends of the ring pipes.  After fork().
+ *
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+ring_parent_setup(cmd_t *cmd)
+{
+    int fd;
+
+    for (fd = 1; fd <= 2; ++fd) {
+        if (cmd->ring_src[fd] >= 0) {
+            close(cmd->child_fd[fd]);
+            cmd->child_fd[fd] = -1;
+        }
+    }
+}
+
+/**
+ * @brief Move whatever is in the child's pipe into the ring.
+ *
+ * @param cmd  IN  Command "object"
+ * @param fd   IN  1 for stdout, or 2 for stderr
+ * @return false at end of file, or when the pipe is empty
+ *
+ */
+bool
+ring_pump(cmd_t *cmd, int fd)
+{
+    struct ring *ring;
+    struct ring_header *hdr;
+    uint64_t head;
+    uint64_t tail;
+    size_t pos;
+    size_t len;
+    ssize_t n;
+
+    if (cmd->ring_src[fd] < 0) {
+        return (false);
+    }
+    ring = (struct ring *)cmd->ring[fd];
+    hdr = ring->hdr;
+    head = hdr->head;
+    pos = head % ring->size;
+    len = ring->size - pos;
+    if (len > RING_CHUNK) {
+        len = RING_CHUNK;
+    }
+
+    // Say that [head, head + len) may be written over, before it is.
+    //
+    tail = hdr->tail;
+    if (head + len > tail + ring->size) {
+        __atomic_store_n(&hdr->tail, head + len - ring->size, __ATOMIC_RELEASE);
+        // ... and keep the new data from being seen before the new tail.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    do {
+        n = read(cmd->ring_src[fd], ring->data + pos, len);
+    } while (n == -1 && errno == EINTR);
+    if (n > 0) {
+        __atomic_store_n(&hdr->head, head + n, __ATOMIC_RELEASE);
+    }
+
+    // Less was written over than was given up.  Take it back.
+    //
+    if (n < (ssize_t)len) {
+        if (n > 0 && head + n > tail + ring->size) {
+            tail = head + n - ring->size;
+        }
+        __atomic_store_n(&hdr->tail, tail, __ATOMIC_RELEASE);
+    }
+    if (n <= 0) {
+        if (n == 0 || errno != EAGAIN) {
+            close(cmd->ring_src[fd]);
+            cmd->ring_src[fd] = -1;
+        }
+        return (false);
+    }
+    return (true);
+}
+
+/**
+ * @brief Drain what is left, and close the ring pipes.  After the child exits.
+ *
+ * @param cmd  IN  Command "object"
+ *
+ * The ring files stay mapped, for the next run, if there is one.
+ *
+ */
+void
+ring_finish(cmd_t *cmd)
+{
+    int fd;
+
+    for (fd = 1; fd <= 2; ++fd) {
+        if (cmd->ring_src[fd] >= 0 && cmd->child_fd[fd] >= 0) {
+            // There never was a child.
+            close(cmd->child_fd[fd]);
+            cmd->child_fd[fd] = -1;
+        }
+        while (ring_pump(cmd, fd)) {
+            continue;
+        }
+        if (cmd->ring_src[fd] >= 0) {
+            close(cmd->ring_src[fd]);
+            cmd->ring_src[fd] = -1;
+        }
+    }
+}
+
+/**
+ * @brief Write the contents of a ring file, oldest first.
+ *
+ * @param fname  IN  The ring file
+ * @param fd     IN  Where to write it
+ * @return errno-style status
+ *
+ * The ring can be in use.  What is there at the moment
+ * of the call is what is written, less anything that is
+ * written over while it is being copied.
+ *
+ */
+int
+ring_dump(const char *fname, int fd)
+{
+    struct ring_header *hdr;
+    struct stat st;
+    const char *data;
+    char *buf;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t tail2;
+    uint64_t size;
+    size_t pos;
+    size_t len;
+    size_t first;
+    void *map;
+    int rfd;
+    int rv;
+
+    rfd = open(fname, O_RDONLY|O_CLOEXEC);
+    if (rfd == -1 || fstat(rfd, &st) != 0) {
+        rv = errno;
+        eprintf("--ring-dump: open('%s') failed.\n", fname);
+        eexplain_err(rv);
+        if (rfd != -1) {
+            close(rfd);
+        }
+        return (rv);
+    }
+    map = MAP_FAILED;
+    if (st.st_size > RING_HDR_SZ) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, rfd, 0);
+    }
+    close(rfd);
+    if (map == MAP_FAILED) {
+        eprintf("--ring-dump: '%s' is not a ring file.\n", fname);
+        return (EINVAL);
+    }
+    hdr = (struct ring_header *)map;
+    size = hdr->size;
+    if (memcmp(hdr->magic, RING_MAGIC, 8) != 0
+        || size != (uint64_t)st.st_size - RING_HDR_SZ) {
+        eprintf("--ring-dump: '%s' is not a ring file.\n", fname);
+        munmap(map, st.st_size);
+        return (EINVAL);
+    }
+    data = (const char *)map + RING_HDR_SZ;
+
+    head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > size) {
+        tail = head - size;
+    }
+    len = head - tail;
+    buf = (char *)guard_mem(malloc(len ? len : 1));
+    pos = tail % size;
+    first = (len < size - pos) ? len : size - pos;
+    memcpy(buf, data + pos, first);
+    memcpy(buf + first, data, len - first);
+
+    // Anything written over while we copied does not count.
+    // The fence keeps the copy from being done after the reload of tail.
+    //
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    tail2 = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+    if (tail2 > tail) {
+        size_t lost = (tail2 - tail < len) ? tail2 - tail : len;
+        rv = write_all(fd, buf + lost, len - lost);
+    }
+    else {
+        rv = write_all(fd, buf, len);
+    }
+    free(buf);
+    munmap(map, st.st_size);
+    return (rv);
+}
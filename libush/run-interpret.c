@@ -21,6 +21,7 @@
  */
 
 #include <ush.h>
+#include <trace.h>
 #include <cscript.h>
 #include <cs-strv.h>
 #include <unistd.h>
@@ -130,6 +131,7 @@ fgetline(linebuf_t *lbuf)
     char *rbuf;
 
     dbg_printf("> %s\n", __FUNCTION__);
+    TRACE_NUM(fgetline__entry, TRACE_BEGIN, "fgetline", "encoding", script_encoding);
 
     // Free up any resources leftover from the last time
     // this line buffer was used.
@@ -159,6 +161,7 @@ fgetline(linebuf_t *lbuf)
     }
     dbg_printf("line: [%s]\n", rbuf);
     dbg_printf("len = %zu\n", strlen(rbuf));
+    TRACE_STR(fgetline__return, TRACE_END, "fgetline", "line", rbuf);
 }
 
 enum section {
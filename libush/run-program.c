@@ -20,20 +20,64 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE 1
+
 #include <ush.h>
+#include <trace.h>
 #include <cscript.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+extern void eexplain_err(int err);
+
+/*
+ * Something went wrong before there ever was a child to wait for.
+ * Make up a wait status that says so, so that the caller's
+ * WEXITSTATUS() is not zero.
+ */
+static int
+fail_status(int err)
+{
+    return (W_EXITCODE(err & 0xff, 0));
+}
 
 static int
 wait_cmd(cmd_t *cmd)
 {
     int status;
+    pid_t pid;
 
     status = 0;
     while (true) {
-        wait(&status);
+        // Use wait4(), rather than wait(), so that we collect
+        // the resource usage of this one child, and only this child.
+        //
+        pid = wait4(cmd->child, &status, 0, &cmd->child_rusage);
+        if (pid == -1) {
+            int err = errno;
+
+            if (err == EINTR) {
+                continue;
+            }
+            // Not a wait status.  Do not let ECHILD pass for a signal.
+            eprintf("wait4(%d) failed.\n", (int)cmd->child);
+            eexplain_err(err);
+            cmd->ioerr = err;
+            cmd->child_status = fail_status(err);
+            return (cmd->child_status);
+        }
         if (WIFEXITED(status) || WIFSIGNALED(status)) {
             cmd->child_status = status;
+            TRACE_NUM(reap, TRACE_INSTANT, "reap", "status", status);
             if (cmd->verbose) {
                 eprintf("status=0x%02x\n", cmd->child_status);
             }
@@ -43,57 +87,404 @@ wait_cmd(cmd_t *cmd)
     return (status);
 }
 
+/*
+ * Without a pidfd: has the child exited?  It is not reaped.
+ */
+static bool
+child_exited(cmd_t *cmd)
+{
+    siginfo_t si;
+
+    memset(&si, 0, sizeof (si));
+    if (waitid(P_PID, cmd->child, &si, WEXITED | WNOHANG | WNOWAIT) != 0) {
+        // Nothing to wait for.  Do not spin; let wait_cmd() sort it out.
+        return (true);
+    }
+    return (si.si_pid != 0);
+}
+
+/*
+ * Sleep on the child's pidfd until it exits, enforcing any time limit.
+ * The child is not reaped, here.  That is left to wait_cmd().
+ */
+static void
+wait_pidfd(cmd_t *cmd)
+{
+    unsigned long long deadline;
+    bool killed;
+
+    deadline = 0;
+    if (cmd->timeout_ns != 0) {
+        deadline = cmd->child_start_ns + cmd->timeout_ns;
+    }
+    killed = false;
+    while (true) {
+        struct pollfd pfd[7];
+        int ms;
+        int rv;
+
+        ms = -1;
+        if (deadline != 0) {
+            unsigned long long now = mono_ns();
+            unsigned long long left;
+
+            left = (now >= deadline) ? 0 : (deadline - now + 999999) / 1000000;
+            ms = (left > INT_MAX) ? INT_MAX : (int)left;
+        }
+        pfd[0].fd = cmd->child_pidfd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = cmd->ready_rfd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+        pfd[2].fd = cmd->tee_src[1];
+        pfd[2].events = POLLIN;
+        pfd[2].revents = 0;
+        pfd[3].fd = cmd->tee_src[2];
+        pfd[3].events = POLLIN;
+        pfd[3].revents = 0;
+        pfd[4].fd = cmd->ring_src[1];
+        pfd[4].events = POLLIN;
+        pfd[4].revents = 0;
+        pfd[5].fd = cmd->ring_src[2];
+        pfd[5].events = POLLIN;
+        pfd[5].revents = 0;
+        pfd[6].fd = cmd->sample_tfd;
+        pfd[6].events = POLLIN;
+        pfd[6].revents = 0;
+        if (cmd->child_pidfd < 0 && pfd[2].fd < 0 && pfd[3].fd < 0
+            && pfd[4].fd < 0 && pfd[5].fd < 0
+            && (cmd->sample_tfd < 0 || child_exited(cmd))) {
+            // No pidfd, and nothing left to pump.  wait_cmd() will block.
+            // With --sample, the timer wakes us up, to look again.
+            break;
+        }
+        rv = poll(pfd, 7, ms);
+        if (rv == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pfd[1].revents != 0) {
+            if (!ready_check(cmd)) {
+                close(cmd->ready_rfd);
+                cmd->ready_rfd = -1;
+            }
+        }
+        if (pfd[2].revents != 0) {
+            tee_pump(cmd, 1);
+        }
+        if (pfd[3].revents != 0) {
+            tee_pump(cmd, 2);
+        }
+        if (pfd[4].revents != 0) {
+            ring_pump(cmd, 1);
+        }
+        if (pfd[5].revents != 0) {
+            ring_pump(cmd, 2);
+        }
+        if (pfd[6].revents != 0) {
+            sample_take(cmd);
+        }
+        if (pfd[0].revents != 0) {
+            break;
+        }
+        if (rv > 0) {
+            continue;
+        }
+
+        // Time is up.
+        //
+        if (!cmd->timed_out) {
+            cmd->timed_out = true;
+            timeout_kill(cmd, cmd->timeout_signal ? cmd->timeout_signal : SIGTERM);
+            deadline = 0;
+            if (cmd->kill_after_ns != 0) {
+                deadline = mono_ns() + cmd->kill_after_ns;
+            }
+        }
+        else if (!killed) {
+            timeout_kill(cmd, SIGKILL);
+            killed = true;
+            deadline = 0;
+        }
+    }
+}
+
+/*
+ * After fork(), in the child, before exec().
+ */
+static void
+setup_child(cmd_t *cmd)
+{
+    int fd;
+
+    timeout_child_setup(cmd);
+    ready_child_setup(cmd);
+    io_memfd_child_setup(cmd);
+    if (cmd->child_fd_plan) {
+        for (fd = 0; fd < 3; ++fd) {
+            if (cmd->child_fd[fd] == fd) {
+                fcntl(fd, F_SETFD, 0);
+            }
+            else if (cmd->child_fd[fd] >= 0) {
+                dup2(cmd->child_fd[fd], fd);
+            }
+        }
+    }
+    if (cpus_apply(cmd) != 0 || mempolicy_apply(cmd) != 0
+        || sched_apply(cmd) != 0 || rlimit_apply(cmd) != 0) {
+        fflush(errprint_fh);
+        _exit(126);
+    }
+    perf_child_setup(cmd);
+}
+
 int
 exec_program(cmd_t *cmd)
 {
     int rv;
 
+    if (!cmd->cmd_fork) {
+        metrics_exec(cmd);
+    }
+    if (trace_fd >= 0) {
+        trace_process_name(cmd->cmd_name);
+    }
+    TRACE_STR(exec, TRACE_INSTANT, "exec", "path", cmd->cmd_path);
     cmd->rc = execvp(cmd->cmd_path, cmd->argv);
     if (cmd->rc != 0) {
-        perror("execvp()");
         rv = errno;
+        perror("execvp()");
+        flight_user_fail("execvp", rv, cmd->verbose);
     }
     else {
         eprintf("execvp() failed for reasons unknown!\n");
         rv = 126;
     }
+    if (!cmd->cmd_fork) {
+        metrics_exec_failed(cmd);
+    }
     if (cmd->cmd_fork) {
         exit(rv);
     }
     return (rv);
 }
 
+/**
+ * @brief Start the child.  Do not wait for it.
+ *
+ * @param cmd  IN  Command "object"
+ * @return 0, or a made-up wait status, if there is no child
+ *
+ * Everything that has to be done before fork(), and in the parent
+ * right after fork(), is done here.  Every successful call must be
+ * followed by wait_child_program().
+ *
+ */
 int
-run_child_program(cmd_t *cmd)
+start_child_program(cmd_t *cmd)
 {
     int rv;
 
-    cmd->child = fork();
-    if (cmd->child == 0) {
-        rv = exec_program(cmd);
+    cmd->child = -1;
+    cmd->child_pidfd = -1;
+    if (cmd->cgroup_parent != NULL) {
+        rv = cgroup_create(cmd);
+        if (rv != 0) {
+            return (fail_status(rv));
+        }
+    }
+
+    rv = ready_prepare(cmd);
+    if (rv == 0) {
+        rv = tee_prepare(cmd);
+        if (rv == 0) {
+            rv = compress_prepare(cmd);
+            if (rv == 0) {
+                rv = ring_prepare(cmd);
+                if (rv == 0) {
+                    rv = perf_prepare(cmd);
+                    if (rv != 0) {
+                        ring_finish(cmd);
+                    }
+                }
+                if (rv != 0) {
+                    compress_finish(cmd);
+                }
+            }
+            if (rv != 0) {
+                tee_finish(cmd);
+            }
+        }
+        if (rv != 0) {
+            ready_teardown(cmd);
+        }
+    }
+    if (rv != 0) {
+        if (cmd->cgroup_parent != NULL) {
+            cgroup_destroy(cmd);
+        }
+        return (fail_status(rv));
+    }
+
+    timeout_prepare(cmd);
+    cmd->child_start_ns = mono_ns();
+    if (cmd->cgroup_parent != NULL) {
+        cmd->child = cgroup_fork(cmd);
     }
     else {
-        if (cmd->verbose) {
-            eprintf("child pid=%d\n", cmd->child);
+        cmd->child = fork();
+    }
+    if (cmd->child == 0) {
+        setup_child(cmd);
+        exec_program(cmd);
+    }
+    if (cmd->child == -1) {
+        rv = errno;
+        perror("fork()");
+        flight_event(TRACE_FAIL, "fork", 0, NULL, rv);
+        timeout_teardown(cmd);
+        ready_teardown(cmd);
+        tee_finish(cmd);
+        compress_finish(cmd);
+        ring_finish(cmd);
+        perf_teardown(cmd);
+        if (cmd->cgroup_parent != NULL) {
+            cgroup_destroy(cmd);
         }
-        rv = wait_cmd(cmd);
+        return (fail_status(rv));
     }
 
+    perf_parent_setup(cmd);
+    TRACE_NUM(fork, TRACE_INSTANT, "fork", "pid", cmd->child);
+    if (cmd->verbose) {
+        eprintf("child pid=%d\n", cmd->child);
+    }
+    timeout_parent_setup(cmd);
+    ready_parent_setup(cmd);
+    tee_parent_setup(cmd);
+    compress_parent_setup(cmd);
+    ring_parent_setup(cmd);
+    supervise_parent_setup(cmd);
+    sample_parent_setup(cmd);
+    cmd->child_pidfd = (int)syscall(SYS_pidfd_open, cmd->child, 0);
+    if (cmd->child_pidfd < 0 && (cmd->timeout_ns != 0 || cmd->ready_fd != 0)) {
+        eprintf("pidfd_open() failed; --timeout and --ready-fd are not enforced.\n");
+    }
+    return (0);
+}
+
+/**
+ * @brief Wait for the child that was started by start_child_program().
+ *
+ * @param cmd  IN  Command "object"
+ * @return the wait status of the child, 124 if it was timed out,
+ *         or a made-up failure status if its compressed output was lost,
+ *         or if it could not be waited for (the errno is in cmd->ioerr)
+ *
+ */
+int
+wait_child_program(cmd_t *cmd)
+{
+    int cerr;
+    int rv;
+
+    wait_pidfd(cmd);
+    tee_finish(cmd);
+    cerr = compress_finish(cmd);
+    ring_finish(cmd);
+    rv = wait_cmd(cmd);
+    cmd->child_end_ns = mono_ns();
+    perf_collect(cmd);
+    sample_finish(cmd);
+    if (trace_fd >= 0) {
+        trace_span(cmd->cmd_name, cmd->child, cmd->child_start_ns, cmd->child_end_ns);
+    }
+    if (cmd->child_pidfd >= 0) {
+        close(cmd->child_pidfd);
+        cmd->child_pidfd = -1;
+    }
+    timeout_teardown(cmd);
+    ready_teardown(cmd);
+    if (cmd->timed_out) {
+        rv = W_EXITCODE(124, 0);
+    }
+    else if (cerr != 0
+             && (rv == 0 || (WIFSIGNALED(rv) && WTERMSIG(rv) == SIGPIPE))) {
+        // The program did its part, but its output was lost;
+        // for example, the disk filled up (ENOSPC).
+        rv = fail_status(cerr);
+    }
+
+    if (cmd->cgroup_parent != NULL) {
+        cgroup_destroy(cmd);
+    }
+    if (cmd->report) {
+        fshow_exit_report(stderr, cmd);
+    }
+    metrics_record(cmd, rv);
+    history_record(cmd);
+
     cmd->rc = rv;
     return (rv);
 }
 
+int
+run_child_program(cmd_t *cmd)
+{
+    int rv;
+
+    rv = start_child_program(cmd);
+    if (rv != 0) {
+        flight_fail("could not start the program", WEXITSTATUS(rv));
+        metrics_record(cmd, rv);
+        cmd->rc = rv;
+        return (rv);
+    }
+    return (wait_child_program(cmd));
+}
+
 int
 run_program(cmd_t * cmd)
 {
     int rv;
 
-    if (cmd->cmd_fork) {
+    readahead_exec(cmd);
+    rv = limit_acquire(cmd);
+    if (rv != 0) {
+        return (fail_status(rv));
+    }
+
+    if (cmd->supervise) {
+        rv = run_supervise(cmd);
+    }
+    else if (cmd->repeat != 0) {
+        rv = run_repeat(cmd);
+    }
+    else if (cmd->cmd_fork) {
         rv = run_child_program(cmd);
     }
     else {
+        readahead_wait();
+        rv = cpus_apply(cmd);
+        if (rv == 0) {
+            rv = mempolicy_apply(cmd);
+        }
+        if (rv == 0) {
+            rv = sched_apply(cmd);
+        }
+        if (rv == 0) {
+            rv = rlimit_apply(cmd);
+        }
+        if (rv != 0) {
+            limit_release(cmd);
+            return (fail_status(rv));
+        }
         rv = exec_program(cmd);
         dbg_printf("run_program: rv=%d\n", rv);
     }
+    limit_release(cmd);
     return (rv);
 }
@@ -0,0 +1,458 @@
+/*
+ * Filename: run-repeat.c
+ * Library: libush
+ * Brief: Run the prepared command repeatedly, and report timing statistics
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var EDOM
+    // Import var EINVAL
+#include <math.h>
+    // Import sqrt()
+#include <stdlib.h>
+    // Import qsort()
+    // Import strtoul()
+#include <string.h>
+    // Import memset()
+    // Import strcmp()
+#include <sys/resource.h>
+    // Import type struct rusage
+#include <sys/wait.h>
+    // Import wait4()
+#include <time.h>
+    // Import clock_gettime()
+
+struct stat_summary {
+    double min;
+    double q1;
+    double median;
+    double q3;
+    double p95;
+    double max;
+    double mean;
+    double stddev;
+};
+
+typedef struct stat_summary stat_summary_t;
+
+extern void eexplain_err(int err);
+
+static int
+parse_count(const char *optname, const char *arg, unsigned int *ret)
+{
+    unsigned long int n;
+
+    if (!isnumeric(arg)) {
+        eprintf("--%s: %s argument must be numeric.\n", optname, arg);
+        return (EDOM);
+    }
+    n = strtoul(arg, NULL, 10);
+    if (n > 1000000) {
+        eprintf("--%s: %s is too many.\n", optname, arg);
+        return (ERANGE);
+    }
+    *ret = (unsigned int)n;
+    return (0);
+}
+
+/**
+ * @brief Command-line option to run the prepared command N times.
+ *
+ * @param cmd   IN  Command "object" that hold context/control information
+ * @param count IN  The number of measured runs
+ * @return errno-style status
+ *
+ * --repeat implies --fork.  There is no way to run a program
+ * more than once, if ush itself is overwritten by exec().
+ *
+ */
+int
+cmd_repeat(cmd_t *cmd, const char *count)
+{
+    int rv;
+
+    rv = parse_count("repeat", count, &cmd->repeat);
+    if (rv == 0 && cmd->repeat == 0) {
+        eprintf("--repeat: must run at least once.\n");
+        rv = ERANGE;
+    }
+    if (rv != 0) {
+        cmd->ioerr = rv;
+        return (rv);
+    }
+    cmd->cmd_fork = true;
+    return (0);
+}
+
+int
+cmd_warmup(cmd_t *cmd, const char *count)
+{
+    int rv;
+
+    rv = parse_count("warmup", count, &cmd->warmup);
+    if (rv != 0) {
+        cmd->ioerr = rv;
+    }
+    return (rv);
+}
+
+int
+cmd_repeat_format(cmd_t *cmd, const char *fmt)
+{
+    if (strcmp(fmt, "text") == 0) {
+        cmd->repeat_json = false;
+        return (0);
+    }
+    if (strcmp(fmt, "json") == 0) {
+        cmd->repeat_json = true;
+        return (0);
+    }
+    eprintf("--repeat-format: '%s' must be one of { text | json }.\n", fmt);
+    cmd->ioerr = EINVAL;
+    return (EINVAL);
+}
+
+static double
+tv_seconds(const struct timeval *tv)
+{
+    return ((double)tv->tv_sec + (double)tv->tv_usec / 1e6);
+}
+
+static double
+ts_seconds(const struct timespec *ts)
+{
+    return ((double)ts->tv_sec + (double)ts->tv_nsec / 1e9);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+
+    return ((da > db) - (da < db));
+}
+
+/*
+ * Linear interpolation between closest ranks, over already sorted data.
+ */
+static double
+quantile(const double *sorted, size_t n, double q)
+{
+    double pos;
+    size_t lo;
+    double frac;
+
+    if (n == 1) {
+        return (sorted[0]);
+    }
+    pos = q * (double)(n - 1);
+    lo = (size_t)pos;
+    if (lo >= n - 1) {
+        return (sorted[n - 1]);
+    }
+    frac = pos - (double)lo;
+    return (sorted[lo] + frac * (sorted[lo + 1] - sorted[lo]));
+}
+
+/*
+ * Summarize |n| samples.  The samples are sorted in place.
+ */
+static void
+stat_summarize(stat_summary_t *st, double *v, size_t n)
+{
+    double sum;
+    double ssq;
+    size_t i;
+
+    qsort(v, n, sizeof (double), cmp_double);
+    sum = 0.0;
+    for (i = 0; i < n; ++i) {
+        sum += v[i];
+    }
+    st->mean = sum / (double)n;
+    ssq = 0.0;
+    for (i = 0; i < n; ++i) {
+        double d = v[i] - st->mean;
+        ssq += d * d;
+    }
+    st->stddev = (n > 1) ? sqrt(ssq / (double)(n - 1)) : 0.0;
+    st->min    = v[0];
+    st->max    = v[n - 1];
+    st->q1     = quantile(v, n, 0.25);
+    st->median = quantile(v, n, 0.50);
+    st->q3     = quantile(v, n, 0.75);
+    st->p95    = quantile(v, n, 0.95);
+}
+
+/*
+ * Count outliers, using Tukey's fences.
+ * Mild outliers lie beyond 1.5 * IQR, severe outliers beyond 3 * IQR.
+ * Mild does not include severe.
+ */
+static void
+count_outliers(const stat_summary_t *st, const double *v, size_t n,
+    size_t *mild, size_t *severe)
+{
+    double iqr;
+    size_t i;
+
+    iqr = st->q3 - st->q1;
+    *mild = 0;
+    *severe = 0;
+    for (i = 0; i < n; ++i) {
+        if (v[i] < st->q1 - 3.0 * iqr || v[i] > st->q3 + 3.0 * iqr) {
+            ++*severe;
+        }
+        else if (v[i] < st->q1 - 1.5 * iqr || v[i] > st->q3 + 1.5 * iqr) {
+            ++*mild;
+        }
+    }
+}
+
+static void
+fshow_stat_text(FILE *f, const char *name, const stat_summary_t *st)
+{
+    fprintf(f, "  %-6s min %.6f  median %.6f  p95 %.6f"
+        "  mean %.6f  stddev %.6f  max %.6f\n",
+        name, st->min, st->median, st->p95, st->mean, st->stddev, st->max);
+}
+
+static void
+fshow_stat_json(FILE *f, const char *name, const stat_summary_t *st)
+{
+    fprintf(f, "  \"%s\": { \"min\": %.9f, \"median\": %.9f,"
+        " \"p95\": %.9f, \"mean\": %.9f, \"stddev\": %.9f, \"max\": %.9f },\n",
+        name, st->min, st->median, st->p95, st->mean, st->stddev, st->max);
+}
+
+static void
+fshow_json_str(FILE *f, const char *str)
+{
+    const unsigned char *s;
+
+    fputc('"', f);
+    for (s = (const unsigned char *)str; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        }
+        else if (*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        }
+        else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+/*
+ * Run the --repeat-hook program, with no arguments, and wait for it.
+ */
+static int
+run_hook(cmd_t *cmd)
+{
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    if (pid == -1) {
+        int err = errno;
+        eprintf("fork() for --repeat-hook failed.\n");
+        eexplain_err(err);
+        return (err);
+    }
+    if (pid == 0) {
+        execlp(cmd->repeat_hook, cmd->repeat_hook, (char *)NULL);
+        perror("execlp()");
+        _exit(126);
+    }
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return (errno);
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        eprintf("--repeat-hook '");
+        fshow_fname(errprint_fh, cmd->repeat_hook);
+        eprintf("' failed; status=0x%02x\n", status);
+        return (ECHILD);
+    }
+    return (0);
+}
+
+/*
+ * The fd that the child gets as its stdin.
+ */
+static int
+repeat_stdin(cmd_t *cmd)
+{
+    if (cmd->child_fd_plan && cmd->child_fd[0] >= 0) {
+        return (cmd->child_fd[0]);
+    }
+    return (0);
+}
+
+int
+run_repeat(cmd_t *cmd)
+{
+    double *wall;
+    double *user;
+    double *sys;
+    long maxrss;
+    unsigned int nfail;
+    unsigned int runs;
+    unsigned int i;
+    stat_summary_t st_wall;
+    stat_summary_t st_user;
+    stat_summary_t st_sys;
+    size_t mild, severe;
+    size_t n;
+    FILE *f;
+    int in_fd;
+    off_t in_off;
+    int status;
+    int rv;
+
+    // Every run must read the same stdin, not whatever the runs
+    // before it left behind.  A file is put back where it was,
+    // before each run.  A pipe cannot be put back.
+    //
+    in_fd = repeat_stdin(cmd);
+    in_off = lseek(in_fd, 0, SEEK_CUR);
+    if (in_off == -1 && errno == ESPIPE && !isatty(in_fd)) {
+        eprintf("--repeat: stdin is a pipe or socket,"
+            " so every run after the first would read only end-of-file.\n");
+        eprintf("--repeat: Use --stdin=<file>, or </dev/null.\n");
+        return (W_EXITCODE(ESPIPE, 0));
+    }
+
+    runs = cmd->repeat;
+    wall = (double *)guard_calloc(runs, sizeof (double));
+    user = (double *)guard_calloc(runs, sizeof (double));
+    sys  = (double *)guard_calloc(runs, sizeof (double));
+    maxrss = 0;
+    nfail = 0;
+    n = 0;
+    status = 0;
+
+    for (i = 0; i < cmd->warmup + runs; ++i) {
+        struct timespec t0, t1;
+        unsigned int j;
+
+        if (cmd->repeat_hook != NULL) {
+            rv = run_hook(cmd);
+            if (rv != 0) {
+                free(wall);
+                free(user);
+                free(sys);
+                // A wait status, as from run_child_program(), not an errno
+                return (W_EXITCODE(rv & 0xff, 0));
+            }
+        }
+
+        if (in_off != -1) {
+            lseek(in_fd, in_off, SEEK_SET);
+        }
+        memset(&cmd->child_rusage, 0, sizeof (cmd->child_rusage));
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        rv = run_child_program(cmd);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        if (i < cmd->warmup) {
+            continue;
+        }
+        if (!WIFEXITED(rv) || WEXITSTATUS(rv) != 0) {
+            ++nfail;
+            status = rv;
+        }
+        else if (nfail == 0) {
+            status = rv;
+        }
+
+        // With no child, there is nothing to measure.
+        //
+        if (cmd->child <= 0) {
+            continue;
+        }
+        j = n++;
+        wall[j] = ts_seconds(&t1) - ts_seconds(&t0);
+        user[j] = tv_seconds(&cmd->child_rusage.ru_utime);
+        sys[j]  = tv_seconds(&cmd->child_rusage.ru_stime);
+        if (cmd->child_rusage.ru_maxrss > maxrss) {
+            maxrss = cmd->child_rusage.ru_maxrss;
+        }
+    }
+
+    if (n == 0) {
+        eprintf("%s: none of %u runs could be started.\n", cmd->cmd_name, runs);
+        free(wall);
+        free(user);
+        free(sys);
+        cmd->child_status = status;
+        return (status);
+    }
+    stat_summarize(&st_wall, wall, n);
+    stat_summarize(&st_user, user, n);
+    stat_summarize(&st_sys,  sys,  n);
+    count_outliers(&st_wall, wall, n, &mild, &severe);
+
+    // Not |errprint_fh|, which might be stdout,
+    // and stdout might have been redirected for the command.
+    //
+    f = stderr;
+    if (cmd->repeat_json) {
+        fprintf(f, "{\n  \"command\": ");
+        fshow_json_str(f, cmd->cmd_path);
+        fprintf(f, ",\n  \"runs\": %zu,\n  \"warmup\": %u,\n",
+            n, cmd->warmup);
+        fshow_stat_json(f, "wall", &st_wall);
+        fshow_stat_json(f, "user", &st_user);
+        fshow_stat_json(f, "sys",  &st_sys);
+        fprintf(f, "  \"maxrss_kb\": %ld,\n", maxrss);
+        fprintf(f, "  \"outliers\": { \"mild\": %zu, \"severe\": %zu },\n",
+            mild, severe);
+        fprintf(f, "  \"failures\": %u\n}\n", nfail);
+    }
+    else {
+        fprintf(f, "%s: %zu runs, %u warmup\n",
+            cmd->cmd_name, n, cmd->warmup);
+        fshow_stat_text(f, "wall", &st_wall);
+        fshow_stat_text(f, "user", &st_user);
+        fshow_stat_text(f, "sys",  &st_sys);
+        fprintf(f, "  maxrss %ld KiB\n", maxrss);
+        if (mild + severe != 0) {
+            fprintf(f, "  outliers: %zu mild, %zu severe, of %zu runs\n",
+                mild, severe, n);
+        }
+        if (nfail != 0) {
+            fprintf(f, "  failures: %u\n", nfail);
+        }
+    }
+    fflush(f);
+
+    free(wall);
+    free(user);
+    free(sys);
+    cmd->child_status = status;
+    return (status);
+}
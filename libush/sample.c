@@ -0,0 +1,417 @@
+/*
+ * Filename: sample.c
+ * Library: libush
+ * Brief: --sample: the child's CPU, memory and I/O over time, from /proc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <dirent.h>
+    // Import opendir()
+    // Import readdir()
+    // Import closedir()
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import open()
+#include <stdint.h>
+    // Import uint64_t
+#include <stdio.h>
+    // Import snprintf()
+#include <stdlib.h>
+    // Import free()
+    // Import strtoull()
+    // Import strtoul()
+#include <string.h>
+    // Import memset()
+    // Import strchr()
+    // Import strdup()
+    // Import strlen()
+    // Import strncmp()
+    // Import strrchr()
+#include <sys/timerfd.h>
+    // Import timerfd_create()
+    // Import timerfd_settime()
+
+extern void *guard_mem(void *obj);
+extern void eexplain_err(int err);
+
+#define SAMPLE_MAX_PROCS 4096
+
+enum { PROC_STAT, PROC_STATUS, PROC_IO };
+
+static const char *proc_files[3] = { "stat", "status", "io" };
+
+struct sample {
+    unsigned int procs;
+    unsigned long long threads;
+    unsigned long long utime;       // Clock ticks
+    unsigned long long stime;
+    unsigned long long rss_kib;
+    unsigned long long swap_kib;
+    unsigned long long rchar;
+    unsigned long long wchar;
+    unsigned long long read_bytes;
+    unsigned long long write_bytes;
+};
+
+static const char sample_header[] =
+    "time_s,pid,procs,threads,utime_s,stime_s,rss_kib,swap_kib,"
+    "rchar,wchar,read_bytes,write_bytes\n";
+
+/**
+ * @brief Command-line option to sample the child's resource usage
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  <interval>:<file>
+ * @return errno-style status
+ *
+ * The file is created now, and gets its CSV header line.
+ * Implies --fork.
+ *
+ */
+int
+cmd_sample(cmd_t *cmd, const char *arg)
+{
+    unsigned long long ns;
+    char *interval;
+    char *colon;
+    const char *fname;
+    int fd;
+    int rv;
+
+    interval = (char *)guard_mem(strdup(arg));
+    colon = strchr(interval, ':');
+    if (colon == NULL || colon[1] == '\0') {
+        eprintf("--sample: expected <interval>:<file>, not '%s'.\n", arg);
+        free(interval);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    *colon = '\0';
+    fname = arg + (colon + 1 - interval);
+    rv = parse_duration(interval, &ns);
+    free(interval);
+    if (rv != 0 || ns < 1000000) {
+        eprintf("--sample: the interval must be at least 1ms, not '%s'.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+
+    fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0666);
+    if (fd == -1) {
+        rv = errno;
+        eprintf("--sample: open('%s') failed.\n", fname);
+        eexplain_err(rv);
+        cmd->ioerr = rv;
+        return (rv);
+    }
+    if (write(fd, sample_header, sizeof (sample_header) - 1) < 0) {
+        rv = errno;
+        eprintf("--sample: write('%s') failed.\n", fname);
+        eexplain_err(rv);
+        close(fd);
+        cmd->ioerr = rv;
+        return (rv);
+    }
+    if (cmd->sample_ns != 0) {
+        close(cmd->sample_fd);
+    }
+    cmd->sample_fd = fd;
+    cmd->sample_ns = ns;
+    cmd->cmd_fork = true;
+    return (0);
+}
+
+/**
+ * @brief Command-line option to include descendants in --sample
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @return errno-style status
+ *
+ */
+int
+cmd_sample_descendants(cmd_t *cmd)
+{
+    cmd->sample_tree = true;
+    return (0);
+}
+
+static int
+open_proc(pid_t pid, const char *file)
+{
+    char path[64];
+
+    snprintf(path, sizeof (path), "/proc/%d/%s", (int)pid, file);
+    return (open(path, O_RDONLY|O_CLOEXEC));
+}
+
+/**
+ * @brief Start the timer, and open the child's /proc files.  After fork().
+ *
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+sample_parent_setup(cmd_t *cmd)
+{
+    struct itimerspec its;
+    int i;
+
+    cmd->sample_tfd = -1;
+    for (i = 0; i < 3; ++i) {
+        cmd->sample_proc[i] = -1;
+    }
+    if (cmd->sample_ns == 0) {
+        return;
+    }
+
+    cmd->sample_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
+    if (cmd->sample_tfd == -1) {
+        eprintf("--sample: timerfd_create() failed.\n");
+        eexplain_err(errno);
+        return;
+    }
+    memset(&its, 0, sizeof (its));
+    its.it_interval.tv_sec = cmd->sample_ns / 1000000000ULL;
+    its.it_interval.tv_nsec = cmd->sample_ns % 1000000000ULL;
+    its.it_value = its.it_interval;
+    timerfd_settime(cmd->sample_tfd, 0, &its, NULL);
+
+    for (i = 0; i < 3; ++i) {
+        cmd->sample_proc[i] = open_proc(cmd->child, proc_files[i]);
+    }
+}
+
+/*
+ * Read a /proc file, from the start.  Return the length, or 0.
+ */
+static size_t
+read_proc(int fd, char *buf, size_t sz)
+{
+    ssize_t n;
+
+    if (fd < 0) {
+        return (0);
+    }
+    n = pread(fd, buf, sz - 1, 0);
+    if (n <= 0) {
+        return (0);
+    }
+    buf[n] = '\0';
+    return ((size_t)n);
+}
+
+/*
+ * The value of "<key>: <n>" or "<key>:\t<n> kB", in a status or io file.
+ */
+static unsigned long long
+proc_field(const char *buf, const char *key)
+{
+    const char *s;
+    size_t len;
+
+    len = strlen(key);
+    for (s = buf; s != NULL && *s != '\0'; s = strchr(s, '\n'), s = s ? s + 1 : NULL) {
+        if (strncmp(s, key, len) == 0 && s[len] == ':') {
+            return (strtoull(s + len + 1, NULL, 10));
+        }
+    }
+    return (0);
+}
+
+/*
+ * Add one process to |smp|.  The fds are of its stat, status and io files.
+ */
+static void
+sample_one(struct sample *smp, const int fd[3])
+{
+    char buf[4096];
+    char *s;
+    unsigned int field;
+
+    if (read_proc(fd[PROC_STAT], buf, sizeof (buf)) == 0) {
+        return;
+    }
+    // The command name, in (), can hold anything.  Skip past it.
+    s = strrchr(buf, ')');
+    if (s == NULL) {
+        return;
+    }
+    ++smp->procs;
+
+    // Field 3 is the state, just after the name.
+    for (field = 3, s += 2; *s != '\0' && field < 24; ++field) {
+        switch (field) {
+        case 14:
+            smp->utime += strtoull(s, NULL, 10);
+            break;
+        case 15:
+            smp->stime += strtoull(s, NULL, 10);
+            break;
+        case 20:
+            smp->threads += strtoull(s, NULL, 10);
+            break;
+        }
+        s = strchr(s, ' ');
+        if (s == NULL) {
+            return;
+        }
+        ++s;
+    }
+    if (field == 24) {
+        smp->rss_kib += strtoull(s, NULL, 10) * (sysconf(_SC_PAGESIZE) / 1024);
+    }
+
+    if (read_proc(fd[PROC_STATUS], buf, sizeof (buf)) != 0) {
+        smp->swap_kib += proc_field(buf, "VmSwap");
+    }
+    if (read_proc(fd[PROC_IO], buf, sizeof (buf)) != 0) {
+        smp->rchar += proc_field(buf, "rchar");
+        smp->wchar += proc_field(buf, "wchar");
+        smp->read_bytes += proc_field(buf, "read_bytes");
+        smp->write_bytes += proc_field(buf, "write_bytes");
+    }
+}
+
+/*
+ * Add the descendants of |pid| to |smp|.
+ */
+static void
+sample_tree(struct sample *smp, pid_t pid, unsigned int depth)
+{
+    char path[320];
+    char buf[4096];
+    struct dirent *de;
+    DIR *dir;
+    char *s;
+    char *end;
+    pid_t kid;
+    int cfd;
+    int fd[3];
+    int i;
+
+    if (depth > 64) {
+        return;
+    }
+    snprintf(path, sizeof (path), "/proc/%d/task", (int)pid);
+    dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, sizeof (path), "/proc/%d/task/%s/children", (int)pid, de->d_name);
+        cfd = open(path, O_RDONLY|O_CLOEXEC);
+        if (cfd < 0) {
+            continue;
+        }
+        if (read_proc(cfd, buf, sizeof (buf)) == 0) {
+            close(cfd);
+            continue;
+        }
+        close(cfd);
+        for (s = buf; smp->procs < SAMPLE_MAX_PROCS; s = end) {
+            kid = (pid_t)strtoul(s, &end, 10);
+            if (end == s) {
+                break;
+            }
+            for (i = 0; i < 3; ++i) {
+                fd[i] = open_proc(kid, proc_files[i]);
+            }
+            sample_one(smp, fd);
+            for (i = 0; i < 3; ++i) {
+                if (fd[i] >= 0) {
+                    close(fd[i]);
+                }
+            }
+            sample_tree(smp, kid, depth + 1);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief The timer went off.  Take a sample, and write it out.
+ *
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+sample_take(cmd_t *cmd)
+{
+    struct sample smp;
+    unsigned long long now;
+    unsigned long long t;
+    uint64_t expired;
+    char line[512];
+    double tick;
+    int len;
+
+    if (read(cmd->sample_tfd, &expired, sizeof (expired)) < 0) {
+        return;
+    }
+    memset(&smp, 0, sizeof (smp));
+    sample_one(&smp, cmd->sample_proc);
+    if (smp.procs == 0) {
+        return;
+    }
+    if (cmd->sample_tree) {
+        sample_tree(&smp, cmd->child, 0);
+    }
+
+    now = mono_ns();
+    t = (now > cmd->child_start_ns) ? now - cmd->child_start_ns : 0;
+    tick = (double)sysconf(_SC_CLK_TCK);
+    len = snprintf(line, sizeof (line),
+        "%llu.%03llu,%d,%u,%llu,%.2f,%.2f,%llu,%llu,%llu,%llu,%llu,%llu\n",
+        t / 1000000000ULL, (t / 1000000) % 1000, (int)cmd->child,
+        smp.procs, smp.threads, smp.utime / tick, smp.stime / tick,
+        smp.rss_kib, smp.swap_kib,
+        smp.rchar, smp.wchar, smp.read_bytes, smp.write_bytes);
+    if (write(cmd->sample_fd, line, len) < 0) {
+        // Keep going; the child matters more than its samples.
+    }
+}
+
+/**
+ * @brief Stop the timer, and close the child's /proc files.
+ *
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+sample_finish(cmd_t *cmd)
+{
+    int i;
+
+    if (cmd->sample_tfd >= 0) {
+        close(cmd->sample_tfd);
+        cmd->sample_tfd = -1;
+    }
+    for (i = 0; i < 3; ++i) {
+        if (cmd->sample_proc[i] >= 0) {
+            close(cmd->sample_proc[i]);
+            cmd->sample_proc[i] = -1;
+        }
+    }
+}
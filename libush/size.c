@@ -0,0 +1,81 @@
+/*
+ * Filename: size.c
+ * Library: libush
+ * Brief: Parse a size in bytes, like "4096", "64K", "16M", "2G"
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ush.h>
+#include <cscript.h>
+
+#include <errno.h>
+    // Import var errno
+    // Import var EINVAL
+    // Import var ERANGE
+#include <stdlib.h>
+    // Import strtoull()
+
+/**
+ * @brief Parse a size in bytes
+ *
+ * @param str  IN   A whole number, with an optional suffix of K, M, G or T
+ * @param ret  OUT  The size in bytes
+ * @return errno-style status
+ *
+ * The suffixes are powers of 1024.
+ *
+ */
+int
+parse_size(const char *str, unsigned long long *ret)
+{
+    unsigned long long n;
+    unsigned int shift;
+    char *sfx;
+
+    if (!(*str >= '0' && *str <= '9')) {
+        return (EINVAL);
+    }
+    errno = 0;
+    n = strtoull(str, &sfx, 10);
+    if (errno != 0) {
+        return (errno);
+    }
+    shift = 0;
+    switch (*sfx) {
+    case 'K': case 'k':
+        shift = 10;
+        break;
+    case 'M': case 'm':
+        shift = 20;
+        break;
+    case 'G': case 'g':
+        shift = 30;
+        break;
+    case 'T': case 't':
+        shift = 40;
+        break;
+    }
+    if (shift != 0) {
+        ++sfx;
+    }
+    if (*sfx != '\0') {
+        return (EINVAL);
+    }
+    if (n > (~0ULL >> shift)) {
+        return (ERANGE);
+    }
+    *ret = n << shift;
+    return (0);
+}
@@ -0,0 +1,753 @@
+/*
+ * Filename: spawn-helper.c
+ * Library: libush
+ * Brief: Start programs from a small helper process, not from the caller
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import fcntl()
+    // Import open()
+#include <limits.h>
+    // Import PATH_MAX
+#include <poll.h>
+    // Import poll()
+#include <signal.h>
+    // Import sigprocmask()
+    // Import signal()
+#include <stdint.h>
+    // Import uint32_t
+#include <stdio.h>
+    // Import fflush()
+#include <stdlib.h>
+    // Import free()
+    // Import malloc()
+    // Import realloc()
+#include <string.h>
+    // Import memchr()
+    // Import memcpy()
+    // Import strlen()
+#include <sys/prctl.h>
+    // Import prctl()
+#include <sys/signalfd.h>
+    // Import signalfd()
+#include <sys/socket.h>
+    // Import recvmsg()
+    // Import sendmsg()
+    // Import socketpair()
+#include <sys/syscall.h>
+    // Import SYS_pidfd_open
+#include <sys/wait.h>
+    // Import waitpid()
+
+extern void *guard_mem(void *obj);
+extern void eexplain_err(int err);
+extern char **environ;
+
+#define HELPER_MAGIC  0x55534831U   // "USH1"
+
+/*
+ * A request, on the control socket.  It comes with four file
+ * descriptors: the socket for the reply, and the child's fds 0, 1, 2.
+ * The cwd, arguments and environment, |len| bytes of null-terminated
+ * strings, follow on the reply socket, which has no limit on size.
+ */
+struct helper_req {
+    uint32_t magic;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t len;
+};
+
+/*
+ * A reply: the pid and errno, with the pidfd, when the child is started;
+ * then the pid and wait status, when it has exited.
+ */
+struct helper_msg {
+    int32_t pid;
+    int32_t val;
+};
+
+struct helper_child {
+    pid_t pid;
+    int   sock;
+};
+
+static int helper_sock = -1;    // The caller's end of the control socket
+static pid_t helper_pid = -1;
+
+static int
+send_msg(int sock, const void *buf, size_t len, const int *fds, int nfds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union {
+        char buf[CMSG_SPACE(4 * sizeof (int))];
+        struct cmsghdr align;
+    } ctl;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof (msg));
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds != 0) {
+        memset(&ctl, 0, sizeof (ctl));
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof (int));
+        cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(nfds * sizeof (int));
+        memcpy(CMSG_DATA(cm), fds, nfds * sizeof (int));
+    }
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        return (errno);
+    }
+    return ((size_t)n == len ? 0 : EPIPE);
+}
+
+/*
+ * Receive a message, and up to |maxfds| file descriptors with it.
+ * Returns the size of the message, 0 at end of file, or -1.
+ */
+static ssize_t
+recv_msg(int sock, void *buf, size_t len, int *fds, int maxfds, int *nfdsp)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union {
+        char buf[CMSG_SPACE(4 * sizeof (int))];
+        struct cmsghdr align;
+    } ctl;
+    ssize_t n;
+    int nfds;
+
+    memset(&msg, 0, sizeof (msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof (ctl.buf);
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+
+    nfds = 0;
+    if (n >= 0) {
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            int *p;
+            int i;
+            int cnt;
+
+            if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            p = (int *)CMSG_DATA(cm);
+            cnt = (cm->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+            for (i = 0; i < cnt; ++i) {
+                if (nfds < maxfds) {
+                    fds[nfds++] = p[i];
+                }
+                else {
+                    close(p[i]);
+                }
+            }
+        }
+    }
+    *nfdsp = nfds;
+    return (n);
+}
+
+static int
+send_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len != 0) {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno);
+        }
+        buf += n;
+        len -= n;
+    }
+    return (0);
+}
+
+static int
+read_all(int fd, char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len != 0) {
+        n = read(fd, buf, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return (n == 0 ? EPIPE : errno);
+        }
+        buf += n;
+        len -= n;
+    }
+    return (0);
+}
+
+/*
+ * In the helper's child: put the request in place, and run it,
+ * as ush_argv() would have in the caller.
+ */
+static void
+helper_runner(int sock, const struct helper_req *req, int *fd)
+{
+    sigset_t mask;
+    char **argv;
+    char **envp;
+    char *buf;
+    char *p;
+    char *end;
+    char *nul;
+    uint32_t i;
+    int tmp[3];
+    int rv;
+
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+
+    buf = (char *)malloc(req->len + 1);
+    if (buf == NULL || read_all(sock, buf, req->len) != 0) {
+        _exit(127);
+    }
+    close(sock);
+    buf[req->len] = '\0';
+    argv = (char **)calloc(req->argc + 1, sizeof (char *));
+    envp = (char **)calloc(req->envc + 1, sizeof (char *));
+    if (argv == NULL || envp == NULL) {
+        _exit(127);
+    }
+
+    // cwd, then argc arguments, then envc environment strings.
+    p = buf;
+    end = buf + req->len;
+    for (i = 0; i < 1 + req->argc + req->envc; ++i) {
+        nul = (char *)memchr(p, '\0', end - p);
+        if (nul == NULL || nul == end) {
+            _exit(127);
+        }
+        if (i > 0 && i <= req->argc) {
+            argv[i - 1] = p;
+        }
+        else if (i > req->argc) {
+            envp[i - 1 - req->argc] = p;
+        }
+        p = nul + 1;
+    }
+
+    // Out of the way of 0, 1 and 2 first, so that none is clobbered.
+    for (i = 0; i < 3; ++i) {
+        tmp[i] = fcntl(fd[i], F_DUPFD_CLOEXEC, 3);
+        close(fd[i]);
+    }
+    for (i = 0; i < 3; ++i) {
+        if (tmp[i] < 0 || dup2(tmp[i], i) < 0) {
+            _exit(127);
+        }
+        close(tmp[i]);
+    }
+
+    if (chdir(buf) != 0) {
+        int err = errno;
+        eprintf("spawn helper: chdir('%s') failed.\n", buf);
+        eexplain_err(err);
+        _exit(127);
+    }
+    environ = envp;
+    rv = ush_argv((int)req->argc, argv);
+
+    // Not exit(): that would run the caller's atexit() handlers, and
+    // flush its stdio buffers, in a process that is only a copy of it.
+    // Only what ush itself wrote is flushed.
+    //
+    if (errprint_fh != NULL) {
+        fflush(errprint_fh);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    _exit(rv);
+}
+
+/*
+ * Take a request off the control socket, and start its child.
+ * Returns false at end of file.
+ */
+static bool
+helper_accept(int ctl, int sfd, struct helper_child **tabp, size_t *np, size_t *capp)
+{
+    struct helper_req req;
+    struct helper_msg msg;
+    ssize_t n;
+    int fds[4];
+    int nfds;
+    int pidfd;
+    int i;
+    pid_t pid;
+
+    n = recv_msg(ctl, &req, sizeof (req), fds, 4, &nfds);
+    if (n <= 0) {
+        if (n == -1 && errno == EAGAIN) {
+            return (true);
+        }
+        for (i = 0; i < nfds; ++i) {
+            close(fds[i]);
+        }
+        return (false);
+    }
+    if (n != sizeof (req) || nfds != 4 || req.magic != HELPER_MAGIC
+        || req.argc == 0) {
+        for (i = 0; i < nfds; ++i) {
+            close(fds[i]);
+        }
+        return (true);
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        close(ctl);
+        close(sfd);
+        helper_runner(fds[0], &req, fds + 1);
+    }
+    for (i = 1; i < 4; ++i) {
+        close(fds[i]);
+    }
+    msg.pid = pid;
+    msg.val = (pid == -1) ? errno : 0;
+    if (pid == -1) {
+        send_msg(fds[0], &msg, sizeof (msg), NULL, 0);
+        close(fds[0]);
+        return (true);
+    }
+    pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    send_msg(fds[0], &msg, sizeof (msg), &pidfd, pidfd >= 0 ? 1 : 0);
+    if (pidfd >= 0) {
+        close(pidfd);
+    }
+    if (*np == *capp) {
+        *capp = *capp ? *capp * 2 : 16;
+        *tabp = (struct helper_child *)realloc(*tabp, *capp * sizeof (**tabp));
+        if (*tabp == NULL) {
+            _exit(127);
+        }
+    }
+    (*tabp)[*np].pid = pid;
+    (*tabp)[*np].sock = fds[0];
+    ++*np;
+    return (true);
+}
+
+/*
+ * Reap whatever children have exited, and send each its wait status.
+ */
+static void
+helper_reap(struct helper_child *tab, size_t *np)
+{
+    struct helper_msg msg;
+    pid_t pid;
+    int status;
+    size_t i;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (i = 0; i < *np; ++i) {
+            if (tab[i].pid == pid) {
+                break;
+            }
+        }
+        if (i == *np) {
+            continue;
+        }
+        msg.pid = pid;
+        msg.val = status;
+        send_msg(tab[i].sock, &msg, sizeof (msg), NULL, 0);
+        close(tab[i].sock);
+        tab[i] = tab[--*np];
+    }
+}
+
+/*
+ * Let go of everything the helper got from the caller, but stderr
+ * and the control socket, which becomes fd 3.  Otherwise, every fd
+ * the caller had open, without FD_CLOEXEC, when the helper was started,
+ * would be held open by the helper, and by every program it starts.
+ * Returns the control socket.
+ */
+static int
+helper_isolate(int ctl)
+{
+    int nul;
+
+    if (ctl != 3) {
+        if (dup3(ctl, 3, O_CLOEXEC) != 3) {
+            _exit(127);
+        }
+        if (ctl < 3) {
+            close(ctl);
+        }
+        ctl = 3;
+    }
+    close_from(4);
+    nul = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (nul >= 0) {
+        dup2(nul, 0);
+        dup2(nul, 1);
+        if (nul > 2) {
+            close(nul);
+        }
+    }
+    return (ctl);
+}
+
+/*
+ * The helper itself.  It runs until the caller closes its end of the
+ * control socket, and every child that it has started has exited.
+ */
+static void
+helper_main(int ctl)
+{
+    struct helper_child *tab;
+    struct signalfd_siginfo si;
+    struct pollfd pfd[2];
+    sigset_t mask;
+    size_t n;
+    size_t cap;
+    int sfd;
+
+    ctl = helper_isolate(ctl);
+    prctl(PR_SET_NAME, "ush-helper", 0, 0, 0);
+    // Keyboard signals are for the caller, and for the children.
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_DFL);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sfd < 0) {
+        _exit(127);
+    }
+
+    tab = NULL;
+    n = 0;
+    cap = 0;
+    while (ctl >= 0 || n != 0) {
+        pfd[0].fd = ctl;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = sfd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _exit(127);
+        }
+        if (pfd[1].revents & POLLIN) {
+            while (read(sfd, &si, sizeof (si)) == sizeof (si)) {
+                continue;
+            }
+            helper_reap(tab, &n);
+        }
+        if (ctl >= 0 && (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            if (!helper_accept(ctl, sfd, &tab, &n, &cap)) {
+                close(ctl);
+                ctl = -1;
+            }
+        }
+    }
+    _exit(0);
+}
+
+/**
+ * @brief Start the spawn helper.  Call it early, while the caller is small.
+ *
+ * @return errno-style status
+ *
+ * From then on, ush_argv(), ush() and ush_popen2() start their
+ * programs from the helper.  Calling it again does nothing.
+ *
+ */
+int
+ush_helper_start(void)
+{
+    int sv[2];
+    pid_t pid;
+    int err;
+
+    if (helper_sock >= 0) {
+        return (0);
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+        err = errno;
+        eprintf("spawn helper: socketpair() failed.\n");
+        eexplain_err(err);
+        return (err);
+    }
+    // Nothing still in a stdio buffer is to be written twice.
+    fflush(NULL);
+    pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        helper_main(sv[1]);
+    }
+    if (pid == -1) {
+        err = errno;
+        eprintf("spawn helper: fork() failed.\n");
+        eexplain_err(err);
+        close(sv[0]);
+        close(sv[1]);
+        return (err);
+    }
+    close(sv[1]);
+    helper_sock = sv[0];
+    helper_pid = pid;
+    return (0);
+}
+
+/**
+ * @brief Stop the spawn helper, once all of its children have exited.
+ *
+ * Programs are started from the caller, again, after this.
+ *
+ */
+void
+ush_helper_stop(void)
+{
+    if (helper_sock < 0) {
+        return;
+    }
+    close(helper_sock);
+    helper_sock = -1;
+    while (waitpid(helper_pid, NULL, 0) == -1 && errno == EINTR) {
+        continue;
+    }
+    helper_pid = -1;
+}
+
+/**
+ * @brief Is there a spawn helper to start programs?
+ *
+ */
+bool
+helper_running(void)
+{
+    return (helper_sock >= 0);
+}
+
+/**
+ * @brief Have the spawn helper start a program.
+ *
+ * @param argc   IN   Count of arguments
+ * @param argv   IN   Arguments for ush_argv(), starting with "ush"
+ * @param fd     IN   To be the child's fds 0, 1 and 2
+ * @param sockp  OUT  Socket on which helper_wait() gets the wait status
+ * @param pidp   OUT  pid of the child
+ * @param pidfdp OUT  pidfd of the child, or -1
+ * @return errno-style status
+ *
+ */
+int
+helper_spawn(int argc, char **argv, const int *fd, int *sockp, pid_t *pidp, int *pidfdp)
+{
+    struct helper_req req;
+    struct helper_msg msg;
+    char cwd[PATH_MAX];
+    char *buf;
+    size_t len;
+    size_t off;
+    size_t sz;
+    ssize_t n;
+    int fds[4];
+    int nfds;
+    int pidfd;
+    int sv[2];
+    int envc;
+    int err;
+    int i;
+
+    if (getcwd(cwd, sizeof (cwd)) == NULL) {
+        return (errno);
+    }
+    for (envc = 0; environ != NULL && environ[envc] != NULL; ++envc) {
+        continue;
+    }
+    len = strlen(cwd) + 1;
+    for (i = 0; i < argc; ++i) {
+        len += strlen(argv[i]) + 1;
+    }
+    for (i = 0; i < envc; ++i) {
+        len += strlen(environ[i]) + 1;
+    }
+    if (len > UINT32_MAX) {
+        return (E2BIG);
+    }
+    buf = (char *)guard_mem(malloc(len));
+    off = 0;
+    sz = strlen(cwd) + 1;
+    memcpy(buf, cwd, sz);
+    off += sz;
+    for (i = 0; i < argc; ++i) {
+        sz = strlen(argv[i]) + 1;
+        memcpy(buf + off, argv[i], sz);
+        off += sz;
+    }
+    for (i = 0; i < envc; ++i) {
+        sz = strlen(environ[i]) + 1;
+        memcpy(buf + off, environ[i], sz);
+        off += sz;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        err = errno;
+        free(buf);
+        return (err);
+    }
+    req.magic = HELPER_MAGIC;
+    req.argc = argc;
+    req.envc = envc;
+    req.len = (uint32_t)len;
+    fds[0] = sv[1];
+    fds[1] = fd[0];
+    fds[2] = fd[1];
+    fds[3] = fd[2];
+    err = send_msg(helper_sock, &req, sizeof (req), fds, 4);
+    close(sv[1]);
+    if (err == 0) {
+        // If the fork() failed, the reply says so; never mind this.
+        send_all(sv[0], buf, len);
+    }
+    free(buf);
+    if (err != 0) {
+        close(sv[0]);
+        return (err);
+    }
+
+    pidfd = -1;
+    n = recv_msg(sv[0], &msg, sizeof (msg), &pidfd, 1, &nfds);
+    if (n != sizeof (msg) || msg.val != 0) {
+        err = (n == sizeof (msg)) ? msg.val : EPIPE;
+        if (nfds != 0) {
+            close(pidfd);
+        }
+        close(sv[0]);
+        return (err);
+    }
+    *sockp = sv[0];
+    *pidp = msg.pid;
+    *pidfdp = nfds ? pidfd : -1;
+    return (0);
+}
+
+/**
+ * @brief Wait for a program started by helper_spawn().
+ *
+ * @param sock  IN  The socket from helper_spawn(); it is closed
+ * @return the wait status of the child, or -1
+ *
+ */
+int
+helper_wait(int sock)
+{
+    struct helper_msg msg;
+
+    if (read_all(sock, (char *)&msg, sizeof (msg)) != 0) {
+        close(sock);
+        errno = ECHILD;
+        return (-1);
+    }
+    close(sock);
+    return (msg.val);
+}
+
+/**
+ * @brief Run a command line for ush_argv() from the spawn helper.
+ *
+ * @param argc  IN   Count of arguments
+ * @param argv  IN   Arguments, starting with "ush"
+ * @param ret   OUT  What ush_argv() returned, in the child
+ * @return errno-style status; ESRCH if there is no helper
+ *
+ * An error is returned only if the program was not started; then,
+ * the caller can run it some other way.  Once the helper has said that
+ * it started, the return is 0, even if the wait status got lost;
+ * then, |*ret| is ECHILD.
+ *
+ */
+int
+helper_argv(int argc, char **argv, int *ret)
+{
+    static const int std_fd[3] = { 0, 1, 2 };
+    pid_t pid;
+    int sock;
+    int pidfd;
+    int status;
+    int err;
+
+    if (helper_sock < 0) {
+        return (ESRCH);
+    }
+    err = helper_spawn(argc, argv, std_fd, &sock, &pid, &pidfd);
+    if (err != 0) {
+        return (err);
+    }
+    if (pidfd >= 0) {
+        close(pidfd);
+    }
+    status = helper_wait(sock);
+    if (status == -1) {
+        // The program was started; it must not be run again, here.
+        eprintf("spawn helper: lost track of pid %d.\n", (int)pid);
+        *ret = ECHILD;
+        return (0);
+    }
+    if (WIFSIGNALED(status)) {
+        *ret = 128 + WTERMSIG(status);
+    }
+    else {
+        *ret = WEXITSTATUS(status);
+    }
+    return (0);
+}
@@ -0,0 +1,414 @@
+/*
+ * Filename: supervise.c
+ * Library: libush
+ * Brief: Keep the --fork parent alive, and restart the child when it exits
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import pipe2()
+    // Import fcntl()
+#include <malloc.h>
+    // Import malloc_trim()
+#include <signal.h>
+    // Import kill()
+    // Import sigaction()
+#include <stdlib.h>
+    // Import strtoul()
+    // Import calloc()
+#include <string.h>
+    // Import memset()
+#include <time.h>
+    // Import nanosleep()
+
+extern void *guard_mem(void *obj);
+extern void eexplain_err(int err);
+
+static int supervise_signals[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM, 0 };
+
+static volatile sig_atomic_t supervise_stop;
+static volatile pid_t supervise_child;
+
+/**
+ * @brief Command-line option to restart the child whenever it exits
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @return errno-style status
+ *
+ * --supervise implies --fork.
+ *
+ */
+int
+cmd_supervise(cmd_t *cmd)
+{
+    cmd->supervise = true;
+    cmd->cmd_fork = true;
+    return (0);
+}
+
+int
+cmd_restart_delay(cmd_t *cmd, const char *arg)
+{
+    int rv;
+
+    rv = parse_duration(arg, &cmd->restart_delay_ns);
+    if (rv != 0) {
+        eprintf("--restart-delay: Invalid duration, '%s'.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    return (0);
+}
+
+int
+cmd_restart_delay_max(cmd_t *cmd, const char *arg)
+{
+    int rv;
+
+    rv = parse_duration(arg, &cmd->restart_delay_max_ns);
+    if (rv != 0) {
+        eprintf("--restart-delay-max: Invalid duration, '%s'.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    return (0);
+}
+
+/**
+ * @brief Command-line option to cap the rate of restarts
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  <count>/<duration>
+ * @return errno-style status
+ *
+ */
+int
+cmd_restart_limit(cmd_t *cmd, const char *arg)
+{
+    char *end;
+    unsigned long n;
+    int rv;
+
+    errno = 0;
+    n = strtoul(arg, &end, 10);
+    rv = EINVAL;
+    if (errno == 0 && end != arg && *end == '/' && n != 0 && n <= 100000) {
+        rv = parse_duration(end + 1, &cmd->restart_window_ns);
+    }
+    if (rv != 0 || cmd->restart_window_ns == 0) {
+        eprintf("--restart-limit: Expected <count>/<duration>, not '%s'.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    cmd->restart_limit = (unsigned int)n;
+    return (0);
+}
+
+/**
+ * @brief Command-line option to name the child's readiness fd
+ *
+ * @param cmd  IN  Command "object" that hold context/control information
+ * @param arg  IN  A file descriptor number, 3 or more
+ * @return errno-style status
+ *
+ */
+int
+cmd_ready_fd(cmd_t *cmd, const char *arg)
+{
+    char *end;
+    long fd;
+
+    errno = 0;
+    fd = strtol(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || fd < 3 || fd > 1023) {
+        eprintf("--ready-fd: '%s' must be a file descriptor in 3..1023.\n", arg);
+        cmd->ioerr = EINVAL;
+        return (EINVAL);
+    }
+    cmd->ready_fd = (int)fd;
+    return (0);
+}
+
+/**
+ * @brief Make the readiness pipe.  Before fork().
+ *
+ * @param cmd  IN  Command "object"
+ * @return errno-style status
+ *
+ */
+int
+ready_prepare(cmd_t *cmd)
+{
+    int pfd[2];
+
+    cmd->ready_rfd = -1;
+    cmd->ready_wfd = -1;
+    cmd->child_ready = false;
+    if (cmd->ready_fd == 0) {
+        return (0);
+    }
+    if (pipe2(pfd, O_CLOEXEC) != 0) {
+        int err = errno;
+        eprintf("pipe2() failed, for --ready-fd.\n");
+        eexplain_err(err);
+        return (err);
+    }
+    cmd->ready_rfd = pfd[0];
+    cmd->ready_wfd = pfd[1];
+    return (0);
+}
+
+/**
+ * @brief The child side of the readiness pipe.  After fork(), before exec().
+ *
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+ready_child_setup(cmd_t *cmd)
+{
+    if (cmd->ready_wfd < 0) {
+        return;
+    }
+    if (cmd->ready_wfd == cmd->ready_fd) {
+        fcntl(cmd->ready_fd, F_SETFD, 0);
+    }
+    else {
+        dup2(cmd->ready_wfd, cmd->ready_fd);
+    }
+}
+
+/**
+ * @brief The parent side of the readiness pipe.  After fork().
+ *
+ * @param cmd  IN  Command "object"
+ *
+ * Close our copy of the write end, so that we see EOF
+ * when the child, and everything it started, is gone.
+ *
+ */
+void
+ready_parent_setup(cmd_t *cmd)
+{
+    if (cmd->ready_wfd >= 0) {
+        close(cmd->ready_wfd);
+        cmd->ready_wfd = -1;
+    }
+}
+
+/**
+ * @brief Something can be read from the readiness pipe.
+ *
+ * @param cmd  IN  Command "object"
+ * @return false if the pipe is at EOF, and no longer worth watching
+ *
+ */
+bool
+ready_check(cmd_t *cmd)
+{
+    char buf[64];
+    ssize_t len;
+
+    len = read(cmd->ready_rfd, buf, sizeof (buf));
+    if (len > 0) {
+        if (!cmd->child_ready && cmd->verbose) {
+            eprintf("supervise: child pid=%d is ready\n", (int)cmd->child);
+        }
+        cmd->child_ready = true;
+        return (true);
+    }
+    if (len == -1 && errno == EINTR) {
+        return (true);
+    }
+    return (false);
+}
+
+void
+ready_teardown(cmd_t *cmd)
+{
+    if (cmd->ready_rfd >= 0) {
+        close(cmd->ready_rfd);
+        cmd->ready_rfd = -1;
+    }
+    if (cmd->ready_wfd >= 0) {
+        close(cmd->ready_wfd);
+        cmd->ready_wfd = -1;
+    }
+}
+
+static void
+stop_signal(int sig)
+{
+    supervise_stop = sig;
+    if (supervise_child > 0) {
+        kill(supervise_child, sig);
+        // In case the child is the leader of a process group (--timeout).
+        kill(-supervise_child, sig);
+    }
+}
+
+/*
+ * Sleep, unless and until we are told to stop.
+ */
+static void
+backoff_sleep(unsigned long long ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    while (supervise_stop == 0 && nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+        continue;
+    }
+}
+
+/**
+ * @brief Run the child, and keep running it, until told to stop.
+ *
+ * @param cmd  IN  Command "object"
+ * @return the wait status of the last run of the child
+ *
+ */
+int
+run_supervise(cmd_t *cmd)
+{
+    struct sigaction saved[sizeof (supervise_signals) / sizeof (int)];
+    unsigned long long *starts;
+    unsigned long long delay;
+    unsigned long long delay_min;
+    unsigned long long delay_max;
+    unsigned long long start;
+    unsigned int nstart;
+    unsigned int restarts;
+    size_t i;
+    int rv;
+
+    delay_min = cmd->restart_delay_ns ? cmd->restart_delay_ns : 100000000ULL;
+    delay_max = cmd->restart_delay_max_ns ? cmd->restart_delay_max_ns : 30000000000ULL;
+    if (delay_max < delay_min) {
+        delay_max = delay_min;
+    }
+    delay = delay_min;
+
+    // Start times of the most recent runs, for --restart-limit
+    starts = NULL;
+    if (cmd->restart_limit != 0) {
+        starts = (unsigned long long *)guard_mem(calloc(cmd->restart_limit + 1, sizeof (*starts)));
+    }
+
+    supervise_stop = 0;
+    supervise_child = 0;
+    for (i = 0; supervise_signals[i] != 0; ++i) {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof (sa));
+        sa.sa_handler = stop_signal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(supervise_signals[i], &sa, &saved[i]);
+    }
+
+    // Everything that was needed to parse the script has been freed,
+    // by now.  Give the memory back, since we might be here for a long time.
+    //
+    malloc_trim(0);
+
+    nstart = 0;
+    restarts = 0;
+    rv = 0;
+    while (supervise_stop == 0) {
+        start = mono_ns();
+        if (starts != NULL) {
+            starts[nstart % (cmd->restart_limit + 1)] = start;
+        }
+        ++nstart;
+        rv = run_child_program(cmd);
+        supervise_child = 0;
+        if (supervise_stop != 0) {
+            break;
+        }
+
+        // A child that could not be started at all (fork() failed with
+        // EAGAIN, say) counts as a crash: it is retried, after the backoff,
+        // and counts against --restart-limit.
+        //
+        if (cmd->child > 0 && (cmd->child_ready
+            || (cmd->ready_fd == 0 && mono_ns() - start >= delay_max))) {
+            delay = delay_min;
+        }
+
+        // The oldest start time kept is that of the run restart_limit
+        // runs before this one.  One more restart, within the window
+        // since then, would be one too many.
+        //
+        if (starts != NULL && nstart > cmd->restart_limit) {
+            unsigned long long oldest = starts[nstart % (cmd->restart_limit + 1)];
+
+            if (mono_ns() + delay - oldest < cmd->restart_window_ns) {
+                eprintf("supervise: more than %u restarts within %.3f s;"
+                    " giving up.\n",
+                    cmd->restart_limit, (double)cmd->restart_window_ns / 1e9);
+                break;
+            }
+        }
+
+        ++restarts;
+        if (cmd->verbose && cmd->child <= 0) {
+            eprintf("supervise: could not start the child, status=0x%x;"
+                " retry #%u in %.3f s\n",
+                rv, restarts, (double)delay / 1e9);
+        }
+        else if (cmd->verbose) {
+            eprintf("supervise: child exited, status=0x%x; restart #%u in %.3f s\n",
+                cmd->child_status, restarts, (double)delay / 1e9);
+        }
+        backoff_sleep(delay);
+        delay *= 2;
+        if (delay > delay_max) {
+            delay = delay_max;
+        }
+    }
+
+    for (i = 0; supervise_signals[i] != 0; ++i) {
+        sigaction(supervise_signals[i], &saved[i], NULL);
+    }
+    supervise_child = 0;
+    free(starts);
+    return (rv);
+}
+
+/**
+ * @brief Tell the signal handler which child to pass signals on to.
+ *
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+supervise_parent_setup(cmd_t *cmd)
+{
+    if (cmd->supervise) {
+        supervise_child = cmd->child;
+        if (supervise_stop != 0) {
+            kill(cmd->child, supervise_stop);
+        }
+    }
+}
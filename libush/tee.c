@@ -0,0 +1,381 @@
+/*
+ * Filename: tee.c
+ * Library: libush
+ * Brief: Copy the child's stdout or stderr to more than one place, in the kernel
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import open()
+    // Import pipe2()
+    // Import splice()
+    // Import tee()
+#include <stdlib.h>
+    // Import realloc()
+#include <string.h>
+    // Import memmove()
+#include <sys/ioctl.h>
+    // Import ioctl()
+    // Import FIONREAD
+#include <sys/stat.h>
+    // Import S_IRUSR
+    // Import S_IWUSR
+
+extern void *guard_mem(void *obj);
+extern void eexplain_err(int err);
+
+// Bigger pipes mean fewer trips around the pump, for each megabyte.
+// If the system does not allow this much, we just keep the default.
+//
+#define TEE_PIPE_SZ (1024 * 1024)
+
+static int
+cmd_tee(cmd_t *cmd, int fd, const char *opt, const char *fname)
+{
+    int tfd;
+
+    tfd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, S_IRUSR|S_IWUSR);
+    if (tfd == -1) {
+        int err = errno;
+        eprintf("%s: open('%s') failed.\n", opt, fname);
+        eexplain_err(err);
+        cmd->ioerr = err;
+        return (err);
+    }
+    cmd->tee_dest[fd] = (int *)guard_mem(realloc(cmd->tee_dest[fd],
+        (cmd->tee_count[fd] + 1) * sizeof (int)));
+    cmd->tee_dest[fd][cmd->tee_count[fd]] = tfd;
+    ++cmd->tee_count[fd];
+    cmd->cmd_fork = true;
+    return (0);
+}
+
+/**
+ * @brief Command-line option to copy the child's stdout to a file, as well
+ *
+ * @param cmd    IN  Command "object" that hold context/control information
+ * @param fname  IN  The file to copy to
+ * @return errno-style status
+ *
+ * --stdout-tee implies --fork.
+ *
+ */
+int
+cmd_stdout_tee(cmd_t *cmd, const char *fname)
+{
+    return (cmd_tee(cmd, 1, "--stdout-tee", fname));
+}
+
+int
+cmd_stderr_tee(cmd_t *cmd, const char *fname)
+{
+    return (cmd_tee(cmd, 2, "--stderr-tee", fname));
+}
+
+/**
+ * @brief Make the pipes for tee.  Before fork().
+ *
+ * @param cmd  IN  Command "object"
+ * @return errno-style status
+ *
+ */
+int
+tee_prepare(cmd_t *cmd)
+{
+    int pfd[2];
+    int fd;
+
+    cmd->tee_src[1] = -1;
+    cmd->tee_src[2] = -1;
+    cmd->tee_tmp[0] = -1;
+    cmd->tee_tmp[1] = -1;
+    if (cmd->tee_count[1] == 0 && cmd->tee_count[2] == 0) {
+        return (0);
+    }
+
+    if (!cmd->child_fd_plan) {
+        for (fd = 0; fd < 3; ++fd) {
+            cmd->child_fd[fd] = -1;
+        }
+        cmd->child_fd_plan = true;
+    }
+    for (fd = 1; fd <= 2; ++fd) {
+        if (cmd->tee_count[fd] == 0 || cmd->child_fd[fd] >= 0) {
+            continue;
+        }
+        if (pipe2(pfd, O_CLOEXEC) != 0) {
+            int err = errno;
+            eprintf("pipe2() failed, for tee.\n");
+            eexplain_err(err);
+            tee_finish(cmd);
+            return (err);
+        }
+        fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+        fcntl(pfd[0], F_SETPIPE_SZ, TEE_PIPE_SZ);
+        cmd->tee_src[fd] = pfd[0];
+        cmd->child_fd[fd] = pfd[1];
+    }
+    if (pipe2(cmd->tee_tmp, O_CLOEXEC) != 0) {
+        int err = errno;
+        eprintf("pipe2() failed, for tee.\n");
+        eexplain_err(err);
+        tee_finish(cmd);
+        return (err);
+    }
+    fcntl(cmd->tee_tmp[1], F_SETPIPE_SZ, TEE_PIPE_SZ);
+    return (0);
+}
+
+/**
+ * @brief Close the child's ends of the tee pipes.  After fork().
+ *
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+tee_parent_setup(cmd_t *cmd)
+{
+    int fd;
+
+    for (fd = 1; fd <= 2; ++fd) {
+        if (cmd->tee_src[fd] >= 0) {
+            close(cmd->child_fd[fd]);
+            cmd->child_fd[fd] = -1;
+        }
+    }
+}
+
+/*
+ * Copy |len| bytes from pipe |src| to |dst|, the slow way,
+ * for a destination that splice() does not support.
+ */
+static int
+copy_out(int src, int dst, size_t len)
+{
+    char buf[65536];
+    ssize_t n;
+    ssize_t w;
+    size_t off;
+
+    while (len != 0) {
+        n = read(src, buf, len < sizeof (buf) ? len : sizeof (buf));
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return (n == 0 ? EPIPE : errno);
+        }
+        for (off = 0; off < (size_t)n; off += w) {
+            w = write(dst, buf + off, n - off);
+            if (w == -1) {
+                if (errno == EINTR) {
+                    w = 0;
+                    continue;
+                }
+                return (errno);
+            }
+        }
+        len -= n;
+    }
+    return (0);
+}
+
+/*
+ * Move exactly |len| bytes, which are known to be in pipe |src|, to |dst|.
+ */
+static int
+splice_out(int src, int dst, size_t len)
+{
+    ssize_t n;
+
+    while (len != 0) {
+        n = splice(src, NULL, dst, NULL, len, SPLICE_F_MOVE);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL) {
+                return (copy_out(src, dst, len));
+            }
+            return (errno);
+        }
+        len -= n;
+    }
+    return (0);
+}
+
+/*
+ * Throw away whatever is left in the tee_tmp pipe, after a failed
+ * splice_out(), so that the next destination gets only its own copy.
+ */
+static void
+drain_tmp(int tmp)
+{
+    char buf[65536];
+    int avail;
+    ssize_t n;
+
+    while (ioctl(tmp, FIONREAD, &avail) == 0 && avail > 0) {
+        n = read(tmp, buf, (size_t)avail < sizeof (buf) ? (size_t)avail : sizeof (buf));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+    }
+}
+
+/*
+ * Stop copying to the |i|'th tee file of |fd|, which failed.
+ * The others, and the child's own stdout or stderr, carry on.
+ */
+static void
+tee_drop(cmd_t *cmd, int fd, size_t i, int err)
+{
+    eprintf("tee of fd %d, to file #%zu, failed; nothing more is copied to it.\n",
+        fd, i + 1);
+    eexplain_err(err);
+    close(cmd->tee_dest[fd][i]);
+    memmove(&cmd->tee_dest[fd][i], &cmd->tee_dest[fd][i + 1],
+        (cmd->tee_count[fd] - i - 1) * sizeof (int));
+    --cmd->tee_count[fd];
+}
+
+/**
+ * @brief Copy whatever is in the child's pipe to every destination.
+ *
+ * @param cmd  IN  Command "object"
+ * @param fd   IN  1 for stdout, or 2 for stderr
+ * @return false at end of file, or when the pipe is empty
+ *
+ * A tee file that fails is dropped; see tee_drop().  If ush's own
+ * stdout or stderr fails, the pipe from the child is closed,
+ * as it would be for any reader that has gone away.
+ *
+ */
+bool
+tee_pump(cmd_t *cmd, int fd)
+{
+    int src;
+    ssize_t len;
+    ssize_t n;
+    size_t i;
+    bool have;
+    int err;
+
+    src = cmd->tee_src[fd];
+    if (src < 0) {
+        return (false);
+    }
+
+    // How much can we move, this time?  As much as tee() will duplicate.
+    //
+    do {
+        len = tee(src, cmd->tee_tmp[1], 1 << 20, SPLICE_F_NONBLOCK);
+    } while (len == -1 && errno == EINTR);
+    if (len <= 0) {
+        if (len == -1 && errno == EAGAIN) {
+            return (false);
+        }
+        close(src);
+        cmd->tee_src[fd] = -1;
+        return (false);
+    }
+
+    // |have| is true while tee_tmp holds one copy of the |len| bytes.
+    //
+    have = true;
+    i = 0;
+    while (i < cmd->tee_count[fd]) {
+        err = 0;
+        if (!have) {
+            // Same data, again.  It is still all there, in the source.
+            do {
+                n = tee(src, cmd->tee_tmp[1], len, 0);
+            } while (n == -1 && errno == EINTR);
+            if (n != len) {
+                err = (n == -1) ? errno : EIO;
+            }
+        }
+        if (err == 0) {
+            err = splice_out(cmd->tee_tmp[0], cmd->tee_dest[fd][i], len);
+        }
+        have = false;
+        if (err != 0) {
+            drain_tmp(cmd->tee_tmp[0]);
+            tee_drop(cmd, fd, i, err);
+            continue;
+        }
+        ++i;
+    }
+    if (have) {
+        // Every tee file has been dropped.
+        drain_tmp(cmd->tee_tmp[0]);
+    }
+
+    err = splice_out(src, fd, len);
+    if (err != 0) {
+        eprintf("tee of fd %d failed.\n", fd);
+        eexplain_err(err);
+        close(src);
+        cmd->tee_src[fd] = -1;
+        return (false);
+    }
+    return (true);
+}
+
+/**
+ * @brief Drain what is left, and close the tee pipes.  After the child exits.
+ *
+ * @param cmd  IN  Command "object"
+ *
+ */
+void
+tee_finish(cmd_t *cmd)
+{
+    int fd;
+
+    for (fd = 1; fd <= 2; ++fd) {
+        if (cmd->tee_src[fd] >= 0 && cmd->child_fd[fd] >= 0) {
+            // There never was a child.
+            close(cmd->child_fd[fd]);
+            cmd->child_fd[fd] = -1;
+        }
+        if (cmd->tee_src[fd] >= 0) {
+            while (tee_pump(cmd, fd)) {
+                continue;
+            }
+            if (cmd->tee_src[fd] >= 0) {
+                close(cmd->tee_src[fd]);
+                cmd->tee_src[fd] = -1;
+            }
+        }
+    }
+    if (cmd->tee_tmp[0] >= 0) {
+        close(cmd->tee_tmp[0]);
+        close(cmd->tee_tmp[1]);
+        cmd->tee_tmp[0] = -1;
+        cmd->tee_tmp[1] = -1;
+    }
+}
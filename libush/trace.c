@@ -0,0 +1,303 @@
+/*
+ * Filename: trace.c
+ * Library: libush
+ * Brief: --trace=<file>: write the launch timeline as Chrome trace events
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ush.h>
+#include <trace.h>
+#include <cscript.h>
+#include <unistd.h>
+
+#include <errno.h>
+    // Import var errno
+#include <fcntl.h>
+    // Import open()
+#include <stdarg.h>
+    // Import va_start()
+#include <stdio.h>
+    // Import snprintf()
+    // Import vsnprintf()
+#include <stdlib.h>
+    // Import atexit()
+#include <sys/syscall.h>
+    // Import SYS_gettid
+
+extern void eexplain_err(int err);
+
+#define TRACE_EVENT_MAX 4096
+#define TRACE_STR_MAX   512
+
+int trace_fd = -1;
+static pid_t trace_pid;
+
+struct ev {
+    char   buf[TRACE_EVENT_MAX];
+    size_t len;
+};
+
+static void
+ev_printf(struct ev *ev, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (ev->len >= sizeof (ev->buf)) {
+        return;
+    }
+    va_start(ap, fmt);
+    n = vsnprintf(ev->buf + ev->len, sizeof (ev->buf) - ev->len, fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        ev->len += n;
+        if (ev->len > sizeof (ev->buf) - 1) {
+            ev->len = sizeof (ev->buf) - 1;
+        }
+    }
+}
+
+/*
+ * A JSON string.  Anything that is not printable ASCII is escaped,
+ * so that whatever bytes are in an argument, the JSON is valid.
+ */
+static void
+ev_string(struct ev *ev, const char *str)
+{
+    const unsigned char *s;
+    size_t i;
+
+    ev_printf(ev, "\"");
+    if (str == NULL) {
+        str = "";
+    }
+    s = (const unsigned char *)str;
+    for (i = 0; s[i] != '\0' && i < TRACE_STR_MAX; ++i) {
+        if (s[i] == '"' || s[i] == '\\') {
+            ev_printf(ev, "\\%c", s[i]);
+        }
+        else if (s[i] < 0x20 || s[i] >= 0x7f) {
+            ev_printf(ev, "\\u%04x", s[i]);
+        }
+        else {
+            ev_printf(ev, "%c", s[i]);
+        }
+    }
+    if (s[i] != '\0') {
+        ev_printf(ev, "...");
+    }
+    ev_printf(ev, "\"");
+}
+
+/*
+ * Every event but the first follows a ",\n", so the file is always
+ * a valid JSON array, but for the closing ']'.
+ */
+static void
+ev_start(struct ev *ev, int ph, const char *name, pid_t pid, pid_t tid,
+    unsigned long long ts_ns)
+{
+    ev->len = 0;
+    ev_printf(ev, ",\n{\"name\":");
+    ev_string(ev, name);
+    ev_printf(ev, ",\"cat\":\"ush\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%ld,\"tid\":%ld",
+        ph, ts_ns / 1000, ts_ns % 1000, (long)pid, (long)tid);
+    if (ph == TRACE_INSTANT) {
+        ev_printf(ev, ",\"s\":\"t\"");
+    }
+}
+
+static void
+ev_write(struct ev *ev)
+{
+    ssize_t n;
+
+    ev_printf(ev, "}");
+    do {
+        n = write(trace_fd, ev->buf, ev->len);
+    } while (n == -1 && errno == EINTR);
+}
+
+static void
+trace_close(void)
+{
+    // Only the ush that opened the file; not a child that failed to exec().
+    if (trace_fd >= 0 && getpid() == trace_pid) {
+        if (write(trace_fd, "\n]\n", 3) < 0) {
+            // Nothing to be done about it
+        }
+        close(trace_fd);
+        trace_fd = -1;
+    }
+}
+
+/**
+ * @brief Start writing trace events to a file.
+ *
+ * @param fname  IN  The trace file; it is truncated
+ * @return errno-style status
+ *
+ */
+int
+trace_open(const char *fname)
+{
+    static bool registered;
+    struct ev ev;
+    int fd;
+
+    fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0666);
+    if (fd == -1) {
+        int err = errno;
+        eprintf("--trace: open('%s') failed.\n", fname);
+        eexplain_err(err);
+        return (err);
+    }
+    if (trace_fd >= 0) {
+        close(trace_fd);
+    }
+    trace_fd = fd;
+    trace_pid = getpid();
+    if (!registered) {
+        atexit(trace_close);
+        registered = true;
+    }
+
+    // The opening '[', and an event to name the ush process
+    ev_start(&ev, 'M', "process_name", trace_pid, trace_pid, mono_ns());
+    ev.buf[0] = '[';
+    ev_printf(&ev, ",\"args\":{\"name\":\"ush\"}");
+    ev_write(&ev);
+    return (0);
+}
+
+/**
+ * @brief Command-line option to write a trace of ush's own work to a file
+ *
+ * @param cmd    IN  Command "object" that hold context/control information
+ * @param fname  IN  The trace file
+ * @return errno-style status
+ *
+ */
+int
+cmd_trace(cmd_t *cmd, const char *fname)
+{
+    int rv;
+
+    rv = trace_open(fname);
+    if (rv != 0) {
+        cmd->ioerr = rv;
+    }
+    return (rv);
+}
+
+/**
+ * @brief Write an event with one string argument.
+ *
+ * @param ph    IN  TRACE_BEGIN, TRACE_END, or TRACE_INSTANT
+ * @param name  IN  Event name
+ * @param key   IN  Argument name, or NULL for none
+ * @param val   IN  Argument
+ *
+ */
+void
+trace_str(int ph, const char *name, const char *key, const char *val)
+{
+    struct ev ev;
+
+    if (trace_fd < 0) {
+        return;
+    }
+    ev_start(&ev, ph, name, getpid(), (pid_t)syscall(SYS_gettid), mono_ns());
+    if (key != NULL) {
+        ev_printf(&ev, ",\"args\":{");
+        ev_string(&ev, key);
+        ev_printf(&ev, ":");
+        ev_string(&ev, val);
+        ev_printf(&ev, "}");
+    }
+    ev_write(&ev);
+}
+
+/**
+ * @brief Write an event with one number argument.
+ *
+ * @param ph    IN  TRACE_BEGIN, TRACE_END, or TRACE_INSTANT
+ * @param name  IN  Event name
+ * @param key   IN  Argument name
+ * @param val   IN  Argument
+ *
+ */
+void
+trace_num(int ph, const char *name, const char *key, long long val)
+{
+    struct ev ev;
+
+    if (trace_fd < 0) {
+        return;
+    }
+    ev_start(&ev, ph, name, getpid(), (pid_t)syscall(SYS_gettid), mono_ns());
+    ev_printf(&ev, ",\"args\":{");
+    ev_string(&ev, key);
+    ev_printf(&ev, ":%lld}", val);
+    ev_write(&ev);
+}
+
+/**
+ * @brief Write a complete event, for the life of a child, once it is known.
+ *
+ * @param name      IN  The program
+ * @param pid       IN  The child; the span is shown on the child's timeline
+ * @param start_ns  IN  When it was forked
+ * @param end_ns    IN  When it was reaped
+ *
+ */
+void
+trace_span(const char *name, pid_t pid,
+    unsigned long long start_ns, unsigned long long end_ns)
+{
+    struct ev ev;
+    unsigned long long dur;
+
+    if (trace_fd < 0) {
+        return;
+    }
+    dur = (end_ns > start_ns) ? end_ns - start_ns : 0;
+    ev_start(&ev, 'X', name, pid, pid, start_ns);
+    ev_printf(&ev, ",\"dur\":%llu.%03llu", dur / 1000, dur % 1000);
+    ev_write(&ev);
+}
+
+/**
+ * @brief Name the calling process, in the trace viewer.
+ *
+ * @param name  IN  The name; for a child, the program it is about to exec()
+ *
+ */
+void
+trace_process_name(const char *name)
+{
+    struct ev ev;
+
+    if (trace_fd < 0) {
+        return;
+    }
+    ev_start(&ev, 'M', "process_name", getpid(), getpid(), mono_ns());
+    ev_printf(&ev, ",\"args\":{\"name\":");
+    ev_string(&ev, name);
+    ev_printf(&ev, "}");
+    ev_write(&ev);
+}
@@ -31,12 +31,15 @@
 // #include <sys/wait.h>
 
 #include <ush.h>
+#include <trace.h>
 #include <cscript.h>
 
 #include <getopt_int.h>
 
 #include <unistd.h>         // Import isatty()
 
+extern void *guard_mem(void *obj);
+
 static cmd_t cmdbuf;
 static cmd_t *cmd = &cmdbuf;
 
@@ -69,12 +72,66 @@ enum opt {
     OPT_SET_STDERR,
     OPT_SET_STDERR_APPEND,
     OPT_SET_STDERR_NEW,
+    OPT_STDOUT_TEE,
+    OPT_STDERR_TEE,
+    OPT_STDOUT_COMPRESS,
+    OPT_STDERR_COMPRESS,
+    OPT_COMPRESS_THREADS,
+    OPT_STDOUT_RING,
+    OPT_STDERR_RING,
+    OPT_RING_DUMP,
     OPT_CLEARENV,
     OPT_ENV,
     OPT_UMASK,
     OPT_CLOSE_FROM,
+    OPT_READAHEAD,
     OPT_REPLACE,
     OPT_ENCODING,
+    OPT_REPEAT,
+    OPT_WARMUP,
+    OPT_REPEAT_HOOK,
+    OPT_REPEAT_FORMAT,
+    OPT_LIMIT,
+    OPT_CPUS,
+    OPT_NUMA_NODE,
+    OPT_THP,
+    OPT_SCHED,
+    OPT_NICE,
+    OPT_IOPRIO,
+    OPT_RLIMIT,
+    OPT_OOM_SCORE_ADJ,
+    OPT_CGROUP,
+    OPT_MEMORY_MAX,
+    OPT_CPU_MAX,
+    OPT_IO_WEIGHT,
+    OPT_PIDS_MAX,
+    OPT_REPORT,
+    OPT_TIMEOUT,
+    OPT_KILL_AFTER,
+    OPT_SIGNAL,
+    OPT_SUPERVISE,
+    OPT_RESTART_DELAY,
+    OPT_RESTART_DELAY_MAX,
+    OPT_RESTART_LIMIT,
+    OPT_READY_FD,
+    OPT_BATCH,
+    OPT_JOBS,
+    OPT_OUTPUT_ORDER,
+    OPT_OUTPUT_PREFIX,
+    OPT_OUTPUT_SPILL,
+    OPT_BROADCAST_STDIN,
+    OPT_TRACE,
+    OPT_METRICS,
+    OPT_METRICS_DUMP,
+    OPT_PERF_STAT,
+    OPT_SAMPLE,
+    OPT_SAMPLE_DESCENDANTS,
+    OPT_HISTORY,
+    OPT_JOB_ORDER,
+    OPT_PRESSURE_LIMIT,
+    OPT_MEM_RESERVE,
+    OPT_JOURNAL,
+    OPT_SHARD,
 };
 
 static struct option long_options[] = {
@@ -93,13 +150,67 @@ static struct option long_options[] = {
     {"stderr",            required_argument, 0,  OPT_SET_STDERR},
     {"stderr-append",     required_argument, 0,  OPT_SET_STDERR_APPEND},
     {"stderr-new",        required_argument, 0,  OPT_SET_STDERR_NEW},
+    {"stdout-tee",        required_argument, 0,  OPT_STDOUT_TEE},
+    {"stderr-tee",        required_argument, 0,  OPT_STDERR_TEE},
+    {"stdout-compress",   required_argument, 0,  OPT_STDOUT_COMPRESS},
+    {"stderr-compress",   required_argument, 0,  OPT_STDERR_COMPRESS},
+    {"compress-threads",  required_argument, 0,  OPT_COMPRESS_THREADS},
+    {"stdout-ring",       required_argument, 0,  OPT_STDOUT_RING},
+    {"stderr-ring",       required_argument, 0,  OPT_STDERR_RING},
+    {"ring-dump",         required_argument, 0,  OPT_RING_DUMP},
     {"chdir",             required_argument, 0,  OPT_CHDIR},
     {"clearenv",          no_argument,       0,  OPT_CLEARENV},
     {"env",               required_argument, 0,  OPT_ENV},
     {"umask",             required_argument, 0,  OPT_UMASK},
     {"close-from",        required_argument, 0,  OPT_CLOSE_FROM},
+    {"readahead",         required_argument, 0,  OPT_READAHEAD},
     {"replace",           required_argument, 0,  OPT_REPLACE},
     {"encoding",          required_argument, 0,  OPT_ENCODING},
+    {"repeat",            required_argument, 0,  OPT_REPEAT},
+    {"warmup",            required_argument, 0,  OPT_WARMUP},
+    {"repeat-hook",       required_argument, 0,  OPT_REPEAT_HOOK},
+    {"repeat-format",     required_argument, 0,  OPT_REPEAT_FORMAT},
+    {"limit",             required_argument, 0,  OPT_LIMIT},
+    {"cpus",              required_argument, 0,  OPT_CPUS},
+    {"numa-node",         required_argument, 0,  OPT_NUMA_NODE},
+    {"thp",               required_argument, 0,  OPT_THP},
+    {"sched",             required_argument, 0,  OPT_SCHED},
+    {"nice",              required_argument, 0,  OPT_NICE},
+    {"ioprio",            required_argument, 0,  OPT_IOPRIO},
+    {"rlimit",            required_argument, 0,  OPT_RLIMIT},
+    {"oom-score-adj",     required_argument, 0,  OPT_OOM_SCORE_ADJ},
+    {"cgroup",            required_argument, 0,  OPT_CGROUP},
+    {"memory-max",        required_argument, 0,  OPT_MEMORY_MAX},
+    {"cpu-max",           required_argument, 0,  OPT_CPU_MAX},
+    {"io-weight",         required_argument, 0,  OPT_IO_WEIGHT},
+    {"pids-max",          required_argument, 0,  OPT_PIDS_MAX},
+    {"report",            no_argument,       0,  OPT_REPORT},
+    {"timeout",           required_argument, 0,  OPT_TIMEOUT},
+    {"kill-after",        required_argument, 0,  OPT_KILL_AFTER},
+    {"signal",            required_argument, 0,  OPT_SIGNAL},
+    {"supervise",         no_argument,       0,  OPT_SUPERVISE},
+    {"restart-delay",     required_argument, 0,  OPT_RESTART_DELAY},
+    {"restart-delay-max", required_argument, 0,  OPT_RESTART_DELAY_MAX},
+    {"restart-limit",     required_argument, 0,  OPT_RESTART_LIMIT},
+    {"ready-fd",          required_argument, 0,  OPT_READY_FD},
+    {"batch",             required_argument, 0,  OPT_BATCH},
+    {"jobs",              required_argument, 0,  OPT_JOBS},
+    {"output-order",      required_argument, 0,  OPT_OUTPUT_ORDER},
+    {"output-prefix",     required_argument, 0,  OPT_OUTPUT_PREFIX},
+    {"output-spill",      required_argument, 0,  OPT_OUTPUT_SPILL},
+    {"broadcast-stdin",   no_argument,       0,  OPT_BROADCAST_STDIN},
+    {"trace",             required_argument, 0,  OPT_TRACE},
+    {"metrics",           required_argument, 0,  OPT_METRICS},
+    {"metrics-dump",      required_argument, 0,  OPT_METRICS_DUMP},
+    {"perf-stat",         optional_argument, 0,  OPT_PERF_STAT},
+    {"sample",            required_argument, 0,  OPT_SAMPLE},
+    {"sample-descendants", no_argument,      0,  OPT_SAMPLE_DESCENDANTS},
+    {"history",           required_argument, 0,  OPT_HISTORY},
+    {"job-order",         required_argument, 0,  OPT_JOB_ORDER},
+    {"pressure-limit",    required_argument, 0,  OPT_PRESSURE_LIMIT},
+    {"mem-reserve",       required_argument, 0,  OPT_MEM_RESERVE},
+    {"journal",           required_argument, 0,  OPT_JOURNAL},
+    {"shard",             required_argument, 0,  OPT_SHARD},
     {0, 0, 0, 0 }
 };
 
@@ -118,7 +229,16 @@ static const char usage_text[] =
     "  --stderr        <filename>\n"
     "  --stderr-append <filename>\n"
     "  --stderr-new    <filename>\n"
+    "  --stdout-tee    <filename>\n"
+    "  --stderr-tee    <filename>\n"
+    "  --stdout-compress gzip[:<level>]|zstd[:<level>]\n"
+    "  --stderr-compress gzip[:<level>]|zstd[:<level>]\n"
+    "  --compress-threads <n>\n"
+    "  --stdout-ring   <filename>:<size>\n"
+    "  --stderr-ring   <filename>:<size>\n"
+    "  --ring-dump     <filename>  Write out a ring file, oldest first, and exit\n"
     "  --close-from    <fd>\n"
+    "  --readahead     <filename>|auto\n"
     "  --chdir         <directory>\n"
     "  --fork\n"
     "  --clearenv      Clear the environment\n"
@@ -126,6 +246,51 @@ static const char usage_text[] =
     "  --append-argv\n"
     "  --replace       <string>\n"
     "  --encoding      text|null|qp|xnn\n"
+    "  --repeat        <count>\n"
+    "  --warmup        <count>\n"
+    "  --repeat-hook   <program>\n"
+    "  --repeat-format text|json\n"
+    "  --limit         <key>:<slots>\n"
+    "  --cpus          <cpu-list>\n"
+    "  --numa-node     [bind:|interleave:|preferred:]<node-list>\n"
+    "  --thp           disable|enable\n"
+    "  --sched         other|batch|idle|fifo[:<prio>]|rr[:<prio>]\n"
+    "  --nice          <n>\n"
+    "  --ioprio        idle|best-effort[:<level>]|realtime[:<level>]\n"
+    "  --rlimit        <resource>=<soft>[:<hard>]\n"
+    "  --oom-score-adj <n>\n"
+    "  --cgroup        <delegated-cgroup-directory>\n"
+    "  --memory-max    <bytes>|max\n"
+    "  --cpu-max       <quota>[:<period>]|<percent>%|max\n"
+    "  --io-weight     <weight>\n"
+    "  --pids-max      <n>|max\n"
+    "  --report        Report exit status and resource usage\n"
+    "  --perf-stat[=<event>,...]  Count the child's events, for the report\n"
+    "  --sample        <interval>:<filename>  Log the child's CPU, memory, I/O as CSV\n"
+    "  --sample-descendants  Include the child's descendants in --sample\n"
+    "  --timeout       <duration>\n"
+    "  --kill-after    <duration>\n"
+    "  --signal        <signal>\n"
+    "  --supervise     Restart the program whenever it exits\n"
+    "  --restart-delay <duration>\n"
+    "  --restart-delay-max <duration>\n"
+    "  --restart-limit <count>/<duration>\n"
+    "  --ready-fd      <fd>\n"
+    "  --batch         <manifest>\n"
+    "  --jobs          <n>|auto[:<n>]\n"
+    "  --output-order  lines|job\n"
+    "  --output-prefix tag|time|tag,time|none\n"
+    "  --output-spill  <bytes>\n"
+    "  --broadcast-stdin  Give every job of a --batch the same stdin\n"
+    "  --history       <filename>  Record run times; --batch starts the longest first\n"
+    "  --job-order     file|longest|shortest\n"
+    "  --pressure-limit <percent>  With --jobs=auto, back off above this stall time\n"
+    "  --mem-reserve   <size>  With --jobs=auto, start no job below this MemAvailable\n"
+    "  --journal       <filename>  Record finished jobs; skip them when run again\n"
+    "  --shard         <i>/<n>  Run only every n'th job of a --batch, from the i'th\n"
+    "  --trace         <filename>  Write a Chrome trace of ush's own work\n"
+    "  --metrics       <filename>  Count this run in a shared metrics file\n"
+    "  --metrics-dump  <filename>  Write out a metrics file for Prometheus, and exit\n"
     ;
 
 static const char version_text[] =
@@ -216,6 +381,22 @@ getopts_init(struct _getopt_data *ctx)
     *ctx = null_getopts_data;
 }
 
+/*
+ * The long name of an option, for --trace.
+ */
+static const char *
+option_name(int optc)
+{
+    const struct option *opt;
+
+    for (opt = long_options; opt->name != NULL; ++opt) {
+        if (opt->val == optc) {
+            return (opt->name);
+        }
+    }
+    return ("?");
+}
+
 /*
  * Arguments can come from the command line of @command{ush} itself,
  * or from the script file, one argument per line.
@@ -238,7 +419,10 @@ ush_getopt(cmd_t *cmd, int argc, char **argv, bool setargv)
     int err_count;
     int optc;
     int rv;
+    bool traced;        // The begin event was written; so, write the end
 
+    traced = (trace_fd >= 0);
+    TRACE_NUM(getopt__entry, TRACE_BEGIN, "getopt", "argc", argc);
     getopts_init(&getopt_ctx);
     option_index = 0;
     err_count = 0;
@@ -247,6 +431,7 @@ ush_getopt(cmd_t *cmd, int argc, char **argv, bool setargv)
 
     while (true) {
         int this_option_optind;
+        bool opt_traced;
 
         if (err_count > 10) {
             eprintf("%s: Too many option errors.\n", program_name);
@@ -279,6 +464,13 @@ ush_getopt(cmd_t *cmd, int argc, char **argv, bool setargv)
             optc = 'h';
         }
 
+        USH_PROBE2(option__entry, optc, optarg);
+        flight_event(TRACE_BEGIN, option_name(optc), 0, optarg, 0);
+        opt_traced = (trace_fd >= 0);
+        if (opt_traced) {
+            trace_str(TRACE_BEGIN, option_name(optc), "arg", optarg);
+        }
+
         switch (optc) {
         case 'V':
             show_ush_version();
@@ -342,12 +534,175 @@ ush_getopt(cmd_t *cmd, int argc, char **argv, bool setargv)
         case OPT_SET_STDERR_NEW:
             rv = set_stderr(cmd, optarg, false, true);
             break;
+        case OPT_STDOUT_TEE:
+            rv = cmd_stdout_tee(cmd, optarg);
+            break;
+        case OPT_STDERR_TEE:
+            rv = cmd_stderr_tee(cmd, optarg);
+            break;
+        case OPT_STDOUT_COMPRESS:
+            rv = cmd_stdout_compress(cmd, optarg);
+            break;
+        case OPT_STDERR_COMPRESS:
+            rv = cmd_stderr_compress(cmd, optarg);
+            break;
+        case OPT_COMPRESS_THREADS:
+            rv = cmd_compress_threads(cmd, optarg);
+            break;
+        case OPT_STDOUT_RING:
+            rv = cmd_stdout_ring(cmd, optarg);
+            break;
+        case OPT_STDERR_RING:
+            rv = cmd_stderr_ring(cmd, optarg);
+            break;
+        case OPT_RING_DUMP:
+            exit(ring_dump(optarg, 1) ? 1 : 0);
+            break;
+        case OPT_READAHEAD:
+            rv = cmd_readahead(cmd, optarg);
+            break;
         case OPT_CLOSE_FROM:
             rv = ush_close_from(optarg);
             break;
         case OPT_REPLACE:
             replace = optarg;
             break;
+        case OPT_REPEAT:
+            rv = cmd_repeat(cmd, optarg);
+            break;
+        case OPT_WARMUP:
+            rv = cmd_warmup(cmd, optarg);
+            break;
+        case OPT_REPEAT_HOOK:
+            free(cmd->repeat_hook);
+            cmd->repeat_hook = (char *)guard_mem(strdup(optarg));
+            break;
+        case OPT_REPEAT_FORMAT:
+            rv = cmd_repeat_format(cmd, optarg);
+            break;
+        case OPT_LIMIT:
+            rv = cmd_limit(cmd, optarg);
+            break;
+        case OPT_CPUS:
+            rv = cmd_cpus(cmd, optarg);
+            break;
+        case OPT_NUMA_NODE:
+            rv = cmd_numa_node(cmd, optarg);
+            break;
+        case OPT_THP:
+            rv = cmd_thp(cmd, optarg);
+            break;
+        case OPT_SCHED:
+            rv = cmd_sched(cmd, optarg);
+            break;
+        case OPT_NICE:
+            rv = cmd_nice(cmd, optarg);
+            break;
+        case OPT_IOPRIO:
+            rv = cmd_ioprio(cmd, optarg);
+            break;
+        case OPT_RLIMIT:
+            rv = cmd_rlimit(cmd, optarg);
+            break;
+        case OPT_OOM_SCORE_ADJ:
+            rv = cmd_oom_score_adj(cmd, optarg);
+            break;
+        case OPT_CGROUP:
+            rv = cmd_cgroup(cmd, optarg);
+            break;
+        case OPT_MEMORY_MAX:
+            rv = cmd_memory_max(cmd, optarg);
+            break;
+        case OPT_CPU_MAX:
+            rv = cmd_cpu_max(cmd, optarg);
+            break;
+        case OPT_IO_WEIGHT:
+            rv = cmd_io_weight(cmd, optarg);
+            break;
+        case OPT_PIDS_MAX:
+            rv = cmd_pids_max(cmd, optarg);
+            break;
+        case OPT_REPORT:
+            cmd->report = true;
+            break;
+        case OPT_TIMEOUT:
+            rv = cmd_timeout(cmd, optarg);
+            break;
+        case OPT_KILL_AFTER:
+            rv = cmd_kill_after(cmd, optarg);
+            break;
+        case OPT_SIGNAL:
+            rv = cmd_signal(cmd, optarg);
+            break;
+        case OPT_SUPERVISE:
+            rv = cmd_supervise(cmd);
+            break;
+        case OPT_RESTART_DELAY:
+            rv = cmd_restart_delay(cmd, optarg);
+            break;
+        case OPT_RESTART_DELAY_MAX:
+            rv = cmd_restart_delay_max(cmd, optarg);
+            break;
+        case OPT_RESTART_LIMIT:
+            rv = cmd_restart_limit(cmd, optarg);
+            break;
+        case OPT_READY_FD:
+            rv = cmd_ready_fd(cmd, optarg);
+            break;
+        case OPT_BATCH:
+            rv = cmd_batch(cmd, optarg);
+            break;
+        case OPT_JOBS:
+            rv = cmd_jobs(cmd, optarg);
+            break;
+        case OPT_OUTPUT_ORDER:
+            rv = cmd_output_order(cmd, optarg);
+            break;
+        case OPT_OUTPUT_PREFIX:
+            rv = cmd_output_prefix(cmd, optarg);
+            break;
+        case OPT_OUTPUT_SPILL:
+            rv = cmd_output_spill(cmd, optarg);
+            break;
+        case OPT_BROADCAST_STDIN:
+            rv = cmd_broadcast_stdin(cmd);
+            break;
+        case OPT_TRACE:
+            rv = cmd_trace(cmd, optarg);
+            break;
+        case OPT_METRICS:
+            rv = cmd_metrics(cmd, optarg);
+            break;
+        case OPT_METRICS_DUMP:
+            exit(metrics_dump(optarg) ? 1 : 0);
+            break;
+        case OPT_PERF_STAT:
+            rv = cmd_perf_stat(cmd, optarg);
+            break;
+        case OPT_SAMPLE:
+            rv = cmd_sample(cmd, optarg);
+            break;
+        case OPT_SAMPLE_DESCENDANTS:
+            rv = cmd_sample_descendants(cmd);
+            break;
+        case OPT_HISTORY:
+            rv = cmd_history(cmd, optarg);
+            break;
+        case OPT_JOB_ORDER:
+            rv = cmd_job_order(cmd, optarg);
+            break;
+        case OPT_PRESSURE_LIMIT:
+            rv = cmd_pressure_limit(cmd, optarg);
+            break;
+        case OPT_MEM_RESERVE:
+            rv = cmd_mem_reserve(cmd, optarg);
+            break;
+        case OPT_JOURNAL:
+            rv = cmd_journal(cmd, optarg);
+            break;
+        case OPT_SHARD:
+            rv = cmd_shard(cmd, optarg);
+            break;
         case '?':
             eprint(program_name);
             eprint(": ");
@@ -374,11 +729,21 @@ ush_getopt(cmd_t *cmd, int argc, char **argv, bool setargv)
             break;
         }
 
+        USH_PROBE2(option__return, optc, rv);
+        flight_event(TRACE_END, option_name(optc), 0, NULL, rv);
+        if (opt_traced) {
+            trace_num(TRACE_END, option_name(optc), "rv", rv);
+        }
         if (rv) {
             ++err_count;
         }
     }
 
+    USH_PROBE1(getopt__return, err_count);
+    flight_event(TRACE_END, "getopt", err_count, NULL, 0);
+    if (traced) {
+        trace_num(TRACE_END, "getopt", "errors", err_count);
+    }
     if (err_count) {
         return (err_count);
     }
@@ -397,12 +762,61 @@ ush_getopt(cmd_t *cmd, int argc, char **argv, bool setargv)
     return (0);
 }
 
-int
-ush_argv(int argc, char **argv)
+/**
+ * @brief Free the copies of option arguments kept in a command.
+ *
+ * @param cmd  IN  Command "object"
+ *
+ * An option argument that is used after option parsing is done
+ * must be copied.  In a script, it lives in the line buffer,
+ * which is freed before the next line is read.
+ *
+ */
+void
+cmd_free_args(cmd_t *cmd)
+{
+    free(cmd->repeat_hook);
+    cmd->repeat_hook = NULL;
+    free(cmd->limit_key);
+    cmd->limit_key = NULL;
+    free(cmd->cgroup_parent);
+    cmd->cgroup_parent = NULL;
+    free(cmd->cgroup_memory_max);
+    cmd->cgroup_memory_max = NULL;
+    free(cmd->cgroup_pids_max);
+    cmd->cgroup_pids_max = NULL;
+    free(cmd->batch_manifest);
+    cmd->batch_manifest = NULL;
+    free(cmd->history_file);
+    cmd->history_file = NULL;
+    free(cmd->journal_file);
+    cmd->journal_file = NULL;
+}
+
+static int
+ush_argv_io(int argc, char **argv, ush_io_t *io)
 {
     int rv;
     set_print_fh();
 
+    // Library callers can call more than once.
+    // Start each time from a clean slate.
+    //
+    memset(cmd, 0, sizeof (*cmd));
+    verbose = false;
+    debug = false;
+    opt_append_argv = false;
+    script_encoding = ENC_TEXT;
+    replace = NULL;
+    opt_command = false;
+    opt_show_argv = false;
+
+    // With in-memory I/O, --stdin, --stdout and --stderr are for
+    // the child only; see set_stdin() and set_write_fd().
+    //
+    cmd->io = io;
+    cmd->start_ns = mono_ns();
+
     // Make it easy to set --debug and --verbose options via the environment,
     // So that it is less likely that options for @command{ush} itself are
     // not confused with options to be passed to the program to be executed.
@@ -413,15 +827,43 @@ ush_argv(int argc, char **argv)
     if (getenv("USH_VERBOSE") != NULL) {
         verbose = true;
     }
+    if (trace_fd < 0 && getenv("USH_TRACE") != NULL) {
+        trace_open(getenv("USH_TRACE"));
+    }
+    if (getenv("USH_METRICS") != NULL) {
+        cmd_metrics(cmd, getenv("USH_METRICS"));
+        cmd->ioerr = 0;
+    }
 
     rv = ush_getopt(cmd, argc, argv, true);
 
     if (rv != 0) {
+        if (cmd->ioerr) {
+            flight_user_fail("an option failed", cmd->ioerr, verbose);
+        }
         usage();
         exit(1);
     }
 
-    if (cmd->argc == 0) {
+    if (cmd->batch_manifest != NULL && cmd->argc != 0) {
+        eprintf("%s: --batch takes its commands from the manifest.\n", program_name);
+        usage();
+        exit(2);
+    }
+
+    if (cmd->broadcast_stdin && cmd->batch_manifest == NULL) {
+        eprintf("%s: --broadcast-stdin is only for --batch.\n", program_name);
+        usage();
+        exit(2);
+    }
+
+    if ((cmd->journal_file != NULL || cmd->shard_count != 0) && cmd->batch_manifest == NULL) {
+        eprintf("%s: --journal and --shard are only for --batch.\n", program_name);
+        usage();
+        exit(2);
+    }
+
+    if (cmd->argc == 0 && cmd->batch_manifest == NULL) {
         eprintf("%s: Must supply at least a command name.\n", program_name);
         usage();
         exit(2);
@@ -432,10 +874,25 @@ ush_argv(int argc, char **argv)
     }
 
     if (cmd->ioerr) {
+        flight_user_fail("an option failed", cmd->ioerr, verbose);
         exit(2);
     }
 
-    if (opt_command) {
+    // In-memory I/O can only be done for a child process.
+    //
+    if (io != NULL) {
+        cmd->cmd_fork = true;
+        rv = io_memfd_open(cmd, io);
+        if (rv != 0) {
+            cmd_free_args(cmd);
+            return (rv);
+        }
+    }
+
+    if (cmd->batch_manifest != NULL) {
+        cmd->child_status = run_batch(cmd);
+    }
+    else if (opt_command) {
         cmd->child_status = run_program(cmd);
     }
     else {
@@ -443,6 +900,10 @@ ush_argv(int argc, char **argv)
         cmd->child_status = run_interpret_xfname(cmd, cmd->argv[0]);
     }
     dbg_printf("child status=%d\n", cmd->child_status);
+    if (io != NULL) {
+        io_memfd_collect(cmd);
+    }
+    cmd_free_args(cmd);
     if (cmd->cmd_fork) {
         return (WEXITSTATUS(cmd->child_status));
     }
@@ -451,6 +912,20 @@ ush_argv(int argc, char **argv)
     }
 }
 
+int
+ush_argv(int argc, char **argv)
+{
+    int rv;
+
+    // With a spawn helper, the whole command is run from there.
+    // If the helper has gone away, run it here, as usual.
+    //
+    if (helper_running() && helper_argv(argc, argv, &rv) == 0) {
+        return (rv);
+    }
+    return (ush_argv_io(argc, argv, NULL));
+}
+
 /*
  * A call to ush_argv() has a complete argv[] including the
  * program name.  So, it can use getopt logic to parse all options.
@@ -484,3 +959,36 @@ ush(int argc, char **argv)
     free(cmd_argv);
     return (rv);
 }
+
+/**
+ * @brief Like ush(), but with stdin, stdout and stderr in memory.
+ *
+ * @param argc  IN      Count of arguments
+ * @param argv  IN      Options, then the program and its arguments
+ * @param io    IN/OUT  Buffer for stdin, which output to capture,
+ *                      and, on return, the captured output
+ * @return the exit status of the program, as for ush()
+ *
+ * The program is always run as a child process, as if with --fork.
+ * No temporary files are used, and the file descriptors of the
+ * calling process are left alone.  Give back the captured output
+ * with ush_io_free().
+ *
+ */
+int
+ush_io(int argc, char **argv, ush_io_t *io)
+{
+    char **cmd_argv;
+    size_t cmd_argv_sz;
+    int rv;
+    char ush_path[] = "ush";
+
+    set_print_fh();
+    cmd_argv_sz = (argc + 2) * sizeof (char *);
+    cmd_argv = (char **)guard_malloc(cmd_argv_sz);
+    cmd_argv[0] = ush_path;
+    memcpy(cmd_argv + 1, argv, (argc + 1) * sizeof (char *));
+    rv = ush_argv_io(argc + 1, cmd_argv, io);
+    free(cmd_argv);
+    return (rv);
+}